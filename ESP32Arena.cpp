@@ -0,0 +1,50 @@
+#include "ESP32Arena.h"
+#include <string.h>
+
+// in the order of Esp32Arena::Region
+static const char* const s_regions[] = { "rx", "cmd", "trace" };
+
+Esp32Arena::Esp32Arena()
+{
+	reset(NULL, 0);
+}
+
+void Esp32Arena::reset(void* base, size_t size)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_top = 0;
+	m_base = NULL;
+	if (base == NULL)
+		return;
+	size_t skip = (ALIGN - (uintptr_t)base % ALIGN) % ALIGN;
+	if (size <= skip)
+		return;
+	m_base = (uint8_t*)base + skip;
+	m_stats.size = size - skip;
+	m_stats.free = m_stats.size;
+}
+
+void* Esp32Arena::alloc(size_t size, Region region)
+{
+	size = WIFI_ARENA_ALIGN(size);
+	if (m_base == NULL || size > m_stats.free)
+	{
+		m_stats.refused += size;
+		return NULL;
+	}
+	void* p = m_base + m_top;
+	m_top += size;
+	m_stats.used[region] += size;
+	m_stats.free -= size;
+	return p;
+}
+
+const Esp32Arena::ArenaStats& Esp32Arena::getStats(void)
+{
+	return m_stats;
+}
+
+const char* Esp32Arena::regionName(Region region)
+{
+	return region < REGION_MAX ? s_regions[region] : "?";
+}
@@ -0,0 +1,46 @@
+// Memory given to the ESP32 AT driver by the application
+
+
+#ifndef _ESP32ARENA_h
+#define _ESP32ARENA_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WIFI_ARENA_ALIGN(n) (((size_t)(n) + 7) & ~(size_t)7)
+
+// one block of memory the driver carves its buffers from, in internal SRAM,
+// external SRAM or a linker section of the application's choice. Buffers are
+// taken front to back, charged to the subsystem that asked, and only given
+// back all together by reset()
+class Esp32Arena
+{
+public:
+	const static size_t ALIGN = 8;
+
+	enum Region {
+		REGION_RX, // receive ring
+		REGION_CMD, // AT command line
+		REGION_TRACE, // event trace, WIFI_TRACE only
+		REGION_MAX
+	};
+	typedef struct _ARENA_STATS {
+		size_t size; // usable, from the first aligned byte
+		size_t used[REGION_MAX];
+		size_t free;
+		size_t refused; // asked for and not given
+	} ArenaStats;
+
+	Esp32Arena();
+	void reset(void* base, size_t size); // NULL leaves nothing to give
+	void* alloc(size_t size, Region region); // aligned to ALIGN, NULL if it does not fit
+	const ArenaStats& getStats(void);
+	static const char* regionName(Region region);
+
+private:
+	uint8_t* m_base;
+	size_t m_top;
+	ArenaStats m_stats;
+};
+
+#endif
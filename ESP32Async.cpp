@@ -0,0 +1,305 @@
+#include "ESP32Async.h"
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+
+// the queue and wake flags use sequentially consistent operations: a thread
+// that finds a wake flag already set relies on the consumer clearing it only
+// before its next pop(), which then sees the link stored by push()
+
+Esp32Queue::Esp32Queue()
+	: m_head(&m_stub)
+	, m_tail(&m_stub)
+{
+	m_stub.next = NULL;
+}
+
+void Esp32Queue::push(AsyncRequest* r)
+{
+	r->next = NULL;
+	AsyncRequest* prev = m_head.exchange(r);
+	prev->next = r;
+}
+
+AsyncRequest* Esp32Queue::pop(void)
+{
+	AsyncRequest* tail = m_tail;
+	AsyncRequest* next = tail->next;
+	if (tail == &m_stub)
+	{
+		if (next == NULL)
+			return NULL;
+		m_tail = next;
+		tail = next;
+		next = next->next;
+	}
+	if (next != NULL)
+	{
+		m_tail = next;
+		return tail;
+	}
+	if (tail != m_head)
+		return NULL; // a push is half done
+	// tail is the last one, the stub goes behind it so tail can be handed out
+	push(&m_stub);
+	next = tail->next;
+	if (next == NULL)
+		return NULL;
+	m_tail = next;
+	return tail;
+}
+
+bool Esp32Queue::busy(void)
+{
+	return m_tail->next == NULL && m_tail != m_head;
+}
+
+Esp32Completions::Esp32Completions()
+{
+#ifdef __linux__
+	m_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_wakePending = false;
+#endif
+}
+
+#ifdef __linux__
+Esp32Completions::~Esp32Completions()
+{
+	if (m_fd != -1)
+		close(m_fd);
+}
+
+AsyncRequest* Esp32Completions::wait(int timeout_ms)
+{
+	while (true)
+	{
+		AsyncRequest* r = m_queue.pop();
+		if (r != NULL)
+			return r;
+		// clear before looking again so a completion from now on signals m_fd
+		m_wakePending = false;
+		r = m_queue.pop();
+		if (r != NULL)
+			return r;
+		struct pollfd p;
+		p.fd = m_fd;
+		p.events = POLLIN;
+		p.revents = 0;
+		if (poll(&p, 1, timeout_ms) <= 0)
+			return NULL;
+		uint64_t count;
+		if (read(m_fd, &count, sizeof(count)) != sizeof(count))
+			return NULL;
+	}
+}
+
+int Esp32Completions::fd(void)
+{
+	return m_fd;
+}
+#endif
+
+AsyncRequest* Esp32Completions::pop(void)
+{
+	return m_queue.pop();
+}
+
+void Esp32Completions::complete(AsyncRequest* r)
+{
+	m_queue.push(r);
+#ifdef __linux__
+	uint64_t one = 1;
+	if (!m_wakePending.exchange(true) && write(m_fd, &one, sizeof(one)) != sizeof(one))
+		m_wakePending = false;
+#endif
+}
+
+Esp32Async::Esp32Async(Esp32& esp)
+	: m_esp(esp)
+	, m_pending(NULL)
+	, m_current(NULL)
+	, m_receiver(NULL)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+#ifdef __linux__
+	m_wakePending = false;
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wakeFd != -1)
+		m_esp.setEventFd(m_wakeFd);
+#endif
+}
+
+#ifdef __linux__
+Esp32Async::~Esp32Async()
+{
+	if (m_wakeFd != -1)
+		close(m_wakeFd);
+}
+#endif
+
+bool Esp32Async::submit(AsyncRequest* r)
+{
+	if (r == NULL || r->completions == NULL)
+		return false;
+	if (r->op != ASYNC_CONNECT_POOLED && (r->link_id < 0 || r->link_id >= Esp32::LINK_MAX))
+		return false;
+	m_submitted.push(r);
+	wake();
+	return true;
+}
+
+void Esp32Async::wake(void)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+	if (!m_wakePending.exchange(true) && write(m_wakeFd, &one, sizeof(one)) != sizeof(one))
+		m_wakePending = false;
+#else
+	m_esp.notifyRxReady(); // safe from any thread, like from the UART interrupt
+#endif
+}
+
+void Esp32Async::setReceiver(IWifi* receiver)
+{
+	m_receiver = receiver;
+}
+
+const Esp32Async::AsyncStats& Esp32Async::getStats(void)
+{
+	return m_stats;
+}
+
+void Esp32Async::loop(void)
+{
+#ifdef __linux__
+	// clear before draining so a submit from now on signals again
+	m_wakePending = false;
+	uint64_t count;
+	while (read(m_wakeFd, &count, sizeof(count)) == sizeof(count))
+	{
+	}
+#endif
+	if (m_current != NULL)
+	{
+		// a close is not answered by a callback, nor is a single send whose payload timed out
+		if (m_esp.isBusy() || (m_current->op != ASYNC_SEND && m_current->op != ASYNC_CLOSE))
+			return;
+		if (m_current->op == ASYNC_SEND)
+			finish(Esp32::RESPONSE_TIMEOUT);
+		else
+			finish(m_esp.isConnected(m_current->link_id) ? Esp32::RESPONSE_UNKNOWN_ERROR : Esp32::RESPONSE_OK);
+	}
+	while (m_current == NULL)
+	{
+		bool fresh = m_pending == NULL;
+		if (fresh)
+		{
+			m_pending = m_submitted.pop();
+			if (m_pending == NULL)
+				break;
+			m_stats.requests++;
+		}
+		if (!issue(m_pending))
+		{
+			if (fresh)
+				m_stats.deferred++;
+			break;
+		}
+		m_pending = NULL;
+	}
+	// a submitter stopped halfway hides what follows, come back without sleeping
+	if (m_pending == NULL && m_current == NULL && m_submitted.busy())
+		wake();
+}
+
+bool Esp32Async::issue(AsyncRequest* r)
+{
+	bool ok = false;
+	m_current = r;
+	switch (r->op)
+	{
+	case ASYNC_SEND:
+		ok = m_esp.sendBytesMUX(this, r->link_id, (byte*)r->data, r->size, r->remote_ip, r->remote_port);
+		break;
+	case ASYNC_CONNECT:
+		if (r->type == Esp32::TCP)
+			ok = m_esp.TCPConnectMUX(this, r->link_id, r->remote_ip, r->remote_port);
+		else if (r->type == Esp32::UDP)
+			ok = m_esp.UDPConnectMUX(this, r->link_id, r->remote_ip, r->remote_port);
+		else
+			ok = m_esp.SSLConnectMUX(this, r->link_id, r->remote_ip, r->remote_port);
+		break;
+	case ASYNC_CONNECT_POOLED:
+		if (m_esp.isBusy())
+			break;
+		r->link_id = m_esp.connectPooled(this, r->type, r->remote_ip, r->remote_port);
+		if (r->link_id == -1)
+		{
+			finish(Esp32::RESPONSE_BUSY); // no link left in the pool
+			return true;
+		}
+		ok = true;
+		break;
+	case ASYNC_RELEASE:
+		m_esp.releaseLink(r->link_id);
+		finish(Esp32::RESPONSE_OK);
+		return true;
+	case ASYNC_CLOSE:
+		ok = m_esp.closeConnect(this, r->link_id);
+		break;
+	}
+	if (!ok)
+		m_current = NULL;
+	return ok;
+}
+
+void Esp32Async::finish(Esp32::ResponseType state)
+{
+	AsyncRequest* r = m_current;
+	m_current = NULL;
+	r->result = state;
+	m_stats.completed++;
+	r->completions->complete(r); // owned by the submitting thread from here
+}
+
+void Esp32Async::cbSend(Esp32::ResponseType state)
+{
+	if (m_current != NULL && m_current->op == ASYNC_SEND)
+		finish(state);
+}
+
+void Esp32Async::cbTCPConnect(Esp32::ResponseType state)
+{
+	if (m_current != NULL && (m_current->op == ASYNC_CONNECT || m_current->op == ASYNC_CONNECT_POOLED))
+		finish(state);
+}
+
+void Esp32Async::cbUDPConnect(Esp32::ResponseType state)
+{
+	cbTCPConnect(state);
+}
+
+void Esp32Async::cbSSLConnect(Esp32::ResponseType state, int link_id, bool already_open)
+{
+	cbTCPConnect(state);
+}
+
+void Esp32Async::cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end)
+{
+	if (m_receiver != NULL)
+		m_receiver->cbReceivedData(link_id, buffer, begin, end);
+}
+
+void Esp32Async::cbReceivedDirect(int link_id, byte* buffer, size_t size)
+{
+	if (m_receiver != NULL)
+		m_receiver->cbReceivedDirect(link_id, buffer, size);
+}
+
+void Esp32Async::cbLinkClosed(int link_id)
+{
+	if (m_receiver != NULL)
+		m_receiver->cbLinkClosed(link_id);
+}
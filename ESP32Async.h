@@ -0,0 +1,141 @@
+// Multi-threaded command submission for the ESP32 AT driver
+
+
+#ifndef _ESP32ASYNC_h
+#define _ESP32ASYNC_h
+
+#include "ESP32WROOM.h"
+#include <atomic>
+
+class Esp32Completions;
+
+enum AsyncOp {
+	ASYNC_SEND, // data, size on link_id, remote_ip 0 for the peer of the link
+	ASYNC_CONNECT, // type on link_id
+	ASYNC_CONNECT_POOLED, // type, link_id is set by the driver
+	ASYNC_RELEASE, // back to the pool, no command
+	ASYNC_CLOSE
+};
+
+// filled by the submitting thread and owned by the driver until it comes back
+// through its completion queue
+typedef struct _ASYNC_REQUEST {
+	AsyncOp op;
+	Esp32::ConnType type;
+	int link_id;
+	uint32_t remote_ip;
+	uint16_t remote_port;
+	const byte* data; // must stay valid until the request comes back
+	size_t size;
+	Esp32::ResponseType result;
+	Esp32Completions* completions;
+	void* context; // for the application
+	std::atomic<struct _ASYNC_REQUEST*> next; // queue link
+} AsyncRequest;
+
+// intrusive multi-producer single-consumer FIFO. push() is one exchange and one
+// store from any thread, pop() is for the consumer only and never blocks. A
+// producer stopped between its two steps hides the requests pushed after it
+// until it goes on, pop() then returns NULL and busy() tells why
+class Esp32Queue
+{
+public:
+	Esp32Queue();
+	void push(AsyncRequest* r);
+	AsyncRequest* pop(void);
+	bool busy(void); // a push is half done
+
+private:
+	std::atomic<AsyncRequest*> m_head; // last pushed
+	AsyncRequest* m_tail; // next to pop
+	AsyncRequest m_stub;
+};
+
+// where finished requests of one thread come back, filled by the I/O thread
+// and emptied by the thread that owns it
+class Esp32Completions
+{
+public:
+	Esp32Completions();
+#ifdef __linux__
+	~Esp32Completions();
+	AsyncRequest* wait(int timeout_ms); // next finished request, NULL on timeout, -1 waits forever
+	int fd(void); // readable when wait() would not block, for the thread's own poll loop
+#endif
+	AsyncRequest* pop(void); // NULL if none
+	void complete(AsyncRequest* r); // I/O thread only
+
+private:
+	Esp32Queue m_queue;
+#ifdef __linux__
+	int m_fd;
+	std::atomic<bool> m_wakePending; // m_fd is signalled and not drained yet
+#endif
+};
+
+// lets any thread drive one module. Threads submit requests, the I/O thread that
+// owns the serial port calls Esp32::loop() and then loop() here, which issues the
+// requests one at a time in submission order and hands each back to the
+// completion queue it names. The Esp32 API itself stays single-threaded, only
+// the I/O thread may call it
+class Esp32Async : public IWifi
+{
+public:
+	typedef struct _ASYNC_STATS {
+		uint32_t requests; // taken off the submission queue
+		uint32_t completed;
+		uint32_t deferred; // waited for the command slot or the send window
+	} AsyncStats;
+
+	Esp32Async(Esp32& esp);
+#ifdef __linux__
+	~Esp32Async();
+#endif
+	// any thread. False if the request has no completion queue. Wakes the I/O thread
+	// in Esp32::waitEvent()
+	bool submit(AsyncRequest* r);
+	// data and closes of the links used here are passed on from the I/O thread, NULL to drop them
+	void setReceiver(IWifi* receiver);
+	void loop(void); // I/O thread, after Esp32::loop()
+	const AsyncStats& getStats(void);
+
+	// IWifi, on the I/O thread
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end);
+	void cbReceivedDirect(int link_id, byte* buffer, size_t size);
+	void cbSend(Esp32::ResponseType state);
+	void cbTCPConnect(Esp32::ResponseType state);
+	void cbUDPConnect(Esp32::ResponseType state);
+	void cbSSLConnect(Esp32::ResponseType state, int link_id, bool already_open);
+	void cbLinkClosed(int link_id);
+
+private:
+	Esp32& m_esp;
+	Esp32Queue m_submitted;
+	AsyncRequest* m_pending; // taken off the queue, waiting for the command slot
+	AsyncRequest* m_current; // in flight
+	IWifi* m_receiver;
+	AsyncStats m_stats;
+#ifdef __linux__
+	int m_wakeFd;
+	std::atomic<bool> m_wakePending; // m_wakeFd is signalled and not drained yet
+#endif
+
+	bool issue(AsyncRequest* r);
+	void finish(Esp32::ResponseType state);
+	void wake(void);
+};
+
+#endif
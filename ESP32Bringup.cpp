@@ -0,0 +1,277 @@
+#include "ESP32Bringup.h"
+
+// the driver answers from inside Esp32::loop() before it frees the command
+// slot, so the callbacks only pick the next step and loop() issues it
+
+Esp32Bringup::Esp32Bringup(Esp32& esp)
+	: m_esp(esp)
+	, m_handler(NULL)
+	, m_step(STEP_IDLE)
+	, m_issued(false)
+	, m_start(0)
+	, m_phaseStart(0)
+	, m_result(Esp32::RESPONSE_OK)
+	, m_staIP(0)
+{
+	memset(&m_config, 0, sizeof(m_config));
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_stats.failed = PHASE_MAX;
+}
+
+bool Esp32Bringup::start(IBringup* handler, const BringupConfig& config)
+{
+	if (m_step != STEP_IDLE || handler == NULL)
+		return false;
+	m_handler = handler;
+	m_config = config;
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_stats.failed = PHASE_MAX;
+	m_start = m_esp.getClock().micros();
+	m_phaseStart = m_start;
+	if (config.reset)
+		next(STEP_RESET);
+	else
+	{
+		m_stats.skipped |= 1 << PHASE_RESET;
+		next(STEP_GETMODE);
+	}
+	loop();
+	return true;
+}
+
+void Esp32Bringup::loop(void)
+{
+	if (m_step == STEP_IDLE || m_issued || m_esp.isBusy())
+		return;
+	if (m_step == STEP_DONE)
+	{
+		m_step = STEP_IDLE;
+		m_handler->cbBringupDone(m_result, m_staIP);
+		return;
+	}
+	// a query the driver answers from its state snapshot calls back before
+	// issue() returns and has already moved on to the next step
+	m_issued = true;
+	if (!issue())
+		m_issued = false;
+}
+
+bool Esp32Bringup::isRunning(void)
+{
+	return m_step != STEP_IDLE;
+}
+
+const Esp32Bringup::BringupStats& Esp32Bringup::getStats(void)
+{
+	return m_stats;
+}
+
+bool Esp32Bringup::issue(void)
+{
+	bool ok = false;
+	bool query = false;
+	switch (m_step)
+	{
+	case STEP_RESET:
+		ok = m_esp.reset(this);
+		break;
+	case STEP_GETMODE:
+		ok = m_esp.getMode(this);
+		query = true;
+		break;
+	case STEP_SETMODE:
+		ok = m_esp.setMode(this, m_config.mode, false);
+		break;
+	case STEP_GETMUX:
+		ok = m_esp.getMUX(this);
+		query = true;
+		break;
+	case STEP_SETMUX:
+		ok = m_esp.setMUX(this, m_config.mux);
+		break;
+	case STEP_GETAP:
+		ok = m_esp.getAP(this);
+		query = true;
+		break;
+	case STEP_JOIN:
+		ok = m_esp.connectAP(this, m_config.ssid, m_config.pwd, m_config.bssid, false);
+		break;
+	case STEP_GETIP:
+		ok = m_esp.getIP(this);
+		query = true;
+		break;
+	default:
+		break;
+	}
+	if (ok && query)
+		m_stats.queries++;
+	else if (ok)
+		m_stats.commands++;
+	return ok;
+}
+
+void Esp32Bringup::next(Step step)
+{
+	m_step = step;
+	m_issued = false;
+}
+
+void Esp32Bringup::endPhase(Phase phase, bool skipped)
+{
+	uint32_t now = m_esp.getClock().micros();
+	m_stats.phase_time[phase] += now - m_phaseStart;
+	m_phaseStart = now;
+	if (skipped)
+		m_stats.skipped |= 1 << phase;
+}
+
+void Esp32Bringup::afterMUX(void)
+{
+	if (m_config.ssid != NULL && (m_config.mode & Esp32::MODE_STATION) != 0)
+	{
+		// AT+CWJAP? is only compared by SSID, which does not tell the pinned AP
+		// from another one of the same network
+		next(m_config.bssid != NULL ? STEP_JOIN : STEP_GETAP);
+		return;
+	}
+	endPhase(PHASE_JOIN, true);
+	endPhase(PHASE_IP, true);
+	finish(Esp32::RESPONSE_OK, 0);
+}
+
+void Esp32Bringup::finish(Esp32::ResponseType result, uint32_t sta_ip)
+{
+	m_stats.total = m_esp.getClock().micros() - m_start;
+	m_result = result;
+	m_staIP = sta_ip;
+	next(STEP_DONE);
+	WIFI_DEBUG_printf("\r\nbringup %d\t%u us, reset %u mode %u mux %u join %u ip %u, skipped %02x\r\n", result,
+		m_stats.total, m_stats.phase_time[PHASE_RESET], m_stats.phase_time[PHASE_MODE], m_stats.phase_time[PHASE_MUX],
+		m_stats.phase_time[PHASE_JOIN], m_stats.phase_time[PHASE_IP], m_stats.skipped);
+}
+
+void Esp32Bringup::fail(Phase phase, Esp32::ResponseType result)
+{
+	endPhase(phase, false);
+	m_stats.failed = phase;
+	finish(result == Esp32::RESPONSE_OK ? Esp32::RESPONSE_UNKNOWN_ERROR : result, 0);
+}
+
+void Esp32Bringup::cbReset(Esp32::ResponseType state)
+{
+	if (m_step != STEP_RESET)
+		return;
+	if (state != Esp32::RESPONSE_OK)
+	{
+		fail(PHASE_RESET, state);
+		return;
+	}
+	endPhase(PHASE_RESET, false);
+	next(STEP_GETMODE);
+}
+
+void Esp32Bringup::cbGetMode(Esp32::ResponseType state, int mode)
+{
+	if (m_step != STEP_GETMODE)
+		return;
+	if (state != Esp32::RESPONSE_OK)
+	{
+		fail(PHASE_MODE, state);
+		return;
+	}
+	if (mode == m_config.mode)
+	{
+		endPhase(PHASE_MODE, true);
+		next(STEP_GETMUX);
+	}
+	else
+		next(STEP_SETMODE);
+}
+
+void Esp32Bringup::cbSetMode(Esp32::ResponseType state)
+{
+	if (m_step != STEP_SETMODE)
+		return;
+	if (state != Esp32::RESPONSE_OK)
+	{
+		fail(PHASE_MODE, state);
+		return;
+	}
+	endPhase(PHASE_MODE, false);
+	next(STEP_GETMUX);
+}
+
+void Esp32Bringup::cbGetMUX(Esp32::ResponseType state, bool isMUX)
+{
+	if (m_step != STEP_GETMUX)
+		return;
+	if (state != Esp32::RESPONSE_OK)
+	{
+		fail(PHASE_MUX, state);
+		return;
+	}
+	if (isMUX == m_config.mux)
+	{
+		endPhase(PHASE_MUX, true);
+		afterMUX();
+	}
+	else
+		next(STEP_SETMUX);
+}
+
+void Esp32Bringup::cbSetMUX(Esp32::ResponseType state)
+{
+	if (m_step != STEP_SETMUX)
+		return;
+	if (state != Esp32::RESPONSE_OK)
+	{
+		fail(PHASE_MUX, state);
+		return;
+	}
+	endPhase(PHASE_MUX, false);
+	afterMUX();
+}
+
+void Esp32Bringup::cbGetAP(Esp32::ResponseType state, const char ssid[])
+{
+	if (m_step != STEP_GETAP)
+		return;
+	if (state != Esp32::RESPONSE_OK)
+	{
+		fail(PHASE_JOIN, state);
+		return;
+	}
+	if (strcmp(ssid, m_config.ssid) == 0) // already joined, the module keeps its address
+	{
+		endPhase(PHASE_JOIN, true);
+		next(STEP_GETIP);
+	}
+	else
+		next(STEP_JOIN);
+}
+
+void Esp32Bringup::cbConnectAP(Esp32::ResponseType state)
+{
+	if (m_step != STEP_JOIN)
+		return;
+	if (state != Esp32::RESPONSE_OK)
+	{
+		fail(PHASE_JOIN, state == Esp32::RESPONSE_UNKNOWN_ERROR ? Esp32::RESPONSE_CONNECTAP_FAIL : state);
+		return;
+	}
+	endPhase(PHASE_JOIN, false);
+	next(STEP_GETIP);
+}
+
+void Esp32Bringup::cbGetIP(Esp32::ResponseType state, uint32_t AP_IP, uint32_t STA_IP)
+{
+	if (m_step != STEP_GETIP)
+		return;
+	if (state != Esp32::RESPONSE_OK || STA_IP == 0)
+	{
+		fail(PHASE_IP, state);
+		return;
+	}
+	endPhase(PHASE_IP, false);
+	finish(Esp32::RESPONSE_OK, STA_IP);
+}
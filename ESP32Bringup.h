@@ -0,0 +1,109 @@
+// Bring-up of the module from power on to a joined station for the ESP32 AT driver
+
+
+#ifndef _ESP32BRINGUP_h
+#define _ESP32BRINGUP_h
+
+#include "ESP32WROOM.h"
+
+class IBringup
+{
+public:
+	// RESPONSE_OK once the module is as configured, sta_ip is 0 if no AP was asked
+	// for. The time spent per phase is in Esp32Bringup::getStats()
+	virtual void cbBringupDone(Esp32::ResponseType result, uint32_t sta_ip) = 0;
+};
+
+// takes the module to the state of a BringupConfig with as few round trips as it
+// can. The mode, MUX and joined AP are queried and only what differs is set,
+// with the _CUR commands so nothing is written to the flash of the module. The
+// driver must not be given other commands until cbBringupDone
+class Esp32Bringup : public IWifi
+{
+public:
+	enum Phase {
+		PHASE_RESET = 0, // AT+RST until "ready", only if asked for
+		PHASE_MODE, // AT+CWMODE? and AT+CWMODE_CUR
+		PHASE_MUX, // AT+CIPMUX? and AT+CIPMUX
+		PHASE_JOIN, // AT+CWJAP? and AT+CWJAP_CUR
+		PHASE_IP, // AT+CIFSR, the station has its address
+		PHASE_MAX
+	};
+	typedef struct _BRINGUP_CONFIG {
+		bool reset; // restart the module first, otherwise it is taken as it is
+		Esp32::WifiMode mode;
+		bool mux;
+		const char* ssid; // NULL to join no AP, the strings must stay valid until done
+		const char* pwd;
+		const char* bssid; // NULL for any, otherwise the AP is always joined again
+	} BringupConfig;
+	typedef struct _BRINGUP_STATS {
+		uint32_t phase_time[PHASE_MAX]; // us, the phases follow each other so they add up to total
+		uint32_t total; // us, from start() to cbBringupDone
+		uint8_t queries;
+		uint8_t commands; // sent to change something
+		uint8_t skipped; // 1 << Phase for each phase found as configured or not needed
+		Phase failed; // PHASE_MAX if none
+	} BringupStats;
+
+	Esp32Bringup(Esp32& esp);
+	bool start(IBringup* handler, const BringupConfig& config); // false while running
+	void loop(void); // call after Esp32::loop(), issues the next command when the slot is free
+	bool isRunning(void);
+	const BringupStats& getStats(void);
+
+	// IWifi, the commands of the bring-up are answered here
+	void cbReset(Esp32::ResponseType state);
+	void cbSetMode(Esp32::ResponseType state);
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType state);
+	void cbGetIP(Esp32::ResponseType state, uint32_t AP_IP, uint32_t STA_IP);
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType state);
+	void cbGetMode(Esp32::ResponseType state, int mode);
+	void cbGetMUX(Esp32::ResponseType state, bool isMUX);
+	void cbGetAP(Esp32::ResponseType state, const char ssid[]);
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end) {}
+	void cbSend(Esp32::ResponseType) {}
+
+private:
+	enum Step {
+		STEP_IDLE,
+		STEP_RESET,
+		STEP_GETMODE,
+		STEP_SETMODE,
+		STEP_GETMUX,
+		STEP_SETMUX,
+		STEP_GETAP,
+		STEP_JOIN,
+		STEP_GETIP,
+		STEP_DONE // cbBringupDone is due once the slot is free
+	};
+
+	Esp32& m_esp;
+	IBringup* m_handler;
+	BringupConfig m_config;
+	BringupStats m_stats;
+	Step m_step;
+	bool m_issued; // the command of m_step is in flight
+	uint32_t m_start; // us
+	uint32_t m_phaseStart; // us
+	Esp32::ResponseType m_result;
+	uint32_t m_staIP;
+
+	bool issue(void);
+	void next(Step step);
+	void endPhase(Phase phase, bool skipped);
+	void afterMUX(void);
+	void finish(Esp32::ResponseType result, uint32_t sta_ip);
+	void fail(Phase phase, Esp32::ResponseType result);
+};
+
+#endif
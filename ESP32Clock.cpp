@@ -0,0 +1,43 @@
+#include "ESP32Clock.h"
+#ifdef __linux__
+#include <time.h>
+#endif
+
+#ifdef WIN32
+extern volatile uint32_t g_ul_ms_ticks;
+#endif
+
+uint32_t SystemClock::micros(void)
+{
+#if defined(__linux__)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000000u + (uint32_t)(ts.tv_nsec / 1000);
+#elif defined(WIN32)
+	return g_ul_ms_ticks * 1000u; // the test harness only has a millisecond tick
+#else
+	return ::micros();
+#endif
+}
+
+VirtualClock::VirtualClock(uint32_t start)
+	: m_now(start)
+{
+}
+
+uint32_t VirtualClock::micros(void)
+{
+	return m_now;
+}
+
+void VirtualClock::set(uint32_t now)
+{
+	m_now = now;
+}
+
+void VirtualClock::advance(uint32_t us)
+{
+	m_now += us;
+}
+
+SystemClock systemClock;
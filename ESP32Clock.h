@@ -0,0 +1,54 @@
+// Time sources for the ESP32 AT driver
+
+
+#ifndef _ESP32CLOCK_h
+#define _ESP32CLOCK_h
+
+#ifdef WIN32
+#include "win32_test/win32_test.h"
+#elif !defined(__linux__)
+#include "Arduino.h"
+#endif
+#include <stdint.h>
+
+// monotonic microsecond counter, it wraps every ~71 minutes so intervals are
+// always taken as (uint32_t)(now - since), which stays correct across the wrap
+class Esp32Clock
+{
+public:
+	virtual ~Esp32Clock() {}
+	virtual uint32_t micros(void) = 0;
+
+	static inline uint32_t elapsed(uint32_t now, uint32_t since)
+	{
+		return now - since;
+	}
+	static inline bool reached(uint32_t now, uint32_t deadline)
+	{
+		return (int32_t)(now - deadline) >= 0;
+	}
+};
+
+// micros() on target, CLOCK_MONOTONIC on Linux
+class SystemClock : public Esp32Clock
+{
+public:
+	uint32_t micros(void);
+};
+
+// time only moves when told to, for deterministic benchmarks and timeout tests
+class VirtualClock : public Esp32Clock
+{
+public:
+	VirtualClock(uint32_t start = 0);
+	uint32_t micros(void);
+	void set(uint32_t now);
+	void advance(uint32_t us);
+
+private:
+	volatile uint32_t m_now;
+};
+
+extern SystemClock systemClock;
+
+#endif
@@ -0,0 +1,670 @@
+#include "ESP32HTTP.h"
+
+static const char* const s_methods[] = { "GET", "HEAD", "POST", "PUT", "DELETE" };
+
+static bool append(char* buffer, size_t* len, size_t size, const char s[])
+{
+	size_t n = strlen(s);
+	if (*len + n > size)
+		return false;
+	memcpy(buffer + *len, s, n);
+	*len += n;
+	return true;
+}
+
+// value of the header if line starts with name, name is in lower case
+static const char* headerValue(const char line[], const char name[])
+{
+	int i = 0;
+	for (; name[i] != 0; i++)
+	{
+		char c = line[i];
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if (c != name[i])
+			return NULL;
+	}
+	if (line[i] != ':')
+		return NULL;
+	i++;
+	while (line[i] == ' ' || line[i] == '\t')
+		i++;
+	return line + i;
+}
+
+// case insensitive search of a lower case token
+static bool hasToken(const char value[], const char token[])
+{
+	size_t n = strlen(token);
+	for (; *value != 0; value++)
+	{
+		size_t i = 0;
+		for (; i < n; i++)
+		{
+			char c = value[i];
+			if (c >= 'A' && c <= 'Z')
+				c += 'a' - 'A';
+			if (c != token[i])
+				break;
+		}
+		if (i == n)
+			return true;
+	}
+	return false;
+}
+
+Esp32HTTP::Esp32HTTP(Esp32& esp)
+	: m_esp(esp)
+	, m_firstLink(0)
+	, m_linkCount(0)
+	, m_seq(0)
+	, m_keepAlive(true)
+	, m_pipelineDepth(PIPELINE_MAX)
+	, m_responseTimeout(RESPONSE_TIMEOUT)
+	, m_connecting(-1)
+	, m_sending(-1)
+	, m_bodyReq(-1)
+	, m_bodyConn(-1)
+	, m_bodyOffset(0)
+	, m_bodyChunk(0)
+{
+	memset(m_requests, 0, sizeof(m_requests));
+	memset(&m_stats, 0, sizeof(m_stats));
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		Connection& c = m_conns[i];
+		c.client = this;
+		c.link_id = i;
+		c.state = CONN_CLOSED;
+		c.head = 0;
+		c.count = 0;
+		c.parse = PARSE_STATUS;
+		c.line_len = 0;
+		c.timer.init(onTimeout, &c);
+	}
+}
+
+void Esp32HTTP::begin(uint8_t first_link, uint8_t links)
+{
+	if (first_link >= Esp32::LINK_MAX)
+		return;
+	if (links > Esp32::LINK_MAX - first_link)
+		links = Esp32::LINK_MAX - first_link;
+	m_firstLink = first_link;
+	m_linkCount = links;
+	for (int i = first_link; i < first_link + links; i++)
+	{
+		m_esp.setLinkOwner(i, this);
+	}
+}
+
+void Esp32HTTP::setKeepAlive(bool en)
+{
+	m_keepAlive = en;
+}
+
+void Esp32HTTP::setPipelineDepth(int depth)
+{
+	if (depth < 1)
+		depth = 1;
+	if (depth > PIPELINE_MAX)
+		depth = PIPELINE_MAX;
+	m_pipelineDepth = depth;
+}
+
+void Esp32HTTP::setResponseTimeout(uint32_t ms)
+{
+	m_responseTimeout = ms;
+}
+
+int Esp32HTTP::request(IHttp* handler, Method method, const char host[], uint32_t ip, uint16_t port, const char path[],
+	const char headers[], const byte* body, size_t body_size, bool ssl)
+{
+	for (int i = 0; i < REQUEST_MAX; i++)
+	{
+		Request& r = m_requests[i];
+		if (r.state != REQ_FREE)
+			continue;
+		r.handler = handler;
+		r.method = method;
+		r.host = host;
+		r.ip = ip;
+		r.port = port;
+		r.ssl = ssl;
+		r.path = path;
+		r.headers = headers;
+		r.body = body;
+		r.body_size = body != NULL ? body_size : 0;
+		r.state = REQ_QUEUED;
+		r.seq = m_seq++;
+		r.tries = 0;
+		m_stats.requests++;
+		return i;
+	}
+	return -1;
+}
+
+int Esp32HTTP::get(IHttp* handler, const char host[], uint32_t ip, uint16_t port, const char path[])
+{
+	return request(handler, METHOD_GET, host, ip, port, path);
+}
+
+bool Esp32HTTP::isIdle(void)
+{
+	for (int i = 0; i < REQUEST_MAX; i++)
+	{
+		if (m_requests[i].state != REQ_FREE)
+			return false;
+	}
+	return m_connecting == -1 && m_sending == -1;
+}
+
+const Esp32HTTP::HttpStats& Esp32HTTP::getStats(void)
+{
+	return m_stats;
+}
+
+void Esp32HTTP::loop(void)
+{
+	checkClosed();
+	// one command at a time, the module has a single command slot anyway
+	if (m_connecting != -1 || m_sending != -1)
+		return;
+	if (m_bodyReq != -1)
+	{
+		sendBody();
+		return;
+	}
+	for (int i = m_firstLink; i < m_firstLink + m_linkCount; i++)
+	{
+		Connection& c = m_conns[i];
+		if (c.state == CONN_CLOSING && c.count == 0 && m_esp.closeConnect(this, c.link_id))
+			return;
+	}
+	int req_id = nextQueued(NULL);
+	if (req_id == -1)
+		return;
+	Request& r = m_requests[req_id];
+	int idle = -1;
+	int pipe = -1;
+	int closed = -1;
+	int victim = -1;
+	for (int i = m_firstLink; i < m_firstLink + m_linkCount; i++)
+	{
+		Connection& c = m_conns[i];
+		if (c.state == CONN_OPEN && sameEndpoint(c, r))
+		{
+			if (c.count == 0)
+			{
+				idle = i;
+				break;
+			}
+			if (pipe == -1 && c.keep_alive && c.count < m_pipelineDepth && idempotent(r))
+				pipe = i;
+		}
+		else if (c.state == CONN_CLOSED && closed == -1)
+			closed = i;
+		else if (c.state == CONN_OPEN && c.count == 0 && victim == -1)
+			victim = i;
+	}
+	if (idle != -1)
+		startRequests(idle, req_id);
+	else if (pipe != -1)
+		startRequests(pipe, req_id);
+	else if (closed != -1)
+		openConnection(closed, req_id);
+	else if (victim != -1) // every link is taken, give up an idle one to another endpoint
+		m_conns[victim].state = CONN_CLOSING;
+}
+
+int Esp32HTTP::nextQueued(Connection* c)
+{
+	int best = -1;
+	for (int i = 0; i < REQUEST_MAX; i++)
+	{
+		Request& r = m_requests[i];
+		if (r.state != REQ_QUEUED)
+			continue;
+		if (c != NULL && (!sameEndpoint(*c, r) || !idempotent(r)))
+			continue;
+		if (best == -1 || (int32_t)(r.seq - m_requests[best].seq) < 0)
+			best = i;
+	}
+	return best;
+}
+
+bool Esp32HTTP::sameEndpoint(Connection& c, Request& r)
+{
+	return c.ip == r.ip && c.port == r.port && c.ssl == r.ssl;
+}
+
+bool Esp32HTTP::idempotent(Request& r)
+{
+	return r.method == METHOD_GET || r.method == METHOD_HEAD;
+}
+
+bool Esp32HTTP::startRequests(int conn_id, int req_id)
+{
+	Connection& c = m_conns[conn_id];
+	int8_t added[PIPELINE_MAX];
+	int n = 0;
+	size_t len = 0;
+	bool body_apart = false;
+	// requests queued behind the first one for the same endpoint go out in the same send
+	while (req_id != -1 && c.count + n < m_pipelineDepth)
+	{
+		Request& r = m_requests[req_id];
+		size_t next = buildRequest(c, len, r, &body_apart);
+		if (next == 0)
+			break;
+		len = next;
+		added[n++] = req_id;
+		r.state = REQ_SENT;
+		if (body_apart || !idempotent(r) || !c.keep_alive)
+			break;
+		req_id = nextQueued(&c);
+	}
+	if (n == 0)
+	{
+		done(req_id, Esp32::RESPONSE_SEND_ERROR); // the headers alone do not fit
+		return false;
+	}
+	if (!m_esp.sendBytesMUX(this, c.link_id, (byte*)c.tx, len))
+	{
+		for (int i = 0; i < n; i++)
+		{
+			m_requests[added[i]].state = REQ_QUEUED;
+		}
+		return false;
+	}
+	m_stats.reused += c.used ? n : n - 1;
+	m_stats.pipelined += c.count > 0 ? n : n - 1;
+	c.used = true;
+	if (c.count == 0)
+		m_esp.getTimers().arm(c.timer, m_responseTimeout);
+	for (int i = 0; i < n; i++)
+	{
+		c.pipeline[(c.head + c.count) % PIPELINE_MAX] = added[i];
+		c.count++;
+	}
+	m_sending = conn_id;
+	if (body_apart)
+	{
+		m_bodyReq = added[n - 1];
+		m_bodyConn = conn_id;
+		m_bodyOffset = 0;
+		m_bodyChunk = 0;
+	}
+	return true;
+}
+
+size_t Esp32HTTP::buildRequest(Connection& c, size_t len, Request& r, bool* body_apart)
+{
+	bool ok = append(c.tx, &len, TX_MAX_SIZE, s_methods[r.method])
+		&& append(c.tx, &len, TX_MAX_SIZE, " ")
+		&& append(c.tx, &len, TX_MAX_SIZE, r.path)
+		&& append(c.tx, &len, TX_MAX_SIZE, " HTTP/1.1\r\nHost: ")
+		&& append(c.tx, &len, TX_MAX_SIZE, r.host)
+		&& append(c.tx, &len, TX_MAX_SIZE, "\r\n");
+	if (ok && !m_keepAlive)
+		ok = append(c.tx, &len, TX_MAX_SIZE, "Connection: close\r\n");
+	if (ok && r.headers != NULL)
+		ok = append(c.tx, &len, TX_MAX_SIZE, r.headers);
+	if (ok && (r.body_size > 0 || r.method == METHOD_POST || r.method == METHOD_PUT))
+	{
+		char s[32];
+		snprintf(s, sizeof(s), "Content-Length: %u\r\n", (unsigned)r.body_size);
+		ok = append(c.tx, &len, TX_MAX_SIZE, s);
+	}
+	if (!ok || !append(c.tx, &len, TX_MAX_SIZE, "\r\n"))
+		return 0;
+	*body_apart = false;
+	if (r.body_size > 0)
+	{
+		if (len + r.body_size <= TX_MAX_SIZE)
+		{
+			memcpy(c.tx + len, r.body, r.body_size);
+			len += r.body_size;
+		}
+		else
+			*body_apart = true; // sent from the caller's memory after the headers
+	}
+	return len;
+}
+
+bool Esp32HTTP::sendBody(void)
+{
+	Request& r = m_requests[m_bodyReq];
+	size_t n = r.body_size - m_bodyOffset;
+	if (n > Esp32::SEND_MAXSIZE)
+		n = Esp32::SEND_MAXSIZE;
+	if (!m_esp.sendBytesMUX(this, m_conns[m_bodyConn].link_id, (byte*)r.body + m_bodyOffset, n))
+		return false;
+	m_bodyChunk = n;
+	m_sending = m_bodyConn;
+	return true;
+}
+
+bool Esp32HTTP::openConnection(int conn_id, int req_id)
+{
+	Connection& c = m_conns[conn_id];
+	Request& r = m_requests[req_id];
+	bool ok;
+	if (r.ssl)
+		ok = m_esp.SSLConnectMUX(this, c.link_id, r.ip, r.port);
+	else
+		ok = m_esp.TCPConnectMUX(this, c.link_id, r.ip, r.port);
+	if (!ok)
+		return false;
+	c.state = CONN_CONNECTING;
+	c.ip = r.ip;
+	c.port = r.port;
+	c.ssl = r.ssl;
+	c.keep_alive = m_keepAlive;
+	c.used = false;
+	c.head = 0;
+	c.count = 0;
+	c.parse = PARSE_STATUS;
+	c.line_len = 0;
+	m_connecting = conn_id;
+	return true;
+}
+
+void Esp32HTTP::cbTCPConnect(Esp32::ResponseType state)
+{
+	if (m_connecting == -1)
+		return;
+	Connection& c = m_conns[m_connecting];
+	m_connecting = -1;
+	if (state == Esp32::RESPONSE_OK)
+	{
+		c.state = CONN_OPEN;
+		m_stats.connects++;
+		return;
+	}
+	c.state = CONN_CLOSED;
+	failEndpoint(c, state);
+}
+
+void Esp32HTTP::cbSSLConnect(Esp32::ResponseType state, int link_id, bool already_open)
+{
+	cbTCPConnect(state);
+}
+
+void Esp32HTTP::cbSend(Esp32::ResponseType state)
+{
+	if (m_sending == -1)
+		return;
+	Connection& c = m_conns[m_sending];
+	m_sending = -1;
+	if (state == Esp32::RESPONSE_OK)
+	{
+		if (m_bodyReq != -1 && m_bodyChunk > 0)
+		{
+			m_bodyOffset += m_bodyChunk;
+			m_bodyChunk = 0;
+			if (m_bodyOffset >= m_requests[m_bodyReq].body_size)
+				m_bodyReq = -1;
+		}
+		return;
+	}
+	// the server may have part of a request, the connection can not be used any more
+	m_bodyReq = -1;
+	failPipeline(c, state);
+	c.state = CONN_CLOSING;
+}
+
+void Esp32HTTP::failEndpoint(Connection& c, Esp32::ResponseType result)
+{
+	for (int i = 0; i < REQUEST_MAX; i++)
+	{
+		Request& r = m_requests[i];
+		if (r.state == REQ_QUEUED && sameEndpoint(c, r))
+			done(i, result);
+	}
+}
+
+void Esp32HTTP::failPipeline(Connection& c, Esp32::ResponseType result)
+{
+	m_esp.getTimers().cancel(c.timer);
+	while (c.count > 0)
+	{
+		int id = c.pipeline[c.head];
+		c.head = (c.head + 1) % PIPELINE_MAX;
+		c.count--;
+		done(id, result);
+	}
+	c.parse = PARSE_STATUS;
+	c.line_len = 0;
+}
+
+void Esp32HTTP::checkClosed(void)
+{
+	for (int i = m_firstLink; i < m_firstLink + m_linkCount; i++)
+	{
+		Connection& c = m_conns[i];
+		if ((c.state == CONN_OPEN || c.state == CONN_CLOSING) && !m_esp.isConnected(c.link_id))
+			closed(c);
+	}
+}
+
+void Esp32HTTP::closed(Connection& c)
+{
+	m_esp.getTimers().cancel(c.timer);
+	if (c.count > 0 && c.parse == PARSE_UNTIL_CLOSE)
+		finish(c, Esp32::RESPONSE_OK);
+	// a response cut short is an error, unanswered GET and HEAD go out again
+	bool started = c.parse != PARSE_STATUS || c.line_len > 0;
+	while (c.count > 0)
+	{
+		int id = c.pipeline[c.head];
+		c.head = (c.head + 1) % PIPELINE_MAX;
+		c.count--;
+		Request& r = m_requests[id];
+		if (!started && idempotent(r) && r.tries < 1)
+		{
+			r.tries++;
+			r.state = REQ_QUEUED;
+		}
+		else
+			done(id, Esp32::RESPONSE_UNKNOWN_ERROR);
+		started = false;
+	}
+	if (m_bodyReq != -1 && m_bodyConn == c.link_id)
+		m_bodyReq = -1;
+	c.state = CONN_CLOSED;
+	c.parse = PARSE_STATUS;
+	c.line_len = 0;
+}
+
+void Esp32HTTP::cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end)
+{
+	if (link_id < m_firstLink || link_id >= m_firstLink + m_linkCount)
+		return;
+	Connection& c = m_conns[link_id];
+	if (c.count > 0)
+		m_esp.getTimers().arm(c.timer, m_responseTimeout);
+	while (begin < end)
+	{
+		uint8_t* p;
+		size_t n = buffer.segment(begin, end, &p);
+		if (n == 0)
+			break;
+		parse(c, p, n);
+		begin += n;
+	}
+}
+
+void Esp32HTTP::cbReceivedDirect(int link_id, byte* buffer, size_t size)
+{
+	if (link_id < m_firstLink || link_id >= m_firstLink + m_linkCount)
+		return;
+	Connection& c = m_conns[link_id];
+	if (c.count > 0)
+		m_esp.getTimers().arm(c.timer, m_responseTimeout);
+	parse(c, buffer, size);
+}
+
+void Esp32HTTP::parse(Connection& c, const byte* p, size_t n)
+{
+	while (n > 0 && c.count > 0) // nothing was asked for the rest
+	{
+		int id = c.pipeline[c.head];
+		if (c.parse == PARSE_BODY || c.parse == PARSE_CHUNK_DATA || c.parse == PARSE_UNTIL_CLOSE)
+		{
+			size_t k = n;
+			if (c.parse != PARSE_UNTIL_CLOSE && k > c.rest)
+				k = c.rest;
+			m_requests[id].handler->cbHttpBody(id, p, k);
+			p += k;
+			n -= k;
+			if (c.parse == PARSE_UNTIL_CLOSE)
+				continue;
+			c.rest -= k;
+			if (c.rest > 0)
+				continue;
+			if (c.parse == PARSE_BODY)
+				finish(c, Esp32::RESPONSE_OK);
+			else
+				c.parse = PARSE_CHUNK_END;
+			continue;
+		}
+		// status, header and chunk size lines
+		const byte* lf = (const byte*)memchr(p, '\n', n);
+		size_t k = lf != NULL ? lf - p : n;
+		size_t room = LINE_MAX_SIZE - 1 - c.line_len;
+		memcpy(c.line + c.line_len, p, k < room ? k : room);
+		c.line_len += k < room ? k : room;
+		p += k;
+		n -= k;
+		if (lf == NULL)
+			break;
+		p++;
+		n--;
+		if (c.line_len > 0 && c.line[c.line_len - 1] == '\r')
+			c.line_len--;
+		c.line[c.line_len] = 0;
+		parseLine(c);
+		c.line_len = 0;
+	}
+}
+
+void Esp32HTTP::parseLine(Connection& c)
+{
+	int id = c.pipeline[c.head];
+	Request& r = m_requests[id];
+	const char* v;
+	switch (c.parse)
+	{
+	case PARSE_STATUS:
+		if (c.line_len == 0) // CRLF left between responses
+			break;
+		if (c.line_len < 12 || strncmp(c.line, "HTTP/1.", 7) != 0)
+		{
+			failPipeline(c, Esp32::RESPONSE_UNKNOWN_ERROR);
+			c.state = CONN_CLOSING;
+			break;
+		}
+		c.status = atoi(c.line + 9);
+		c.content_length = -1;
+		c.chunked = false;
+		c.keep_alive = m_keepAlive && c.line[7] == '1'; // HTTP/1.0 closes unless told otherwise
+		c.parse = PARSE_HEADER;
+		break;
+	case PARSE_HEADER:
+		if (c.line_len == 0)
+		{
+			headersDone(c);
+			break;
+		}
+		if ((v = headerValue(c.line, "content-length")) != NULL)
+			c.content_length = atol(v);
+		else if ((v = headerValue(c.line, "transfer-encoding")) != NULL)
+			c.chunked = hasToken(v, "chunked");
+		else if ((v = headerValue(c.line, "connection")) != NULL)
+		{
+			if (hasToken(v, "close"))
+				c.keep_alive = false;
+			else if (hasToken(v, "keep-alive"))
+				c.keep_alive = m_keepAlive;
+		}
+		r.handler->cbHttpHeader(id, c.line);
+		break;
+	case PARSE_CHUNK_SIZE:
+		if (c.line_len == 0)
+			break;
+		c.rest = strtoul(c.line, NULL, 16); // extensions after ';' are ignored
+		c.parse = c.rest == 0 ? PARSE_TRAILER : PARSE_CHUNK_DATA;
+		break;
+	case PARSE_CHUNK_END:
+		c.parse = PARSE_CHUNK_SIZE;
+		break;
+	case PARSE_TRAILER:
+		if (c.line_len == 0)
+			finish(c, Esp32::RESPONSE_OK);
+		break;
+	default:
+		break;
+	}
+}
+
+void Esp32HTTP::headersDone(Connection& c)
+{
+	int id = c.pipeline[c.head];
+	Request& r = m_requests[id];
+	if (c.status >= 100 && c.status < 200) // interim response, the real one follows
+	{
+		c.parse = PARSE_STATUS;
+		return;
+	}
+	r.handler->cbHttpResponse(id, c.status, c.chunked ? -1 : c.content_length);
+	if (r.method == METHOD_HEAD || c.status == 204 || c.status == 304 || (c.content_length == 0 && !c.chunked))
+		finish(c, Esp32::RESPONSE_OK);
+	else if (c.chunked)
+		c.parse = PARSE_CHUNK_SIZE;
+	else if (c.content_length > 0)
+	{
+		c.rest = c.content_length;
+		c.parse = PARSE_BODY;
+	}
+	else
+	{
+		c.keep_alive = false;
+		c.parse = PARSE_UNTIL_CLOSE;
+	}
+}
+
+void Esp32HTTP::finish(Connection& c, Esp32::ResponseType result)
+{
+	int id = c.pipeline[c.head];
+	c.head = (c.head + 1) % PIPELINE_MAX;
+	c.count--;
+	c.parse = PARSE_STATUS;
+	if (c.count == 0)
+		m_esp.getTimers().cancel(c.timer);
+	if (id == m_bodyReq) // answered before its whole body went out, the server reads the rest as the next request
+		c.keep_alive = false;
+	if (!c.keep_alive)
+		c.state = CONN_CLOSING;
+	if (result == Esp32::RESPONSE_OK)
+		m_stats.responses++;
+	done(id, result);
+}
+
+void Esp32HTTP::done(int req_id, Esp32::ResponseType result)
+{
+	Request& r = m_requests[req_id];
+	if (req_id == m_bodyReq) // none of its body goes out any more
+		m_bodyReq = -1;
+	r.state = REQ_FREE; // the handler may queue the next request with this id
+	if (result != Esp32::RESPONSE_OK)
+		m_stats.failures++;
+	r.handler->cbHttpDone(req_id, result);
+}
+
+void Esp32HTTP::onTimeout(void* arg)
+{
+	Connection* c = (Connection*)arg;
+	c->client->failPipeline(*c, Esp32::RESPONSE_TIMEOUT);
+	c->state = CONN_CLOSING;
+}
@@ -0,0 +1,180 @@
+// HTTP/1.1 client for the ESP32 AT driver
+
+
+#ifndef _ESP32HTTP_h
+#define _ESP32HTTP_h
+
+#include "ESP32WROOM.h"
+
+// events of one request, id is the value returned by Esp32HTTP::request()
+class IHttp
+{
+public:
+	virtual void cbHttpResponse(int id, int status, int32_t content_length) = 0; // -1 if not known
+	virtual void cbHttpHeader(int id, const char line[]) {}
+	virtual void cbHttpBody(int id, const byte* data, size_t size) = 0;
+	virtual void cbHttpDone(int id, Esp32::ResponseType result) = 0; // the id is free again
+};
+
+// keeps connections open across requests on the links given to begin() and
+// pipelines idempotent requests to the same endpoint on an open connection.
+// Responses are parsed as they arrive, the body is handed over from the receive
+// ring or the link buffer without copying. Strings and bodies passed to
+// request() must stay valid until cbHttpDone
+class Esp32HTTP : public IWifi
+{
+public:
+	const static int REQUEST_MAX = 8;
+	const static int PIPELINE_MAX = 4; // requests sent on one connection and not answered yet
+	const static int TX_MAX_SIZE = 512; // request line and headers, small bodies go with them
+	const static int LINE_MAX_SIZE = 128; // longer header lines are cut
+	const static uint32_t RESPONSE_TIMEOUT = 10000;
+
+	enum Method {
+		METHOD_GET = 0,
+		METHOD_HEAD,
+		METHOD_POST,
+		METHOD_PUT,
+		METHOD_DELETE
+	};
+	typedef struct _HTTP_STATS {
+		uint32_t requests;
+		uint32_t responses;
+		uint32_t failures;
+		uint32_t connects;
+		uint32_t reused; // sent on a connection opened for an earlier request
+		uint32_t pipelined; // sent while an earlier response was still pending
+	} HttpStats;
+
+	Esp32HTTP(Esp32& esp);
+	void begin(uint8_t first_link = 0, uint8_t links = Esp32::LINK_MAX); // the module must be in MUX mode
+	void setKeepAlive(bool en); // false sends "Connection: close" and connects per request
+	void setPipelineDepth(int depth); // 1 to wait for each response
+	void setResponseTimeout(uint32_t ms);
+	// headers are complete lines ending with CRLF, or NULL. Returns the request id,
+	// -1 if the queue is full
+	int request(IHttp* handler, Method method, const char host[], uint32_t ip, uint16_t port, const char path[],
+		const char headers[] = NULL, const byte* body = NULL, size_t body_size = 0, bool ssl = false);
+	int get(IHttp* handler, const char host[], uint32_t ip, uint16_t port, const char path[]);
+	void loop(void); // call after Esp32::loop(), issues queued work when the command slot is free
+	bool isIdle(void);
+	const HttpStats& getStats(void);
+
+	// IWifi, the client issues its own commands and owns the data of its links
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end);
+	void cbReceivedDirect(int link_id, byte* buffer, size_t size);
+	void cbSend(Esp32::ResponseType state);
+	void cbTCPConnect(Esp32::ResponseType state);
+	void cbSSLConnect(Esp32::ResponseType state, int link_id, bool already_open);
+
+private:
+	enum RequestState {
+		REQ_FREE = 0,
+		REQ_QUEUED,
+		REQ_SENT
+	};
+	enum ConnState {
+		CONN_CLOSED = 0,
+		CONN_CONNECTING,
+		CONN_OPEN,
+		CONN_CLOSING
+	};
+	enum ParseState {
+		PARSE_STATUS = 0,
+		PARSE_HEADER,
+		PARSE_BODY,
+		PARSE_CHUNK_SIZE,
+		PARSE_CHUNK_DATA,
+		PARSE_CHUNK_END,
+		PARSE_TRAILER,
+		PARSE_UNTIL_CLOSE
+	};
+	typedef struct _REQUEST {
+		IHttp* handler;
+		Method method;
+		const char* host;
+		uint32_t ip;
+		uint16_t port;
+		bool ssl;
+		const char* path;
+		const char* headers;
+		const byte* body;
+		size_t body_size;
+		RequestState state;
+		uint32_t seq; // queue order
+		uint8_t tries; // sent again after the connection closed unanswered
+	} Request;
+	typedef struct _CONNECTION {
+		Esp32HTTP* client;
+		uint8_t link_id;
+		ConnState state;
+		uint32_t ip;
+		uint16_t port;
+		bool ssl;
+		bool keep_alive; // the server keeps the connection after the current response
+		bool used; // a request was sent on the connection
+		int8_t pipeline[PIPELINE_MAX]; // sent requests in response order
+		uint8_t head;
+		uint8_t count;
+		ParseState parse;
+		int status;
+		int32_t content_length;
+		bool chunked;
+		uint32_t rest; // body or chunk bytes still expected
+		char line[LINE_MAX_SIZE];
+		int line_len;
+		Esp32Timer timer; // response timeout
+		char tx[TX_MAX_SIZE];
+	} Connection;
+
+	Esp32& m_esp;
+	Request m_requests[REQUEST_MAX];
+	Connection m_conns[Esp32::LINK_MAX];
+	uint8_t m_firstLink;
+	uint8_t m_linkCount;
+	uint32_t m_seq;
+	bool m_keepAlive;
+	int m_pipelineDepth;
+	uint32_t m_responseTimeout;
+	int m_connecting; // connection waiting for its connect result, -1 if none
+	int m_sending; // connection whose send is in flight, -1 if none
+	int m_bodyReq; // request whose body is sent apart from its headers, -1 if none
+	int m_bodyConn;
+	size_t m_bodyOffset;
+	size_t m_bodyChunk; // in flight
+	HttpStats m_stats;
+
+	int nextQueued(Connection* c);
+	bool sameEndpoint(Connection& c, Request& r);
+	bool startRequests(int conn_id, int req_id);
+	size_t buildRequest(Connection& c, size_t len, Request& r, bool* body_apart);
+	bool idempotent(Request& r);
+	bool sendBody(void);
+	bool openConnection(int conn_id, int req_id);
+	void checkClosed(void);
+	void closed(Connection& c);
+	void failPipeline(Connection& c, Esp32::ResponseType result);
+	void failEndpoint(Connection& c, Esp32::ResponseType result);
+	void parse(Connection& c, const byte* p, size_t n);
+	void parseLine(Connection& c);
+	void headersDone(Connection& c);
+	void finish(Connection& c, Esp32::ResponseType result);
+	void done(int req_id, Esp32::ResponseType result);
+	static void onTimeout(void* arg);
+};
+
+#endif
@@ -0,0 +1,631 @@
+#include "ESP32MQTT.h"
+
+#define MQTT_CONNECT 1
+#define MQTT_CONNACK 2
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 4
+#define MQTT_SUBSCRIBE 8
+#define MQTT_SUBACK 9
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_UNSUBACK 11
+#define MQTT_PINGREQ 12
+#define MQTT_PINGRESP 13
+#define MQTT_DISCONNECT 14
+
+// bytes taken by the remaining length field
+static size_t lengthSize(size_t len)
+{
+	if (len < 128)
+		return 1;
+	if (len < 16384)
+		return 2;
+	if (len < 2097152)
+		return 3;
+	return 4;
+}
+
+static byte* putLength(byte* p, size_t len)
+{
+	do
+	{
+		byte b = len & 0x7f;
+		len >>= 7;
+		if (len > 0)
+			b |= 0x80;
+		*p++ = b;
+	} while (len > 0);
+	return p;
+}
+
+static byte* putU16(byte* p, uint16_t v)
+{
+	*p++ = v >> 8;
+	*p++ = v & 0xff;
+	return p;
+}
+
+static byte* putString(byte* p, const char s[], size_t len)
+{
+	p = putU16(p, len);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+Esp32MQTT::Esp32MQTT(Esp32& esp)
+	: m_esp(esp)
+	, m_handler(NULL)
+	, m_linkID(0)
+	, m_state(STATE_DISCONNECTED)
+	, m_ip(0)
+	, m_port(0)
+	, m_ssl(false)
+	, m_keepAlive(0)
+	, m_cleanSession(true)
+	, m_nextID(0)
+	, m_connecting(false)
+	, m_sending(false)
+	, m_fill(0)
+	, m_connectLen(0)
+	, m_pingOutstanding(false)
+	, m_accepted(false)
+{
+	m_txLen[0] = m_txLen[1] = 0;
+	m_txPackets[0] = m_txPackets[1] = 0;
+	memset(m_inflight, 0, sizeof(m_inflight));
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_pingTimer.init(onPing, this);
+	resetParser();
+}
+
+void Esp32MQTT::begin(uint8_t link_id)
+{
+	m_linkID = link_id;
+	m_esp.setLinkOwner(link_id, this);
+}
+
+bool Esp32MQTT::connect(IMqtt* handler, uint32_t ip, uint16_t port, const char client_id[], uint16_t keep_alive,
+	const char user[], const char password[], bool clean_session, bool ssl)
+{
+	if (m_state != STATE_DISCONNECTED || m_sending)
+		return false;
+	m_handler = handler;
+	m_ip = ip;
+	m_port = port;
+	m_ssl = ssl;
+	m_clientID = client_id;
+	m_user = user;
+	m_password = password;
+	m_keepAlive = keep_alive;
+	if (clean_session)
+		dropInflight(Esp32::RESPONSE_UNKNOWN_ERROR); // the broker will not know them
+	m_cleanSession = clean_session;
+	m_connectLen = buildConnect();
+	if (m_connectLen == 0)
+		return false;
+	m_state = STATE_TCP_PENDING;
+	return true;
+}
+
+size_t Esp32MQTT::buildConnect(void)
+{
+	size_t id_len = strlen(m_clientID);
+	size_t user_len = m_user != NULL ? strlen(m_user) : 0;
+	size_t password_len = m_password != NULL ? strlen(m_password) : 0;
+	size_t len = 10 + 2 + id_len;
+	if (m_user != NULL)
+		len += 2 + user_len;
+	if (m_password != NULL)
+		len += 2 + password_len;
+	if (1 + lengthSize(len) + len > sizeof(m_connectPacket))
+		return 0;
+	byte flags = 0;
+	if (m_cleanSession)
+		flags |= 0x02;
+	if (m_user != NULL)
+		flags |= 0x80;
+	if (m_password != NULL)
+		flags |= 0x40;
+	byte* p = m_connectPacket;
+	*p++ = MQTT_CONNECT << 4;
+	p = putLength(p, len);
+	p = putString(p, "MQTT", 4);
+	*p++ = 4; // protocol level 3.1.1
+	*p++ = flags;
+	p = putU16(p, m_keepAlive);
+	p = putString(p, m_clientID, id_len);
+	if (m_user != NULL)
+		p = putString(p, m_user, user_len);
+	if (m_password != NULL)
+		p = putString(p, m_password, password_len);
+	return p - m_connectPacket;
+}
+
+void Esp32MQTT::disconnect(void)
+{
+	if (m_state == STATE_TCP_PENDING)
+	{
+		m_state = STATE_DISCONNECTED;
+		return;
+	}
+	if (m_state == STATE_CONNECTED)
+	{
+		byte* p = reserve(2);
+		if (p != NULL)
+		{
+			*p++ = MQTT_DISCONNECT << 4;
+			*p = 0;
+		}
+	}
+	if (m_state != STATE_DISCONNECTED)
+		m_state = STATE_CLOSING;
+}
+
+bool Esp32MQTT::isConnected(void)
+{
+	return m_state == STATE_CONNECTED;
+}
+
+const Esp32MQTT::MqttStats& Esp32MQTT::getStats(void)
+{
+	return m_stats;
+}
+
+uint16_t Esp32MQTT::nextID(void)
+{
+	if (++m_nextID == 0)
+		m_nextID = 1;
+	return m_nextID;
+}
+
+byte* Esp32MQTT::reserve(size_t n)
+{
+	size_t& len = m_txLen[m_fill];
+	if (len + n > TX_MAX_SIZE)
+		return NULL;
+	byte* p = m_tx[m_fill] + len;
+	len += n;
+	m_txPackets[m_fill]++;
+	return p;
+}
+
+bool Esp32MQTT::queuePublish(const char topic[], const byte* payload, size_t size, uint8_t qos, bool retain, uint16_t id, bool dup)
+{
+	size_t topic_len = strlen(topic);
+	size_t len = 2 + topic_len + (qos > 0 ? 2 : 0) + size;
+	byte* p = reserve(1 + lengthSize(len) + len);
+	if (p == NULL)
+		return false;
+	*p++ = (MQTT_PUBLISH << 4) | (dup ? 0x08 : 0) | (qos << 1) | (retain ? 0x01 : 0);
+	p = putLength(p, len);
+	p = putString(p, topic, topic_len);
+	if (qos > 0)
+		p = putU16(p, id);
+	memcpy(p, payload, size);
+	return true;
+}
+
+int Esp32MQTT::publish(const char topic[], const byte* payload, size_t size, uint8_t qos, bool retain)
+{
+	if (m_state == STATE_DISCONNECTED || m_state == STATE_CLOSING)
+		return -1;
+	if (qos == 0)
+	{
+		if (!queuePublish(topic, payload, size, 0, retain, 0, false))
+			return -1;
+		m_stats.published++;
+		return 0;
+	}
+	for (int i = 0; i < INFLIGHT_MAX; i++)
+	{
+		Inflight& f = m_inflight[i];
+		if (f.packet_id != 0)
+			continue;
+		uint16_t id = nextID();
+		if (!queuePublish(topic, payload, size, 1, retain, id, false))
+			return -1;
+		f.packet_id = id;
+		f.topic = topic;
+		f.payload = payload;
+		f.size = size;
+		f.retain = retain;
+		f.resend = false;
+		m_stats.published++;
+		return id;
+	}
+	return -1; // the window is full, wait for cbMqttPublished
+}
+
+int Esp32MQTT::subscribe(const char topic[], uint8_t qos)
+{
+	if (m_state == STATE_DISCONNECTED || m_state == STATE_CLOSING)
+		return -1;
+	size_t topic_len = strlen(topic);
+	size_t len = 2 + 2 + topic_len + 1;
+	byte* p = reserve(1 + lengthSize(len) + len);
+	if (p == NULL)
+		return -1;
+	uint16_t id = nextID();
+	*p++ = (MQTT_SUBSCRIBE << 4) | 0x02;
+	p = putLength(p, len);
+	p = putU16(p, id);
+	p = putString(p, topic, topic_len);
+	*p = qos > 1 ? 1 : qos;
+	return id;
+}
+
+int Esp32MQTT::unsubscribe(const char topic[])
+{
+	if (m_state == STATE_DISCONNECTED || m_state == STATE_CLOSING)
+		return -1;
+	size_t topic_len = strlen(topic);
+	size_t len = 2 + 2 + topic_len;
+	byte* p = reserve(1 + lengthSize(len) + len);
+	if (p == NULL)
+		return -1;
+	uint16_t id = nextID();
+	*p++ = (MQTT_UNSUBSCRIBE << 4) | 0x02;
+	p = putLength(p, len);
+	p = putU16(p, id);
+	putString(p, topic, topic_len);
+	return id;
+}
+
+void Esp32MQTT::loop(void)
+{
+	if ((m_state == STATE_MQTT_CONNECTING || m_state == STATE_CONNECTED || m_state == STATE_CLOSING)
+		&& !m_esp.isConnected(m_linkID))
+		closed();
+	if (m_connecting || m_sending)
+		return;
+	switch (m_state)
+	{
+	case STATE_TCP_PENDING:
+		if (m_ssl ? m_esp.SSLConnectMUX(this, m_linkID, m_ip, m_port)
+			: m_esp.TCPConnectMUX(this, m_linkID, m_ip, m_port))
+		{
+			m_connecting = true;
+			m_state = STATE_TCP_CONNECTING;
+		}
+		break;
+	case STATE_MQTT_CONNECTING:
+		if (m_connectLen > 0 && m_esp.sendBytesMUX(this, m_linkID, m_connectPacket, m_connectLen))
+		{
+			m_connectLen = 0;
+			m_sending = true;
+		}
+		break;
+	case STATE_CONNECTED:
+		resendInflight();
+		if (m_txLen[m_fill] > 0)
+			flush();
+		break;
+	case STATE_CLOSING:
+		if (m_txLen[m_fill] > 0) // DISCONNECT goes out before the link is closed
+			flush();
+		else
+			m_esp.closeConnect(this, m_linkID);
+		break;
+	default:
+		break;
+	}
+}
+
+bool Esp32MQTT::flush(void)
+{
+	int b = m_fill;
+	if (!m_esp.sendBytesMUX(this, m_linkID, m_tx[b], m_txLen[b]))
+		return false;
+	m_sending = true;
+	m_stats.batches++;
+	m_stats.packets += m_txPackets[b];
+	m_fill = 1 - b; // empty, it was sent before
+	if (m_keepAlive > 0)
+		m_esp.getTimers().arm(m_pingTimer, m_keepAlive * 1000UL);
+	return true;
+}
+
+void Esp32MQTT::resendInflight(void)
+{
+	for (int i = 0; i < INFLIGHT_MAX; i++)
+	{
+		Inflight& f = m_inflight[i];
+		if (f.packet_id == 0 || !f.resend)
+			continue;
+		if (!queuePublish(f.topic, f.payload, f.size, 1, f.retain, f.packet_id, true))
+			return; // the batch is full, the rest go with the next one
+		f.resend = false;
+	}
+}
+
+void Esp32MQTT::dropInflight(Esp32::ResponseType result)
+{
+	for (int i = 0; i < INFLIGHT_MAX; i++)
+	{
+		Inflight& f = m_inflight[i];
+		if (f.packet_id == 0)
+			continue;
+		uint16_t id = f.packet_id;
+		f.packet_id = 0;
+		if (m_handler != NULL)
+			m_handler->cbMqttPublished(id, result);
+	}
+}
+
+void Esp32MQTT::cbTCPConnect(Esp32::ResponseType state)
+{
+	if (!m_connecting)
+		return;
+	m_connecting = false;
+	bool cancelled = m_state == STATE_CLOSING; // disconnect() while connecting
+	if (state != Esp32::RESPONSE_OK)
+	{
+		m_state = STATE_DISCONNECTED;
+		if (!cancelled)
+			m_handler->cbMqttConnected(state, -1);
+		return;
+	}
+	if (cancelled)
+	{
+		// no CONNECT, and nothing queued meanwhile goes out before loop() closes the link
+		m_txLen[m_fill] = 0;
+		m_txPackets[m_fill] = 0;
+		return;
+	}
+	m_state = STATE_MQTT_CONNECTING;
+	m_pingOutstanding = false;
+	resetParser();
+}
+
+void Esp32MQTT::cbSSLConnect(Esp32::ResponseType state, int link_id, bool already_open)
+{
+	cbTCPConnect(state);
+}
+
+void Esp32MQTT::cbSend(Esp32::ResponseType state)
+{
+	if (!m_sending)
+		return;
+	m_sending = false;
+	int b = 1 - m_fill;
+	m_txLen[b] = 0;
+	m_txPackets[b] = 0;
+	// QoS 1 publishes of a lost batch are sent again after reconnecting
+	if (state != Esp32::RESPONSE_OK && m_state != STATE_DISCONNECTED)
+		m_state = STATE_CLOSING;
+}
+
+void Esp32MQTT::closed(void)
+{
+	State state = m_state;
+	bool accepted = m_accepted;
+	m_state = STATE_DISCONNECTED;
+	m_accepted = false;
+	m_esp.getTimers().cancel(m_pingTimer);
+	m_txLen[m_fill] = 0;
+	m_txPackets[m_fill] = 0;
+	if (m_cleanSession)
+		dropInflight(Esp32::RESPONSE_UNKNOWN_ERROR);
+	else
+	{
+		for (int i = 0; i < INFLIGHT_MAX; i++)
+		{
+			m_inflight[i].resend = true;
+		}
+	}
+	if (m_handler == NULL)
+		return;
+	if (state == STATE_MQTT_CONNECTING)
+		m_handler->cbMqttConnected(Esp32::RESPONSE_UNKNOWN_ERROR, -1);
+	else if (accepted) // a refused CONNACK was reported as such
+		m_handler->cbMqttDisconnected();
+}
+
+void Esp32MQTT::onPing(void* arg)
+{
+	Esp32MQTT* self = (Esp32MQTT*)arg;
+	if (self->m_state != STATE_CONNECTED)
+		return;
+	if (self->m_pingOutstanding) // nothing heard for a whole keep alive period
+	{
+		self->m_state = STATE_CLOSING;
+		return;
+	}
+	byte* p = self->reserve(2);
+	if (p != NULL)
+	{
+		*p++ = MQTT_PINGREQ << 4;
+		*p = 0;
+		self->m_pingOutstanding = true;
+	}
+	self->m_esp.getTimers().arm(self->m_pingTimer, self->m_keepAlive * 1000UL);
+}
+
+void Esp32MQTT::cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end)
+{
+	if (link_id != m_linkID)
+		return;
+	while (begin < end)
+	{
+		uint8_t* p;
+		size_t n = buffer.segment(begin, end, &p);
+		if (n == 0)
+			break;
+		parse(p, n);
+		begin += n;
+	}
+}
+
+void Esp32MQTT::cbReceivedDirect(int link_id, byte* buffer, size_t size)
+{
+	if (link_id == m_linkID)
+		parse(buffer, size);
+}
+
+void Esp32MQTT::resetParser(void)
+{
+	m_rxState = RX_TYPE;
+	m_rxType = 0;
+	m_rxRemaining = 0;
+	m_rxShift = 0;
+	m_rxPos = 0;
+	m_topicLen = 0;
+	m_rxID = 0;
+	m_topic[0] = 0;
+}
+
+void Esp32MQTT::parse(const byte* p, size_t n)
+{
+	while (n > 0)
+	{
+		switch (m_rxState)
+		{
+		case RX_TYPE:
+			m_rxType = *p++;
+			n--;
+			m_rxRemaining = 0;
+			m_rxShift = 0;
+			m_rxState = RX_LENGTH;
+			break;
+		case RX_LENGTH:
+		{
+			byte b = *p++;
+			n--;
+			m_rxRemaining |= (uint32_t)(b & 0x7f) << m_rxShift;
+			m_rxShift += 7;
+			if (b & 0x80)
+			{
+				if (m_rxShift >= 28) // malformed, the stream can not be followed any more
+				{
+					resetParser();
+					m_state = STATE_CLOSING;
+					return;
+				}
+				break;
+			}
+			m_rxPos = 0;
+			m_topicLen = 0;
+			m_rxID = 0;
+			memset(m_rxHeader, 0, sizeof(m_rxHeader));
+			m_rxState = (m_rxType >> 4) == MQTT_PUBLISH ? RX_PUBLISH_HEADER : RX_BODY;
+			if (m_rxRemaining == 0)
+				packetDone();
+			break;
+		}
+		case RX_BODY:
+		{
+			size_t k = n < m_rxRemaining ? n : m_rxRemaining;
+			for (size_t i = 0; i < k && m_rxPos < RX_HEADER_SIZE; i++)
+			{
+				m_rxHeader[m_rxPos++] = p[i];
+			}
+			p += k;
+			n -= k;
+			m_rxRemaining -= k;
+			if (m_rxRemaining == 0)
+				packetDone();
+			break;
+		}
+		case RX_PUBLISH_HEADER:
+			m_rxRemaining--;
+			publishHeader(*p++);
+			n--;
+			if (m_rxState == RX_PUBLISH_HEADER && m_rxRemaining == 0) // cut short
+				packetDone();
+			break;
+		case RX_PAYLOAD:
+		{
+			size_t k = n < m_rxRemaining ? n : m_rxRemaining;
+			m_handler->cbMqttMessage(m_topic, p, k, m_payloadOffset, m_payloadTotal);
+			m_payloadOffset += k;
+			p += k;
+			n -= k;
+			m_rxRemaining -= k;
+			if (m_rxRemaining == 0)
+				packetDone();
+			break;
+		}
+		}
+	}
+}
+
+void Esp32MQTT::publishHeader(byte b)
+{
+	uint32_t pos = m_rxPos++;
+	if (pos < 2)
+		m_topicLen = (m_topicLen << 8) | b;
+	else if (pos < 2u + m_topicLen)
+	{
+		if (pos - 2 < TOPIC_MAX_SIZE - 1)
+			m_topic[pos - 2] = b;
+	}
+	else
+		m_rxID = (m_rxID << 8) | b;
+	uint32_t id_len = (m_rxType & 0x06) != 0 ? 2 : 0;
+	if (m_rxPos < 2 || m_rxPos != 2u + m_topicLen + id_len)
+		return;
+	m_topic[m_topicLen < TOPIC_MAX_SIZE - 1 ? m_topicLen : TOPIC_MAX_SIZE - 1] = 0;
+	m_payloadTotal = m_rxRemaining;
+	m_payloadOffset = 0;
+	m_rxState = RX_PAYLOAD;
+	if (m_rxRemaining == 0)
+	{
+		m_handler->cbMqttMessage(m_topic, NULL, 0, 0, 0);
+		packetDone();
+	}
+}
+
+void Esp32MQTT::packetDone(void)
+{
+	uint8_t type = m_rxType >> 4;
+	uint16_t id = (m_rxHeader[0] << 8) | m_rxHeader[1];
+	m_rxState = RX_TYPE;
+	m_pingOutstanding = false; // the broker is alive
+	switch (type)
+	{
+	case MQTT_CONNACK:
+		if (m_state != STATE_MQTT_CONNECTING)
+			break;
+		if (m_rxHeader[1] != 0)
+		{
+			m_state = STATE_CLOSING;
+			m_handler->cbMqttConnected(Esp32::RESPONSE_UNKNOWN_ERROR, m_rxHeader[1]);
+			break;
+		}
+		m_state = STATE_CONNECTED;
+		m_accepted = true;
+		if (m_keepAlive > 0)
+			m_esp.getTimers().arm(m_pingTimer, m_keepAlive * 1000UL);
+		m_handler->cbMqttConnected(Esp32::RESPONSE_OK, 0);
+		break;
+	case MQTT_PUBLISH:
+		m_stats.received++;
+		if ((m_rxType & 0x06) != 0)
+		{
+			byte* p = reserve(4);
+			if (p != NULL)
+			{
+				*p++ = MQTT_PUBACK << 4;
+				*p++ = 2;
+				putU16(p, m_rxID);
+			}
+		}
+		break;
+	case MQTT_PUBACK:
+		for (int i = 0; i < INFLIGHT_MAX; i++)
+		{
+			Inflight& f = m_inflight[i];
+			if (f.packet_id != id)
+				continue;
+			f.packet_id = 0;
+			m_stats.acked++;
+			m_handler->cbMqttPublished(id, Esp32::RESPONSE_OK);
+			break;
+		}
+		break;
+	case MQTT_SUBACK:
+		m_handler->cbMqttSubscribed(id, m_rxHeader[2]);
+		break;
+	default: // UNSUBACK, PINGRESP
+		break;
+	}
+}
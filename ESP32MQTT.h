@@ -0,0 +1,156 @@
+// MQTT 3.1.1 client for the ESP32 AT driver
+
+
+#ifndef _ESP32MQTT_h
+#define _ESP32MQTT_h
+
+#include "ESP32WROOM.h"
+
+class IMqtt
+{
+public:
+	virtual void cbMqttConnected(Esp32::ResponseType, int return_code) = 0; // CONNACK code, 0 if accepted
+	virtual void cbMqttPublished(uint16_t packet_id, Esp32::ResponseType) = 0; // QoS 1 only
+	// the payload of a message may come in several parts, offset tells where this one goes
+	virtual void cbMqttMessage(const char topic[], const byte* data, size_t size, size_t offset, size_t total) = 0;
+	virtual void cbMqttSubscribed(uint16_t packet_id, uint8_t granted_qos) {}
+	virtual void cbMqttDisconnected(void) {} // only after an accepted CONNACK
+};
+
+// one broker connection on one MUX link. Packets queued between two loop() calls
+// leave in a single AT+CIPSEND, QoS 1 publishes wait for their PUBACK in a bounded
+// window and are sent again with DUP after reconnecting without a clean session.
+// Incoming payloads are handed over from the receive ring without copying.
+// Only QoS 0 and 1 are supported
+class Esp32MQTT : public IWifi
+{
+public:
+	const static int TX_MAX_SIZE = 1024; // per batch, two batches alternate
+	const static int INFLIGHT_MAX = 8;
+	const static int TOPIC_MAX_SIZE = 128; // incoming topics are cut to this
+	const static int RX_HEADER_SIZE = 8;
+
+	typedef struct _MQTT_STATS {
+		uint32_t published;
+		uint32_t acked;
+		uint32_t received;
+		uint32_t batches; // AT+CIPSEND issued
+		uint32_t packets; // packets in those batches
+	} MqttStats;
+
+	Esp32MQTT(Esp32& esp);
+	void begin(uint8_t link_id); // the module must be in MUX mode
+	// keep_alive is in seconds, the strings are copied into the CONNECT packet
+	bool connect(IMqtt* handler, uint32_t ip, uint16_t port, const char client_id[], uint16_t keep_alive = 60,
+		const char user[] = NULL, const char password[] = NULL, bool clean_session = true, bool ssl = false);
+	void disconnect(void); // a connect not accepted yet ends without a callback
+	bool isConnected(void);
+	// returns the packet id, 0 for QoS 0, -1 if the batch or the QoS 1 window is full.
+	// topic and payload of a QoS 1 publish must stay valid until cbMqttPublished
+	int publish(const char topic[], const byte* payload, size_t size, uint8_t qos = 0, bool retain = false);
+	int subscribe(const char topic[], uint8_t qos = 0);
+	int unsubscribe(const char topic[]);
+	void loop(void); // call after Esp32::loop(), sends the queued batch when the command slot is free
+	const MqttStats& getStats(void);
+
+	// IWifi, the client issues its own commands and owns the data of its link
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end);
+	void cbReceivedDirect(int link_id, byte* buffer, size_t size);
+	void cbSend(Esp32::ResponseType state);
+	void cbTCPConnect(Esp32::ResponseType state);
+	void cbSSLConnect(Esp32::ResponseType state, int link_id, bool already_open);
+
+private:
+	enum State {
+		STATE_DISCONNECTED = 0,
+		STATE_TCP_PENDING, // connect not issued yet
+		STATE_TCP_CONNECTING,
+		STATE_MQTT_CONNECTING, // waiting for CONNACK
+		STATE_CONNECTED,
+		STATE_CLOSING
+	};
+	enum RxState {
+		RX_TYPE = 0,
+		RX_LENGTH,
+		RX_BODY, // packets other than PUBLISH, the head is kept
+		RX_PUBLISH_HEADER,
+		RX_PAYLOAD
+	};
+	typedef struct _INFLIGHT {
+		uint16_t packet_id; // 0 if the entry is free
+		const char* topic;
+		const byte* payload;
+		size_t size;
+		bool retain;
+		bool resend; // not acknowledged before the connection was lost
+	} Inflight;
+
+	Esp32& m_esp;
+	IMqtt* m_handler;
+	uint8_t m_linkID;
+	State m_state;
+	uint32_t m_ip;
+	uint16_t m_port;
+	bool m_ssl;
+	const char* m_clientID;
+	const char* m_user;
+	const char* m_password;
+	uint16_t m_keepAlive;
+	bool m_cleanSession;
+	uint16_t m_nextID;
+	bool m_connecting; // connect command in flight
+	bool m_sending; // the CONNECT packet or batch m_tx[1 - m_fill] is in flight
+	byte m_tx[2][TX_MAX_SIZE];
+	size_t m_txLen[2];
+	uint16_t m_txPackets[2];
+	int m_fill; // batch taking new packets
+	byte m_connectPacket[TX_MAX_SIZE / 4];
+	size_t m_connectLen;
+	Inflight m_inflight[INFLIGHT_MAX];
+	Esp32Timer m_pingTimer;
+	bool m_pingOutstanding;
+	bool m_accepted; // CONNACK accepted on the current connection
+	// receive
+	RxState m_rxState;
+	uint8_t m_rxType;
+	uint32_t m_rxRemaining;
+	uint8_t m_rxShift;
+	uint32_t m_rxPos;
+	byte m_rxHeader[RX_HEADER_SIZE];
+	uint16_t m_topicLen;
+	uint16_t m_rxID;
+	char m_topic[TOPIC_MAX_SIZE];
+	uint32_t m_payloadTotal;
+	uint32_t m_payloadOffset;
+	MqttStats m_stats;
+
+	uint16_t nextID(void);
+	byte* reserve(size_t n);
+	bool queuePublish(const char topic[], const byte* payload, size_t size, uint8_t qos, bool retain, uint16_t id, bool dup);
+	size_t buildConnect(void);
+	void resetParser(void);
+	bool flush(void);
+	void resendInflight(void);
+	void dropInflight(Esp32::ResponseType result);
+	void closed(void);
+	void parse(const byte* p, size_t n);
+	void publishHeader(byte b);
+	void packetDone(void);
+	static void onPing(void* arg);
+};
+
+#endif
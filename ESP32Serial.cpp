@@ -0,0 +1,658 @@
+#include "ESP32Serial.h"
+#include <string.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#endif
+
+static void putLE(uint8_t* p, uint32_t v, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		p[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+CaptureSerial::CaptureSerial()
+	: m_pSerial(NULL)
+	, m_pClock(&systemClock)
+	, m_buffer(NULL)
+	, m_size(0)
+	, m_len(0)
+	, m_dropped(0)
+#ifdef __linux__
+	, m_fd(-1)
+#endif
+{
+}
+
+#ifdef __linux__
+CaptureSerial::~CaptureSerial()
+{
+	close();
+}
+#endif
+
+void CaptureSerial::begin(Esp32Serial& serial, Esp32Clock& clock)
+{
+	m_pSerial = &serial;
+	m_pClock = &clock;
+}
+
+void CaptureSerial::setBuffer(uint8_t* buffer, size_t size)
+{
+	m_buffer = buffer;
+	m_size = buffer != NULL ? size : 0;
+	m_len = 0;
+	m_dropped = 0;
+	writeHeader();
+}
+
+size_t CaptureSerial::length(void)
+{
+	return m_len;
+}
+
+uint32_t CaptureSerial::dropped(void)
+{
+	return m_dropped;
+}
+
+#ifdef __linux__
+bool CaptureSerial::open(const char path[])
+{
+	close();
+	m_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (m_fd == -1)
+		return false;
+	m_dropped = 0;
+	writeHeader();
+	return true;
+}
+
+void CaptureSerial::close(void)
+{
+	if (m_fd != -1)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+#endif
+
+int CaptureSerial::available(void)
+{
+	return m_pSerial->available();
+}
+
+int CaptureSerial::read(void)
+{
+	int c = m_pSerial->read();
+	if (c != -1)
+	{
+		uint8_t b = c;
+		record(false, &b, 1);
+	}
+	return c;
+}
+
+size_t CaptureSerial::read(uint8_t* buffer, size_t n)
+{
+	size_t c = m_pSerial->read(buffer, n);
+	if (c > 0)
+		record(false, buffer, c);
+	return c;
+}
+
+size_t CaptureSerial::write(const uint8_t* buffer, size_t n)
+{
+	record(true, buffer, n);
+	return m_pSerial->write(buffer, n);
+}
+
+int CaptureSerial::fd(void)
+{
+	return m_pSerial->fd();
+}
+
+void CaptureSerial::writeHeader(void)
+{
+	uint8_t header[HEADER_SIZE];
+	memcpy(header, "E32W", 4);
+	putLE(header + 4, VERSION, 2);
+	putLE(header + 6, 0, 2);
+	putLE(header + 8, m_pClock->micros(), 4);
+	put(header, HEADER_SIZE);
+}
+
+void CaptureSerial::record(bool tx, const uint8_t* p, size_t n)
+{
+	uint32_t now = m_pClock->micros();
+	while (n > 0)
+	{
+		size_t c = n < CHUNK_MAX_SIZE ? n : CHUNK_MAX_SIZE;
+		uint8_t header[RECORD_HEADER_SIZE];
+		putLE(header, now, 4);
+		putLE(header + 4, c | (tx ? TX_FLAG : 0), 2);
+		// a chunk is recorded whole or not at all
+		if (m_buffer != NULL && m_len + RECORD_HEADER_SIZE + c > m_size)
+		{
+			m_dropped++;
+			return;
+		}
+		if (!put(header, RECORD_HEADER_SIZE) || !put(p, c))
+			return;
+		p += c;
+		n -= c;
+	}
+}
+
+bool CaptureSerial::put(const uint8_t* p, size_t n)
+{
+#ifdef __linux__
+	if (m_fd != -1)
+	{
+		while (n > 0)
+		{
+			ssize_t c = ::write(m_fd, p, n);
+			if (c == -1 && errno == EINTR)
+				continue;
+			if (c <= 0)
+			{
+				m_dropped++;
+				return false;
+			}
+			p += c;
+			n -= c;
+		}
+		return true;
+	}
+#endif
+	if (m_buffer == NULL || m_len + n > m_size)
+		return false;
+	memcpy(m_buffer + m_len, p, n);
+	m_len += n;
+	return true;
+}
+
+#ifndef __linux__
+UsartSerial::UsartSerial()
+	: m_pSerial(NULL)
+{
+}
+
+void UsartSerial::begin(USARTClass& hSerial, int aBaud, bool en)
+{
+	m_pSerial = &hSerial;
+	m_pSerial->setCTSPin(DIGIFI_CTS);
+	m_pSerial->enableCTS(en);
+	m_pSerial->begin(aBaud);
+}
+
+USARTClass& UsartSerial::getUsart(void)
+{
+	return *m_pSerial;
+}
+
+int UsartSerial::available(void)
+{
+	return m_pSerial->available();
+}
+
+int UsartSerial::read(void)
+{
+	return m_pSerial->read();
+}
+
+size_t UsartSerial::read(uint8_t* buffer, size_t n)
+{
+	size_t j = 0;
+	while (j < n && m_pSerial->available())
+	{
+		buffer[j++] = m_pSerial->read();
+	}
+	return j;
+}
+
+size_t UsartSerial::write(const uint8_t* buffer, size_t n)
+{
+	return m_pSerial->write(buffer, n);
+}
+#else
+// termios2 is not exported by glibc, this is the kernel layout used by TCGETS2/TCSETS2
+struct esp32_termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+#define ESP32_TCGETS2 _IOR('T', 0x2A, struct esp32_termios2)
+#define ESP32_TCSETS2 _IOW('T', 0x2B, struct esp32_termios2)
+#define ESP32_BOTHER 0010000
+
+static speed_t baudConstant(uint32_t baud)
+{
+	switch (baud)
+	{
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 921600: return B921600;
+	case 1000000: return B1000000;
+	case 2000000: return B2000000;
+	case 3000000: return B3000000;
+	default: return B0;
+	}
+}
+
+TermiosSerial::TermiosSerial()
+	: m_fd(-1)
+{
+}
+
+TermiosSerial::~TermiosSerial()
+{
+	close();
+}
+
+bool TermiosSerial::open(const char path[], uint32_t baud, bool rtscts)
+{
+	close();
+	int fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	if (!attach(fd) || !setBaud(baud) || !setFlowControl(rtscts))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool TermiosSerial::attach(int fd)
+{
+	close();
+	m_fd = fd;
+	int flags = fcntl(m_fd, F_GETFL);
+	if (flags == -1 || fcntl(m_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return false;
+	if (isatty(m_fd) && !makeRaw())
+		return false;
+	return true;
+}
+
+void TermiosSerial::close(void)
+{
+	if (m_fd != -1)
+	{
+		::close(m_fd);
+		m_fd = -1;
+	}
+}
+
+bool TermiosSerial::makeRaw(void)
+{
+	struct termios tio;
+	if (tcgetattr(m_fd, &tio) == -1)
+		return false;
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	return tcsetattr(m_fd, TCSANOW, &tio) == 0;
+}
+
+bool TermiosSerial::setBaud(uint32_t baud)
+{
+	speed_t speed = baudConstant(baud);
+	if (speed != B0)
+	{
+		struct termios tio;
+		if (tcgetattr(m_fd, &tio) == -1)
+			return false;
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+		return tcsetattr(m_fd, TCSANOW, &tio) == 0;
+	}
+	// non standard rate, let the UART driver pick the nearest divisor
+	struct esp32_termios2 tio2;
+	if (ioctl(m_fd, ESP32_TCGETS2, &tio2) == -1)
+		return false;
+	tio2.c_cflag &= ~CBAUD;
+	tio2.c_cflag |= ESP32_BOTHER;
+	tio2.c_ispeed = baud;
+	tio2.c_ospeed = baud;
+	return ioctl(m_fd, ESP32_TCSETS2, &tio2) == 0;
+}
+
+bool TermiosSerial::setFlowControl(bool rtscts)
+{
+	struct termios tio;
+	if (tcgetattr(m_fd, &tio) == -1)
+		return false;
+	if (rtscts)
+		tio.c_cflag |= CRTSCTS;
+	else
+		tio.c_cflag &= ~CRTSCTS;
+	return tcsetattr(m_fd, TCSANOW, &tio) == 0;
+}
+
+bool TermiosSerial::isOpen(void)
+{
+	return m_fd != -1;
+}
+
+int TermiosSerial::available(void)
+{
+	int n = 0;
+	if (m_fd == -1 || ioctl(m_fd, FIONREAD, &n) == -1)
+		return 0;
+	return n;
+}
+
+int TermiosSerial::read(void)
+{
+	uint8_t c;
+	if (read(&c, 1) == 0)
+		return -1;
+	return c;
+}
+
+size_t TermiosSerial::read(uint8_t* buffer, size_t n)
+{
+	if (m_fd == -1)
+		return 0;
+	ssize_t c;
+	do
+	{
+		c = ::read(m_fd, buffer, n);
+	} while (c == -1 && errno == EINTR);
+	return c > 0 ? (size_t)c : 0;
+}
+
+size_t TermiosSerial::write(const uint8_t* buffer, size_t n)
+{
+	size_t j = 0;
+	while (m_fd != -1 && j < n)
+	{
+		ssize_t c = ::write(m_fd, buffer + j, n - j);
+		if (c > 0)
+		{
+			j += c;
+		}
+		else if (c == -1 && errno == EAGAIN)
+		{
+			// output queue full, wait for the UART to drain
+			struct pollfd pfd;
+			pfd.fd = m_fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+		}
+		else if (c == -1 && errno != EINTR)
+		{
+			break;
+		}
+	}
+	return j;
+}
+
+int TermiosSerial::fd(void)
+{
+	return m_fd;
+}
+
+PtyLoopback::PtyLoopback()
+{
+	m_name[0] = 0;
+}
+
+bool PtyLoopback::open(uint32_t baud)
+{
+	close();
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (master == -1)
+		return false;
+	if (grantpt(master) == -1 || unlockpt(master) == -1
+		|| ptsname_r(master, m_name, sizeof(m_name)) != 0)
+	{
+		::close(master);
+		return false;
+	}
+	if (!m_module.attach(master) || !m_device.open(m_name, baud, false))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void PtyLoopback::close(void)
+{
+	m_device.close();
+	m_module.close();
+	m_name[0] = 0;
+}
+
+const char* PtyLoopback::deviceName(void)
+{
+	return m_name;
+}
+
+TermiosSerial& PtyLoopback::device(void)
+{
+	return m_device;
+}
+
+TermiosSerial& PtyLoopback::module(void)
+{
+	return m_module;
+}
+
+static uint32_t getLE(const uint8_t* p, int n)
+{
+	uint32_t v = 0;
+	for (int i = 0; i < n; i++)
+	{
+		v |= (uint32_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+ReplaySerial::ReplaySerial()
+	: m_pClock(&systemClock)
+	, m_owned(NULL)
+	, m_data(NULL)
+	, m_size(0)
+	, m_base(0)
+	, m_first(0)
+	, m_rx(0)
+	, m_rxOffset(0)
+	, m_tx(0)
+	, m_txOffset(0)
+	, m_mismatches(0)
+{
+}
+
+ReplaySerial::~ReplaySerial()
+{
+	free(m_owned);
+}
+
+bool ReplaySerial::load(const char path[], Esp32Clock& clock)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+	uint8_t* data = NULL;
+	long size = -1;
+	if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0)
+	{
+		data = (uint8_t*)malloc(size);
+		if (data != NULL && fread(data, 1, size, f) != (size_t)size)
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(f);
+	if (data == NULL || !attach(data, size, clock))
+	{
+		free(data);
+		return false;
+	}
+	free(m_owned);
+	m_owned = data;
+	return true;
+}
+
+bool ReplaySerial::attach(const uint8_t* data, size_t size, Esp32Clock& clock)
+{
+	if (size < CaptureSerial::HEADER_SIZE || memcmp(data, "E32W", 4) != 0
+		|| getLE(data + 4, 2) != CaptureSerial::VERSION)
+		return false;
+	m_data = data;
+	m_size = size;
+	m_pClock = &clock;
+	size_t pos = CaptureSerial::HEADER_SIZE;
+	m_first = next(&pos, false) || next(&pos, true) ? recordTime(pos) : 0;
+	pos = CaptureSerial::HEADER_SIZE;
+	if (next(&pos, true))
+	{
+		// the first chunk is whichever comes first
+		uint32_t t = recordTime(pos);
+		if ((int32_t)(t - m_first) < 0)
+			m_first = t;
+	}
+	rewind();
+	return true;
+}
+
+void ReplaySerial::rewind(void)
+{
+	m_base = m_pClock->micros();
+	m_rx = CaptureSerial::HEADER_SIZE;
+	m_tx = CaptureSerial::HEADER_SIZE;
+	m_rxOffset = 0;
+	m_txOffset = 0;
+	m_mismatches = 0;
+	next(&m_rx, false);
+	next(&m_tx, true);
+}
+
+bool ReplaySerial::done(void)
+{
+	return m_rx >= m_size;
+}
+
+uint32_t ReplaySerial::nextTime(void)
+{
+	if (done())
+		return NO_DATA;
+	return m_base + (recordTime(m_rx) - m_first);
+}
+
+uint32_t ReplaySerial::mismatches(void)
+{
+	return m_mismatches;
+}
+
+int ReplaySerial::available(void)
+{
+	if (done() || !Esp32Clock::reached(m_pClock->micros(), nextTime()))
+		return 0;
+	return recordLength(m_rx) - m_rxOffset;
+}
+
+int ReplaySerial::read(void)
+{
+	uint8_t c;
+	if (read(&c, 1) == 0)
+		return -1;
+	return c;
+}
+
+size_t ReplaySerial::read(uint8_t* buffer, size_t n)
+{
+	size_t j = 0;
+	uint32_t now = m_pClock->micros();
+	while (j < n && !done() && Esp32Clock::reached(now, nextTime()))
+	{
+		size_t len = recordLength(m_rx);
+		size_t c = len - m_rxOffset;
+		if (c > n - j)
+			c = n - j;
+		memcpy(buffer + j, m_data + m_rx + CaptureSerial::RECORD_HEADER_SIZE + m_rxOffset, c);
+		j += c;
+		m_rxOffset += c;
+		if (m_rxOffset == len)
+		{
+			m_rx += CaptureSerial::RECORD_HEADER_SIZE + len;
+			m_rxOffset = 0;
+			next(&m_rx, false);
+		}
+	}
+	return j;
+}
+
+size_t ReplaySerial::write(const uint8_t* buffer, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		if (m_tx >= m_size)
+		{
+			m_mismatches += n - i;
+			break;
+		}
+		if (m_data[m_tx + CaptureSerial::RECORD_HEADER_SIZE + m_txOffset] != buffer[i])
+			m_mismatches++;
+		if (++m_txOffset == recordLength(m_tx))
+		{
+			m_tx += CaptureSerial::RECORD_HEADER_SIZE + m_txOffset;
+			m_txOffset = 0;
+			next(&m_tx, true);
+		}
+	}
+	return n;
+}
+
+// moves pos to the first record at or after it going the given way, to the end if none
+bool ReplaySerial::next(size_t* pos, bool tx)
+{
+	while (*pos + CaptureSerial::RECORD_HEADER_SIZE <= m_size)
+	{
+		size_t len = recordLength(*pos);
+		if (*pos + CaptureSerial::RECORD_HEADER_SIZE + len > m_size) // cut short
+			break;
+		bool is_tx = (getLE(m_data + *pos + 4, 2) & CaptureSerial::TX_FLAG) != 0;
+		if (is_tx == tx && len > 0)
+			return true;
+		*pos += CaptureSerial::RECORD_HEADER_SIZE + len;
+	}
+	*pos = m_size;
+	return false;
+}
+
+uint32_t ReplaySerial::recordTime(size_t pos)
+{
+	return getLE(m_data + pos, 4);
+}
+
+size_t ReplaySerial::recordLength(size_t pos)
+{
+	return getLE(m_data + pos + 4, 2) & ~CaptureSerial::TX_FLAG & 0xffff;
+}
+#endif
@@ -0,0 +1,181 @@
+// Serial backends for the ESP32 AT driver
+
+
+#ifndef _ESP32SERIAL_h
+#define _ESP32SERIAL_h
+
+#ifdef WIN32
+#include "win32_test/win32_test.h"
+#include "win32_test/serial_test.h"
+#elif !defined(__linux__)
+#include "Arduino.h"
+#endif
+#include <stdint.h>
+#include <stddef.h>
+#include "ESP32Clock.h"
+
+#define DIGIFI_RTS  57
+#define DIGIFI_CTS  58
+
+// byte stream the driver talks to the module through
+class Esp32Serial
+{
+public:
+	virtual ~Esp32Serial() {}
+	virtual int available(void) = 0;
+	virtual int read(void) = 0; // -1 if no data
+	virtual size_t read(uint8_t* buffer, size_t n) = 0; // never blocks, returns count read
+	virtual size_t write(const uint8_t* buffer, size_t n) = 0; // blocks until all written
+	virtual int fd(void) { return -1; } // descriptor for Esp32::waitEvent(), -1 if none
+};
+
+// passes everything to another serial and records each chunk read or written
+// with its time. The capture is a 12 byte header, then per chunk a 4 byte time
+// in us, a 2 byte length with TX_FLAG set for written data, and the bytes, all
+// little endian. It goes to a buffer given by the application, or a file on Linux
+class CaptureSerial : public Esp32Serial
+{
+public:
+	const static uint16_t VERSION = 1;
+	const static uint16_t TX_FLAG = 0x8000;
+	const static size_t HEADER_SIZE = 12;
+	const static size_t RECORD_HEADER_SIZE = 6;
+	const static size_t CHUNK_MAX_SIZE = 0x7fff;
+
+	CaptureSerial();
+#ifdef __linux__
+	~CaptureSerial();
+#endif
+	void begin(Esp32Serial& serial, Esp32Clock& clock = systemClock);
+	void setBuffer(uint8_t* buffer, size_t size); // records stop when the buffer is full
+	size_t length(void); // bytes captured in the buffer, header included
+	uint32_t dropped(void); // chunks not recorded for lack of room
+#ifdef __linux__
+	bool open(const char path[]);
+	void close(void);
+#endif
+
+	int available(void);
+	int read(void);
+	size_t read(uint8_t* buffer, size_t n);
+	size_t write(const uint8_t* buffer, size_t n);
+	int fd(void);
+
+private:
+	Esp32Serial* m_pSerial;
+	Esp32Clock* m_pClock;
+	uint8_t* m_buffer;
+	size_t m_size;
+	size_t m_len;
+	uint32_t m_dropped;
+#ifdef __linux__
+	int m_fd;
+#endif
+
+	void writeHeader(void);
+	void record(bool tx, const uint8_t* p, size_t n);
+	bool put(const uint8_t* p, size_t n);
+};
+
+#ifndef __linux__
+// Arduino USART, the module on the DigiX board
+class UsartSerial : public Esp32Serial
+{
+public:
+	UsartSerial();
+	void begin(USARTClass& hSerial, int aBaud = 115200, bool en = false);
+	USARTClass& getUsart(void);
+
+	int available(void);
+	int read(void);
+	size_t read(uint8_t* buffer, size_t n);
+	size_t write(const uint8_t* buffer, size_t n);
+
+private:
+	USARTClass* m_pSerial;
+};
+#else
+// tty device in raw mode, e.g. /dev/ttyUSB0 on a Linux gateway
+class TermiosSerial : public Esp32Serial
+{
+public:
+	TermiosSerial();
+	~TermiosSerial();
+	bool open(const char path[], uint32_t baud = 115200, bool rtscts = false);
+	bool attach(int fd); // take over an already opened descriptor, it is closed by close()
+	void close(void);
+	bool setBaud(uint32_t baud); // any rate the UART driver accepts, not only the Bxxx constants
+	bool setFlowControl(bool rtscts);
+	bool isOpen(void);
+
+	int available(void);
+	int read(void);
+	size_t read(uint8_t* buffer, size_t n);
+	size_t write(const uint8_t* buffer, size_t n);
+	int fd(void);
+
+private:
+	int m_fd;
+
+	bool makeRaw(void);
+};
+
+// pseudo terminal pair: the driver opens device(), a module emulator drives module()
+class PtyLoopback
+{
+public:
+	PtyLoopback();
+	bool open(uint32_t baud = 115200);
+	void close(void);
+	const char* deviceName(void);
+	TermiosSerial& device(void);
+	TermiosSerial& module(void);
+
+private:
+	TermiosSerial m_device;
+	TermiosSerial m_module;
+	char m_name[64];
+};
+
+// plays a capture back to the driver under virtual time: received chunks become
+// readable once the clock reaches their time, rebased to when the capture was
+// loaded, and written data is compared with what was written in the field
+class ReplaySerial : public Esp32Serial
+{
+public:
+	const static uint32_t NO_DATA = 0xffffffff;
+
+	ReplaySerial();
+	~ReplaySerial();
+	bool load(const char path[], Esp32Clock& clock);
+	bool attach(const uint8_t* data, size_t size, Esp32Clock& clock); // data must stay valid
+	void rewind(void); // play again from the start, rebased to the clock now
+	bool done(void); // every received chunk was read
+	uint32_t nextTime(void); // clock time of the next received data, NO_DATA if none
+	uint32_t mismatches(void); // written bytes that differ from the capture or go beyond it
+
+	int available(void);
+	int read(void);
+	size_t read(uint8_t* buffer, size_t n);
+	size_t write(const uint8_t* buffer, size_t n);
+
+private:
+	Esp32Clock* m_pClock;
+	uint8_t* m_owned; // file contents from load()
+	const uint8_t* m_data;
+	size_t m_size;
+	uint32_t m_base; // clock time of the first chunk
+	uint32_t m_first; // capture time of the first chunk
+	size_t m_rx; // record of the next received chunk
+	size_t m_rxOffset; // bytes of it already read
+	size_t m_tx; // record of the next written chunk
+	size_t m_txOffset;
+	uint32_t m_mismatches;
+
+	bool next(size_t* pos, bool tx);
+	uint32_t recordTime(size_t pos);
+	size_t recordLength(size_t pos);
+};
+#endif
+
+#endif
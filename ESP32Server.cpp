@@ -0,0 +1,333 @@
+#include "ESP32Server.h"
+
+Esp32Server::Esp32Server(Esp32& esp)
+	: m_esp(esp)
+	, m_handler(NULL)
+	, m_port(0)
+	, m_maxClients(Esp32::LINK_MAX)
+	, m_timeout(SERVER_TIMEOUT)
+	, m_setup(SETUP_NONE)
+	, m_waiting(false)
+	, m_idleTimeout(0)
+	, m_quantum(QUANTUM)
+	, m_next(0)
+	, m_sending(-1)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		Session& s = m_sessions[i];
+		s.server = this;
+		s.client.link_id = i;
+		s.client.active = false;
+		s.client.context = NULL;
+		s.closing = false;
+		s.rx_head = 0;
+		s.rx_len = 0;
+		s.timer.init(onIdle, &s);
+	}
+}
+
+bool Esp32Server::begin(IServer* handler, uint16_t port, uint8_t max_clients, uint16_t timeout)
+{
+	if (handler == NULL || max_clients == 0 || (m_setup != SETUP_NONE && m_setup != SETUP_DONE))
+		return false;
+	m_handler = handler;
+	m_port = port;
+	m_maxClients = max_clients < Esp32::LINK_MAX ? max_clients : Esp32::LINK_MAX;
+	m_timeout = timeout;
+	m_setup = SETUP_MAXCONN;
+	return true;
+}
+
+void Esp32Server::end(void)
+{
+	if (m_setup == SETUP_NONE)
+		return;
+	m_setup = SETUP_STOP;
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		if (m_sessions[i].client.active)
+			m_sessions[i].closing = true;
+	}
+}
+
+void Esp32Server::setIdleTimeout(uint32_t ms)
+{
+	m_idleTimeout = ms;
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		Session& s = m_sessions[i];
+		if (!s.client.active)
+			continue;
+		if (ms > 0)
+			touch(s);
+		else
+			m_esp.getTimers().cancel(s.timer);
+	}
+}
+
+void Esp32Server::setQuantum(size_t bytes)
+{
+	m_quantum = bytes > 0 ? bytes : 1;
+}
+
+bool Esp32Server::send(uint8_t link_id, const byte* data, size_t size)
+{
+	if (link_id >= Esp32::LINK_MAX || !m_sessions[link_id].client.active || m_sending != -1)
+		return false;
+	Session& s = m_sessions[link_id];
+	if (!m_esp.sendBytesMUX(this, link_id, (byte*)data, size))
+		return false;
+	m_sending = link_id;
+	s.client.tx_bytes += size;
+	touch(s);
+	return true;
+}
+
+void Esp32Server::close(uint8_t link_id)
+{
+	if (link_id < Esp32::LINK_MAX && m_sessions[link_id].client.active)
+		m_sessions[link_id].closing = true;
+}
+
+Esp32Server::Client* Esp32Server::getClient(uint8_t link_id)
+{
+	if (link_id >= Esp32::LINK_MAX || !m_sessions[link_id].client.active)
+		return NULL;
+	return &m_sessions[link_id].client;
+}
+
+int Esp32Server::clientCount(void)
+{
+	int n = 0;
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		if (m_sessions[i].client.active)
+			n++;
+	}
+	return n;
+}
+
+const Esp32Server::ServerStats& Esp32Server::getStats(void)
+{
+	return m_stats;
+}
+
+void Esp32Server::loop(void)
+{
+	// the module does not always print CLOSED for a link closed by AT+CIPCLOSE
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		Session& s = m_sessions[i];
+		if (s.client.active && !m_esp.isConnected(i))
+			closed(s);
+	}
+	// one round, each client gets a quantum and the round starts one client further each time
+	for (int k = 0; k < Esp32::LINK_MAX; k++)
+	{
+		Session& s = m_sessions[(m_next + k) % Esp32::LINK_MAX];
+		if (s.client.active && s.rx_len > 0)
+			deliver(s, m_quantum);
+	}
+	m_next = (m_next + 1) % Esp32::LINK_MAX;
+	if (m_waiting || m_sending != -1)
+		return;
+	if (m_setup != SETUP_NONE && m_setup != SETUP_DONE)
+	{
+		setup();
+		return;
+	}
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		Session& s = m_sessions[i];
+		if (s.closing && m_esp.closeConnect(this, i))
+		{
+			s.closing = false;
+			return;
+		}
+	}
+}
+
+void Esp32Server::setup(void)
+{
+	switch (m_setup)
+	{
+	case SETUP_MAXCONN:
+		m_waiting = m_esp.setServerMaxConn(this, m_maxClients);
+		break;
+	case SETUP_SERVER:
+		m_waiting = m_esp.startTCPServer(this, m_port);
+		break;
+	case SETUP_TIMEOUT:
+		m_waiting = m_esp.setServerTimeout(this, m_timeout);
+		break;
+	case SETUP_STOP:
+		m_waiting = m_esp.stopTCPServer(this, m_port);
+		break;
+	default:
+		break;
+	}
+}
+
+void Esp32Server::cbServer(Esp32::ResponseType state)
+{
+	m_waiting = false;
+	if (m_setup == SETUP_STOP)
+	{
+		m_setup = SETUP_NONE;
+		return;
+	}
+	// firmware without AT+CIPSERVERMAXCONN, the limit is kept by the server alone
+	if (state != Esp32::RESPONSE_OK && m_setup != SETUP_MAXCONN)
+	{
+		m_setup = SETUP_NONE;
+		m_handler->cbServerStarted(state);
+		return;
+	}
+	m_setup = (Setup)(m_setup + 1);
+	if (m_setup == SETUP_DONE)
+		m_handler->cbServerStarted(Esp32::RESPONSE_OK);
+}
+
+void Esp32Server::cbSend(Esp32::ResponseType state)
+{
+	if (m_sending == -1)
+		return;
+	Session& s = m_sessions[m_sending];
+	m_sending = -1;
+	if (s.client.active)
+		m_handler->cbClientSent(s.client, state);
+}
+
+void Esp32Server::cbWritable(int link_id, size_t window)
+{
+	Session& s = m_sessions[link_id];
+	if (s.client.active)
+		m_handler->cbClientWritable(s.client, window);
+}
+
+void Esp32Server::cbLinkAccepted(int link_id)
+{
+	Session& s = m_sessions[link_id];
+	m_esp.setLinkOwner(link_id, this);
+	if (m_setup != SETUP_DONE || m_handler == NULL || clientCount() >= m_maxClients)
+	{
+		// data of the link is dropped until it is closed
+		m_stats.rejected++;
+		s.closing = true;
+		return;
+	}
+	s.client.active = true;
+	s.client.rx_bytes = 0;
+	s.client.tx_bytes = 0;
+	s.client.context = NULL;
+	s.closing = false;
+	s.rx_head = 0;
+	s.rx_len = 0;
+	m_stats.accepted++;
+	m_stats.active++;
+	if (m_stats.active > m_stats.active_max)
+		m_stats.active_max = m_stats.active;
+	touch(s);
+	m_handler->cbClientAccepted(s.client);
+}
+
+void Esp32Server::cbLinkClosed(int link_id)
+{
+	closed(m_sessions[link_id]);
+}
+
+void Esp32Server::closed(Session& s)
+{
+	s.closing = false;
+	m_esp.setLinkOwner(s.client.link_id, NULL);
+	if (!s.client.active)
+		return;
+	deliver(s, s.rx_len);
+	m_esp.getTimers().cancel(s.timer);
+	s.client.active = false;
+	m_stats.active--;
+	m_handler->cbClientClosed(s.client);
+}
+
+void Esp32Server::cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end)
+{
+	Session& s = m_sessions[link_id];
+	if (!s.client.active)
+		return;
+	while (begin < end)
+	{
+		uint8_t* p;
+		size_t n = buffer.segment(begin, end, &p);
+		if (n == 0)
+			break;
+		enqueue(s, p, n);
+		begin += n;
+	}
+}
+
+void Esp32Server::cbReceivedDirect(int link_id, byte* buffer, size_t size)
+{
+	Session& s = m_sessions[link_id];
+	if (s.client.active)
+		enqueue(s, buffer, size);
+}
+
+void Esp32Server::enqueue(Session& s, const byte* p, size_t n)
+{
+	s.client.rx_bytes += n;
+	touch(s);
+	if (s.rx_len + n > RX_QUEUE_SIZE)
+	{
+		// nothing is dropped, the client loses its turn instead
+		deliver(s, s.rx_len);
+		m_stats.overflow += n;
+		m_handler->cbClientData(s.client, p, n);
+		return;
+	}
+	m_stats.queued += n;
+	while (n > 0)
+	{
+		int tail = (s.rx_head + s.rx_len) % RX_QUEUE_SIZE;
+		size_t c = RX_QUEUE_SIZE - tail;
+		if (c > n)
+			c = n;
+		memcpy(s.rx + tail, p, c);
+		s.rx_len += c;
+		p += c;
+		n -= c;
+	}
+}
+
+void Esp32Server::deliver(Session& s, size_t n)
+{
+	while (n > 0 && s.rx_len > 0 && s.client.active)
+	{
+		size_t c = RX_QUEUE_SIZE - s.rx_head;
+		if (c > (size_t)s.rx_len)
+			c = s.rx_len;
+		if (c > n)
+			c = n;
+		const byte* p = s.rx + s.rx_head;
+		s.rx_head = (s.rx_head + c) % RX_QUEUE_SIZE;
+		s.rx_len -= c;
+		n -= c;
+		m_handler->cbClientData(s.client, p, c);
+	}
+}
+
+void Esp32Server::touch(Session& s)
+{
+	if (m_idleTimeout > 0)
+		m_esp.getTimers().arm(s.timer, m_idleTimeout);
+}
+
+void Esp32Server::onIdle(void* arg)
+{
+	Session* s = (Session*)arg;
+	if (!s->client.active)
+		return;
+	s->server->m_stats.idle_closed++;
+	s->closing = true;
+}
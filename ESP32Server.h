@@ -0,0 +1,129 @@
+// TCP server sessions for the ESP32 AT driver
+
+
+#ifndef _ESP32SERVER_h
+#define _ESP32SERVER_h
+
+#include "ESP32WROOM.h"
+
+class IServer;
+
+// accepts clients on one port and keeps a session per client link. Received
+// data is queued per client and handed over round robin, at most a quantum per
+// client on each loop(), so one busy client does not hold up the others. Clients
+// quiet for the idle timeout are closed by the server, AT+CIPSTO is the module's
+// own limit in seconds
+class Esp32Server : public IWifi
+{
+public:
+	const static int RX_QUEUE_SIZE = 512; // per client
+	const static size_t QUANTUM = 128;
+	const static uint16_t SERVER_TIMEOUT = 180; // s
+
+	typedef struct _CLIENT {
+		uint8_t link_id;
+		bool active;
+		uint32_t rx_bytes;
+		uint32_t tx_bytes;
+		void* context; // for the application
+	} Client;
+	typedef struct _SERVER_STATS {
+		uint32_t accepted;
+		uint32_t rejected; // over the client limit
+		uint32_t idle_closed;
+		uint32_t active;
+		uint32_t active_max;
+		uint32_t queued; // bytes that waited for their turn
+		uint32_t overflow; // bytes handed over at once because the queue was full
+	} ServerStats;
+
+	Esp32Server(Esp32& esp);
+	// the module must be in MUX mode. The server is set up from loop(), cbServerStarted
+	// tells the result
+	bool begin(IServer* handler, uint16_t port, uint8_t max_clients = Esp32::LINK_MAX, uint16_t timeout = SERVER_TIMEOUT);
+	void end(void);
+	void setIdleTimeout(uint32_t ms); // 0 to leave idle clients to the module
+	void setQuantum(size_t bytes);
+	bool send(uint8_t link_id, const byte* data, size_t size); // false while the command slot is busy
+	void close(uint8_t link_id);
+	Client* getClient(uint8_t link_id); // NULL if no client on the link
+	int clientCount(void);
+	void loop(void); // call after Esp32::loop()
+	const ServerStats& getStats(void);
+
+	// IWifi, the server issues its own commands and owns the data of its clients
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end);
+	void cbReceivedDirect(int link_id, byte* buffer, size_t size);
+	void cbSend(Esp32::ResponseType state);
+	void cbWritable(int link_id, size_t window);
+	void cbServer(Esp32::ResponseType state);
+	void cbLinkAccepted(int link_id);
+	void cbLinkClosed(int link_id);
+
+private:
+	enum Setup {
+		SETUP_NONE = 0,
+		SETUP_MAXCONN,
+		SETUP_SERVER,
+		SETUP_TIMEOUT,
+		SETUP_DONE,
+		SETUP_STOP
+	};
+	typedef struct _SESSION {
+		Esp32Server* server;
+		Client client;
+		bool closing; // close wanted, not issued yet
+		byte rx[RX_QUEUE_SIZE];
+		int rx_head;
+		int rx_len;
+		Esp32Timer timer; // idle timeout
+	} Session;
+
+	Esp32& m_esp;
+	IServer* m_handler;
+	uint16_t m_port;
+	uint8_t m_maxClients;
+	uint16_t m_timeout;
+	Setup m_setup;
+	bool m_waiting; // setup command in flight
+	uint32_t m_idleTimeout;
+	size_t m_quantum;
+	int m_next; // first session of the next round
+	int m_sending; // session whose send is in flight, -1 if none
+	Session m_sessions[Esp32::LINK_MAX];
+	ServerStats m_stats;
+
+	void setup(void);
+	void enqueue(Session& s, const byte* p, size_t n);
+	void deliver(Session& s, size_t n);
+	void touch(Session& s);
+	void closed(Session& s);
+	static void onIdle(void* arg);
+};
+
+class IServer
+{
+public:
+	virtual void cbServerStarted(Esp32::ResponseType) {}
+	virtual void cbClientAccepted(Esp32Server::Client& client) = 0;
+	virtual void cbClientData(Esp32Server::Client& client, const byte* data, size_t size) = 0;
+	virtual void cbClientClosed(Esp32Server::Client& client) = 0; // queued data was handed over before
+	virtual void cbClientSent(Esp32Server::Client& client, Esp32::ResponseType) {}
+	virtual void cbClientWritable(Esp32Server::Client& client, size_t window) {}
+};
+
+#endif
@@ -0,0 +1,264 @@
+#include "ESP32Timer.h"
+#include <string.h>
+
+Esp32Timer::Esp32Timer()
+	: m_next(NULL)
+	, m_prev(NULL)
+	, m_expires(0)
+	, m_level(0)
+	, m_slot(0)
+	, m_armed(false)
+	, m_cb(NULL)
+	, m_arg(NULL)
+{
+}
+
+Esp32Timer::Esp32Timer(Esp32TimerCallback cb, void* arg)
+	: m_next(NULL)
+	, m_prev(NULL)
+	, m_expires(0)
+	, m_level(0)
+	, m_slot(0)
+	, m_armed(false)
+	, m_cb(cb)
+	, m_arg(arg)
+{
+}
+
+void Esp32Timer::init(Esp32TimerCallback cb, void* arg)
+{
+	m_cb = cb;
+	m_arg = arg;
+}
+
+bool Esp32Timer::isArmed(void)
+{
+	return m_armed;
+}
+
+// index of the first set bit at or after pos going round the wheel, -1 if none
+static int nextSlot(uint64_t bits, int pos)
+{
+	if (bits == 0)
+		return -1;
+	uint64_t rotated = pos == 0 ? bits : (bits >> pos) | (bits << (64 - pos));
+	return (pos + __builtin_ctzll(rotated)) & (Esp32TimerWheel::SLOTS - 1);
+}
+
+Esp32TimerWheel::Esp32TimerWheel(Esp32Clock& clock)
+	: m_pClock(&clock)
+	, m_lastUs(0)
+	, m_started(false)
+	, m_tick(0)
+	, m_count(0)
+{
+	memset(m_slots, 0, sizeof(m_slots));
+	memset(m_occupied, 0, sizeof(m_occupied));
+}
+
+void Esp32TimerWheel::setClock(Esp32Clock& clock)
+{
+	// armed timers keep their remaining ticks
+	m_pClock = &clock;
+	m_lastUs = clock.micros();
+	m_started = true;
+}
+
+uint32_t Esp32TimerWheel::lagTicks(void)
+{
+	// the clock is read first here rather than in the constructor: a global driver
+	// may be built before systemClock, which lives in another translation unit
+	if (!m_started)
+	{
+		m_lastUs = m_pClock->micros();
+		m_started = true;
+	}
+	return Esp32Clock::elapsed(m_pClock->micros(), m_lastUs) / TICK_US;
+}
+
+void Esp32TimerWheel::arm(Esp32Timer& timer, uint32_t ms)
+{
+	if (timer.m_armed)
+		unlink(timer);
+	else
+		m_count++;
+	// m_tick may lag the clock until the next advance(), and the slot of the
+	// current tick has already run, so the first possible expiry is the next tick
+	timer.m_expires = m_tick + lagTicks() + (ms > 0 ? ms : 1);
+	timer.m_armed = true;
+	place(timer);
+}
+
+void Esp32TimerWheel::cancel(Esp32Timer& timer)
+{
+	if (!timer.m_armed)
+		return;
+	unlink(timer);
+	timer.m_armed = false;
+	m_count--;
+}
+
+int Esp32TimerWheel::count(void)
+{
+	return m_count;
+}
+
+void Esp32TimerWheel::place(Esp32Timer& timer)
+{
+	uint32_t delta = timer.m_expires - m_tick;
+	int level = 0;
+	if ((int32_t)delta <= 0)
+		delta = 0; // overdue, runs with the current slot
+	while (level < LEVELS - 1 && delta >= (uint32_t)1 << (SLOT_BITS * (level + 1)))
+	{
+		level++;
+	}
+	uint32_t expires = timer.m_expires;
+	if (delta >= (uint32_t)1 << (SLOT_BITS * LEVELS))
+		expires = m_tick + ((uint32_t)1 << (SLOT_BITS * LEVELS)) - 1; // beyond the wheel, park in the last slot
+	else if ((int32_t)(expires - m_tick) < 0)
+		expires = m_tick;
+	int slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+	timer.m_level = level;
+	timer.m_slot = slot;
+	timer.m_prev = NULL;
+	timer.m_next = m_slots[level][slot];
+	if (timer.m_next != NULL)
+		timer.m_next->m_prev = &timer;
+	m_slots[level][slot] = &timer;
+	m_occupied[level] |= (uint64_t)1 << slot;
+}
+
+void Esp32TimerWheel::unlink(Esp32Timer& timer)
+{
+	if (timer.m_prev != NULL)
+		timer.m_prev->m_next = timer.m_next;
+	else
+		m_slots[timer.m_level][timer.m_slot] = timer.m_next;
+	if (timer.m_next != NULL)
+		timer.m_next->m_prev = timer.m_prev;
+	if (m_slots[timer.m_level][timer.m_slot] == NULL)
+		m_occupied[timer.m_level] &= ~((uint64_t)1 << timer.m_slot);
+	timer.m_next = NULL;
+	timer.m_prev = NULL;
+}
+
+void Esp32TimerWheel::cascade(int level)
+{
+	int slot = (m_tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+	Esp32Timer* t = m_slots[level][slot];
+	m_slots[level][slot] = NULL;
+	m_occupied[level] &= ~((uint64_t)1 << slot);
+	while (t != NULL)
+	{
+		Esp32Timer* next = t->m_next;
+		place(*t);
+		t = next;
+	}
+}
+
+void Esp32TimerWheel::expire(void)
+{
+	// move timers down from the levels whose slot boundary is this tick
+	for (int level = 1; level < LEVELS; level++)
+	{
+		if ((m_tick & (((uint32_t)1 << (SLOT_BITS * level)) - 1)) != 0)
+			break;
+		cascade(level);
+	}
+	int slot = m_tick & (SLOTS - 1);
+	Esp32Timer* t = m_slots[0][slot];
+	m_slots[0][slot] = NULL;
+	m_occupied[0] &= ~((uint64_t)1 << slot);
+	while (t != NULL)
+	{
+		// unlink before the callback so it may re-arm or cancel any timer
+		Esp32Timer* next = t->m_next;
+		if (next != NULL)
+		{
+			next->m_prev = NULL;
+			m_slots[0][slot] = next;
+			m_occupied[0] |= (uint64_t)1 << slot;
+		}
+		else
+		{
+			m_slots[0][slot] = NULL;
+			m_occupied[0] &= ~((uint64_t)1 << slot);
+		}
+		t->m_next = NULL;
+		t->m_armed = false;
+		m_count--;
+		if (t->m_cb != NULL)
+			t->m_cb(t->m_arg);
+		t = m_slots[0][slot];
+	}
+}
+
+void Esp32TimerWheel::advance(void)
+{
+	uint32_t ticks = lagTicks();
+	m_lastUs += ticks * TICK_US;
+	while (ticks > 0)
+	{
+		if (m_count == 0)
+		{
+			m_tick += ticks;
+			break;
+		}
+		// jump to the last tick before the next first level boundary when
+		// nothing on the first level is due before it
+		uint32_t pos = m_tick & (SLOTS - 1);
+		uint32_t gap = SLOTS - 1 - pos;
+		if (gap > 0 && ticks > gap)
+		{
+			uint64_t ahead = m_occupied[0] & (~(uint64_t)0 << (pos + 1));
+			if (ahead == 0)
+			{
+				m_tick += gap;
+				ticks -= gap;
+			}
+		}
+		m_tick++;
+		ticks--;
+		expire();
+	}
+}
+
+uint32_t Esp32TimerWheel::nextTimeout(void)
+{
+	if (m_count == 0)
+		return NO_TIMEOUT;
+	uint32_t best = NO_TIMEOUT;
+	for (int level = 0; level < LEVELS; level++)
+	{
+		if (m_occupied[level] == 0)
+			continue;
+		int pos = (m_tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+		uint32_t ticks;
+		if (level == 0)
+		{
+			// first level slots hold exact expiries, the current slot only holds overdue timers
+			if (m_occupied[0] & ((uint64_t)1 << pos))
+				return 0;
+			int slot = nextSlot(m_occupied[0], (pos + 1) & (SLOTS - 1));
+			ticks = (slot - pos) & (SLOTS - 1);
+		}
+		else
+		{
+			// higher levels: the first occupied slot after the current one holds
+			// the level's earliest expiries, scan its list for the exact one
+			int slot = nextSlot(m_occupied[level], (pos + 1) & (SLOTS - 1));
+			ticks = NO_TIMEOUT;
+			for (Esp32Timer* t = m_slots[level][slot]; t != NULL; t = t->m_next)
+			{
+				uint32_t delta = t->m_expires - m_tick;
+				if (delta < ticks)
+					ticks = delta;
+			}
+		}
+		if (ticks < best)
+			best = ticks;
+	}
+	uint32_t lag = lagTicks();
+	return best > lag ? best - lag : 0;
+}
@@ -0,0 +1,73 @@
+// Timer wheel for the ESP32 AT driver
+
+
+#ifndef _ESP32TIMER_h
+#define _ESP32TIMER_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ESP32Clock.h"
+
+typedef void (*Esp32TimerCallback)(void* arg);
+
+// a timer is owned by whoever arms it and linked into the wheel while armed,
+// so arming and cancelling never allocate
+class Esp32Timer
+{
+public:
+	Esp32Timer();
+	Esp32Timer(Esp32TimerCallback cb, void* arg);
+	void init(Esp32TimerCallback cb, void* arg);
+	bool isArmed(void);
+
+private:
+	friend class Esp32TimerWheel;
+	Esp32Timer* m_next;
+	Esp32Timer* m_prev;
+	uint32_t m_expires; // tick
+	uint8_t m_level;
+	uint8_t m_slot;
+	bool m_armed;
+	Esp32TimerCallback m_cb;
+	void* m_arg;
+};
+
+// hierarchical timing wheel with 1 ms ticks: 4 levels of 64 slots cover ~4.6 hours,
+// longer timers are cascaded again when they reach the top level.
+// arm() and cancel() are O(1), expiry walks one slot per tick and skips empty
+// stretches of the first level with its occupancy bitmap, nextTimeout() finds the
+// first occupied slot of each level from the bitmaps
+class Esp32TimerWheel
+{
+public:
+	const static int SLOT_BITS = 6;
+	const static int SLOTS = 1 << SLOT_BITS;
+	const static int LEVELS = 4;
+	const static uint32_t TICK_US = 1000;
+	const static uint32_t NO_TIMEOUT = 0xffffffff;
+
+	Esp32TimerWheel(Esp32Clock& clock);
+	void setClock(Esp32Clock& clock);
+	void arm(Esp32Timer& timer, uint32_t ms); // re-arms if already armed
+	void cancel(Esp32Timer& timer);
+	void advance(void); // run the callbacks of every expired timer
+	uint32_t nextTimeout(void); // ms until the next expiry, NO_TIMEOUT if nothing is armed
+	int count(void);
+
+private:
+	Esp32Clock* m_pClock;
+	uint32_t m_lastUs; // clock time of m_tick
+	bool m_started; // m_lastUs was read from the clock
+	uint32_t m_tick;
+	int m_count;
+	Esp32Timer* m_slots[LEVELS][SLOTS];
+	uint64_t m_occupied[LEVELS];
+
+	void place(Esp32Timer& timer);
+	void unlink(Esp32Timer& timer);
+	void cascade(int level);
+	void expire(void);
+	uint32_t lagTicks(void);
+};
+
+#endif
@@ -0,0 +1,138 @@
+// Response tokens of the ESP32 AT firmware, included by ESP32WROOM.cpp only
+
+
+#ifndef _ESP32TOKEN_h
+#define _ESP32TOKEN_h
+
+#include <stdint.h>
+
+// every text the parser looks for, with its length counted by the compiler.
+// The line tokens come first and are told apart by a perfect hash of a few of
+// their bytes, so a line is classified with one table lookup and one compare
+enum ResponseToken {
+	TOKEN_OK = 0,
+	TOKEN_ERROR,
+	TOKEN_SEND_OK,
+	TOKEN_SEND_FAIL,
+	TOKEN_BUSY,
+	TOKEN_READY,
+	TOKEN_WIFI_DISCONNECT,
+	TOKEN_WIFI_GOT_IP,
+	TOKEN_WIFI_CONNECTED,
+	TOKEN_CLOSED,
+	TOKEN_CONNECT,
+	TOKEN_RECV,
+	TOKEN_IPD,
+	TOKEN_CIFSR,
+	TOKEN_CIPAP,
+	TOKEN_CIPSTA,
+	TOKEN_CIPDOMAIN,
+	TOKEN_CWLAP,
+	TOKEN_CWMODE,
+	TOKEN_CIPMUX,
+	TOKEN_CWJAP,
+	TOKEN_NO_AP,
+	TOKEN_LINE_MAX,
+	// fields after a line token, matched where the handler expects them
+	TOKEN_APIP = TOKEN_LINE_MAX,
+	TOKEN_STAIP,
+	TOKEN_IP,
+	TOKEN_NETMASK,
+	TOKEN_GATEWAY,
+	TOKEN_CIPSTATUS, // shares its key with "+CIPSTA:"
+	TOKEN_MAX,
+	TOKEN_NONE = 0xff
+};
+
+typedef struct _TOKEN_TEXT {
+	const char* text;
+	uint8_t size; // without the terminating 0
+} TokenText;
+
+#define TOKEN_TEXT(s) { s, sizeof(s) - 1 }
+
+// in the order of ResponseToken
+static constexpr TokenText s_tokens[] = {
+	TOKEN_TEXT("OK\r\n"),
+	TOKEN_TEXT("ERROR\r\n"),
+	TOKEN_TEXT("SEND OK\r\n"),
+	TOKEN_TEXT("SEND FAIL\r\n"),
+	TOKEN_TEXT("busy p...\r\n"),
+	TOKEN_TEXT("ready\r\n"),
+	TOKEN_TEXT("WIFI DISCONNECT\r\n"),
+	TOKEN_TEXT("WIFI GOT IP\r\n"),
+	TOKEN_TEXT("WIFI CONNECTED\r\n"),
+	TOKEN_TEXT("CLOSED\r\n"),
+	TOKEN_TEXT("CONNECT\r\n"),
+	TOKEN_TEXT("Recv "),
+	TOKEN_TEXT("+IPD,"),
+	TOKEN_TEXT("+CIFSR:"),
+	TOKEN_TEXT("+CIPAP:"),
+	TOKEN_TEXT("+CIPSTA:"),
+	TOKEN_TEXT("+CIPDOMAIN:"),
+	TOKEN_TEXT("+CWLAP:"),
+	TOKEN_TEXT("+CWMODE:"),
+	TOKEN_TEXT("+CIPMUX:"),
+	TOKEN_TEXT("+CWJAP:"),
+	TOKEN_TEXT("No AP\r\n"),
+	TOKEN_TEXT("APIP,\""),
+	TOKEN_TEXT("STAIP,\""),
+	TOKEN_TEXT("ip:\""),
+	TOKEN_TEXT("netmask:\""),
+	TOKEN_TEXT("gateway:\""),
+	TOKEN_TEXT("+CIPSTATUS:"),
+};
+
+static_assert(sizeof(s_tokens) / sizeof(s_tokens[0]) == TOKEN_MAX, "a token without text");
+
+const static int TOKEN_SLOTS = 32;
+const static int IP_TEXT_MAX = 15; // "255.255.255.255" after a field token
+const static int TOKEN_MIN_SIZE = 4; // bytes needed before a line is classified
+const static int TOKEN_WIDE_SIZE = 6; // same for the prefixes shared by several tokens
+
+// "SE", "WI" and "+C" start more than one token, their 4th and 6th bytes go into the key too
+constexpr bool token_wide(uint8_t c0, uint8_t c1)
+{
+	return (c0 == 'S' && c1 == 'E') || (c0 == 'W' && c1 == 'I') || (c0 == '+' && c1 == 'C');
+}
+
+constexpr uint32_t token_key(uint8_t c0, uint8_t c1, uint8_t c3, uint8_t c5)
+{
+	return (uint32_t)c0 | ((uint32_t)c1 << 8) | (token_wide(c0, c1) ? ((uint32_t)c3 << 16) | ((uint32_t)c5 << 24) : 0);
+}
+
+constexpr uint8_t token_hash(uint32_t key)
+{
+	return (uint8_t)((uint32_t)(key * 0x81a1ed73u) >> 27);
+}
+
+constexpr uint8_t token_slot(int t)
+{
+	return token_hash(token_key(s_tokens[t].text[0], s_tokens[t].text[1], s_tokens[t].text[3],
+		token_wide(s_tokens[t].text[0], s_tokens[t].text[1]) ? s_tokens[t].text[5] : 0));
+}
+
+// the line token hashed to slot, searched from t on
+constexpr uint8_t token_owner(int slot, int t)
+{
+	return t == TOKEN_LINE_MAX ? (uint8_t)TOKEN_NONE : token_slot(t) == slot ? (uint8_t)t : token_owner(slot, t + 1);
+}
+
+constexpr bool tokens_perfect(int t)
+{
+	return t == TOKEN_LINE_MAX || (token_owner(token_slot(t), 0) == t && tokens_perfect(t + 1));
+}
+
+static_assert(tokens_perfect(0), "two line tokens share a slot, change the multiplier of token_hash()");
+
+#define TOKEN_OWNER4(s) token_owner(s, 0), token_owner(s + 1, 0), token_owner(s + 2, 0), token_owner(s + 3, 0)
+
+// slot to line token, TOKEN_NONE where no token hashes
+static constexpr uint8_t s_tokenSlots[TOKEN_SLOTS] = {
+	TOKEN_OWNER4(0), TOKEN_OWNER4(4), TOKEN_OWNER4(8), TOKEN_OWNER4(12),
+	TOKEN_OWNER4(16), TOKEN_OWNER4(20), TOKEN_OWNER4(24), TOKEN_OWNER4(28)
+};
+
+#undef TOKEN_OWNER4
+
+#endif
@@ -0,0 +1,80 @@
+#include "ESP32Trace.h"
+#include <string.h>
+
+Esp32Trace::Esp32Trace()
+	: m_events(&m_spare)
+	, m_size(0)
+	, m_mask(0)
+	, m_head(0)
+{
+}
+
+bool Esp32Trace::attach(TraceEvent* events, uint32_t size)
+{
+	if (events == NULL || size == 0)
+	{
+		events = &m_spare;
+		size = 0;
+	}
+	else if ((size & (size - 1)) != 0)
+		return false;
+	else
+		memset(events, 0, size * sizeof(TraceEvent));
+	m_events = events;
+	m_size = size;
+	m_mask = size == 0 ? 0 : size - 1;
+	m_head = 0;
+	return true;
+}
+
+uint32_t Esp32Trace::size(void)
+{
+	return m_size;
+}
+
+uint32_t Esp32Trace::recorded(void)
+{
+	return m_head;
+}
+
+size_t Esp32Trace::read(TraceEvent* events, size_t n)
+{
+	uint32_t head = m_head;
+	uint32_t count = head < m_size ? head : m_size;
+	if (n > count)
+		n = count;
+	for (size_t i = 0; i < n; i++)
+	{
+		events[i] = m_events[(head - n + i) & m_mask];
+	}
+	return n;
+}
+
+size_t Esp32Trace::save(uint8_t* buffer, size_t size)
+{
+	if (size < sizeof(TraceHeader))
+		return 0;
+	TraceHeader header;
+	memcpy(header.magic, "E32T", 4);
+	header.version = VERSION;
+	header.event_size = sizeof(TraceEvent);
+	header.recorded = m_head;
+	uint32_t head = m_head;
+	size_t n = (size - sizeof(TraceHeader)) / sizeof(TraceEvent);
+	if (n > (head < m_size ? head : m_size))
+		n = head < m_size ? head : m_size;
+	// buffer may sit at any address, an event is not stored through a TraceEvent*
+	uint8_t* p = buffer + sizeof(TraceHeader);
+	for (size_t i = 0; i < n; i++, p += sizeof(TraceEvent))
+	{
+		memcpy(p, &m_events[(head - n + i) & m_mask], sizeof(TraceEvent));
+	}
+	header.count = n;
+	memcpy(buffer, &header, sizeof(header));
+	return sizeof(TraceHeader) + header.count * sizeof(TraceEvent);
+}
+
+void Esp32Trace::clear(void)
+{
+	m_head = 0;
+}
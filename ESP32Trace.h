@@ -0,0 +1,75 @@
+// Binary event trace for the ESP32 AT driver
+
+
+#ifndef _ESP32TRACE_h
+#define _ESP32TRACE_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef WIFI_TRACE_SIZE
+#define WIFI_TRACE_SIZE 256 // events by default, a power of two
+#endif
+
+// fixed size events in a ring given by the driver from its arena. Recording is
+// a few stores, never allocates and never prints, the newest events overwrite
+// the oldest. Nothing is kept until attach()
+// save() writes the ring as a file decoded by tools/esp32trace on the host
+class Esp32Trace
+{
+public:
+	const static uint32_t SIZE = WIFI_TRACE_SIZE; // default
+	const static uint16_t VERSION = 1;
+
+	enum EventType {
+		TRACE_NONE = 0,
+		TRACE_CMD, // arg command, value length of the line
+		TRACE_RETRY, // arg command, value attempt
+		TRACE_PROMPT, // arg link, value payload written after ">"
+		TRACE_RX, // value bytes read from the serial in one loop()
+		TRACE_OVERFLOW, // value bytes lost in the receive ring
+		TRACE_DATA, // arg link, value bytes handed to the application
+		TRACE_END, // arg command, value round trip in ms
+		TRACE_RESPONSE, // arg command, value Esp32::ResponseType other than OK
+		TRACE_LINK // arg link, value 1 connected, 0 closed
+	};
+	typedef struct _TRACE_EVENT {
+		uint32_t time; // us, clock of the driver
+		uint8_t type;
+		uint8_t arg;
+		uint16_t value;
+	} TraceEvent;
+	typedef struct _TRACE_HEADER {
+		char magic[4]; // "E32T"
+		uint16_t version;
+		uint16_t event_size;
+		uint32_t recorded; // since clear(), more than count means the oldest were overwritten
+		uint32_t count; // events that follow, oldest first
+	} TraceHeader;
+
+	Esp32Trace();
+	inline void record(uint32_t time, uint8_t type, uint8_t arg, uint32_t value)
+	{
+		TraceEvent& e = m_events[m_head & m_mask];
+		e.time = time;
+		e.type = type;
+		e.arg = arg;
+		e.value = value > 0xffff ? 0xffff : value;
+		m_head++;
+	}
+	bool attach(TraceEvent* events, uint32_t size); // size a power of two, 0 keeps nothing. Clears
+	uint32_t size(void);
+	uint32_t recorded(void);
+	size_t read(TraceEvent* events, size_t n); // the last n events, oldest first
+	size_t save(uint8_t* buffer, size_t size); // header and events, 0 if size is too small for the header, any alignment
+	void clear(void);
+
+private:
+	TraceEvent* m_events;
+	uint32_t m_size; // 0 while not attached
+	uint32_t m_mask;
+	uint32_t m_head; // events recorded
+	TraceEvent m_spare; // written while not attached
+};
+
+#endif
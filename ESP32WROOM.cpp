@@ -1,116 +1,281 @@
 #include "ESP32WROOM.h"
+#include "ESP32Token.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+#if !defined(WIFI_SCAN_SCALAR) && defined(__AVX2__)
+#include <immintrin.h>
+#elif !defined(WIFI_SCAN_SCALAR) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 //#define DEBUG
-extern volatile uint32_t g_ul_ms_ticks;
+#ifndef __linux__
 extern "C" {
 	void wdt_restart(Wdt* p_wdt);
 }
+#endif
+
+static inline size_t min_size(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+// first CR, LF, ':' or ',' in p[0..n), n if none. The kernel is chosen at compile
+// time: AVX2 or SSE2 on the x86 host, 32-bit words on little-endian targets such
+// as the Cortex-M, bytes with WIFI_SCAN_SCALAR or anywhere else
+static inline bool is_delim(uint8_t c)
+{
+	return c == '\r' || c == '\n' || c == ':' || c == ',';
+}
+
+#if !defined(WIFI_SCAN_SCALAR) && defined(__AVX2__)
+static size_t scan_delim(const uint8_t* p, size_t n)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i colon = _mm256_set1_epi8(':');
+	const __m256i comma = _mm256_set1_epi8(',');
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+		__m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, colon), _mm256_cmpeq_epi8(v, comma)));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	for (; i < n && !is_delim(p[i]); i++)
+	{
+	}
+	return i;
+}
+#elif !defined(WIFI_SCAN_SCALAR) && defined(__SSE2__)
+static size_t scan_delim(const uint8_t* p, size_t n)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i colon = _mm_set1_epi8(':');
+	const __m128i comma = _mm_set1_epi8(',');
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(m);
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	for (; i < n && !is_delim(p[i]); i++)
+	{
+	}
+	return i;
+}
+#elif !defined(WIFI_SCAN_SCALAR) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// high bit set in each zero byte of x; bytes above a zero may be flagged too,
+// the lowest flag is always right
+static inline uint32_t zero_bytes(uint32_t x)
+{
+	return (x - 0x01010101u) & ~x & 0x80808080u;
+}
+
+static size_t scan_delim(const uint8_t* p, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		uint32_t w;
+		memcpy(&w, p + i, 4); // a single load, unaligned is fine on the Cortex-M3
+		uint32_t mask = zero_bytes(w ^ 0x0d0d0d0du) | zero_bytes(w ^ 0x0a0a0a0au)
+			| zero_bytes(w ^ 0x3a3a3a3au) | zero_bytes(w ^ 0x2c2c2c2cu);
+		if (mask != 0)
+			return i + (__builtin_ctz(mask) >> 3);
+	}
+	for (; i < n && !is_delim(p[i]); i++)
+	{
+	}
+	return i;
+}
+#else
+static size_t scan_delim(const uint8_t* p, size_t n)
+{
+	size_t i = 0;
+	for (; i < n && !is_delim(p[i]); i++)
+	{
+	}
+	return i;
+}
+#endif
 
 MyRingBuffer::MyRingBuffer(void)
 {
-	memset(_aucBuffer, 0, BUFFER_MAX_SIZE);
+	attach(&_ucSpare, 1);
+}
+
+void MyRingBuffer::attach(uint8_t* buffer, size_t size)
+{
+	memset(buffer, 0, size);
+	_aucBuffer = buffer;
+	_iSize = size;
 	_iHead = 0;
 	_iTail = 0;
 }
 
+int MyRingBuffer::capacity(void)
+{
+	return _iSize - 1;
+}
+
 void MyRingBuffer::store_byte(uint8_t c)
 {
-	int i = (uint32_t)(_iHead + 1) % BUFFER_MAX_SIZE;
+	int i = wrap(_iHead + 1);
 
 	_aucBuffer[_iHead] = c;
 	_iHead = i;
 	if (i == _iTail)
 	{
-		_iTail = (uint32_t)(_iTail + 1) % BUFFER_MAX_SIZE;
+		_iTail = wrap(_iTail + 1);
+	}
+}
+
+size_t MyRingBuffer::store_bytes(const uint8_t* p, size_t n)
+{
+	size_t room = _iSize - 1 - length();
+	size_t lost = n > room ? n - room : 0;
+	if (n > (size_t)(_iSize - 1)) // only the newest bytes stay
+	{
+		p += n - (_iSize - 1);
+		n = _iSize - 1;
+	}
+	while (n > 0)
+	{
+		size_t c = min_size(n, _iSize - _iHead);
+		memcpy(_aucBuffer + _iHead, p, c);
+		_iHead = wrap(_iHead + c);
+		p += c;
+		n -= c;
 	}
+	if (lost > 0)
+		_iTail = wrap(_iHead + 1);
+	return lost;
 }
 
 bool MyRingBuffer::is_full(void)
 {
-	int i = (uint32_t)(_iHead + 1) % BUFFER_MAX_SIZE;
+	int i = wrap(_iHead + 1);
 	return i == _iTail;
 }
 
+// the searches run over the at most two contiguous segments of the ring
+
 int MyRingBuffer::find_byte(byte c, int begin, int end)
 {
 	int len = length();
 	if (end == -1 || end > len) end = len;
-	if (begin >= end) return -1;
-	int i = _iTail + begin, j = begin;
-	while (j < end)
+	while (begin < end)
 	{
-		if (_aucBuffer[i] == c)
-		{
-			return j;
-		}
-		i = (uint32_t)(i + 1) % BUFFER_MAX_SIZE;
-		j++;
+		uint8_t* p;
+		size_t n = segment(begin, end, &p);
+		const uint8_t* q = (const uint8_t*)memchr(p, c, n);
+		if (q != NULL)
+			return begin + (q - p);
+		begin += n;
 	}
 	return -1;
 }
 
-// kmp algorithm for find_bytes
-static void Next(byte* T, int* next, int size) {
-	int i = 1;
-	next[1] = 0;
-	int j = 0;
-	while (i < size) {
-		if (j == 0 || T[i - 1] == T[j - 1]) {
-			i++;
-			j++;
-			next[i] = j;
-		}
-		else {
-			j = next[j];
-		}
+int MyRingBuffer::find_delim(int begin, int end)
+{
+	int len = length();
+	if (end == -1 || end > len) end = len;
+	while (begin < end)
+	{
+		uint8_t* p;
+		size_t n = segment(begin, end, &p);
+		size_t k = scan_delim(p, n);
+		if (k < n)
+			return begin + k;
+		begin += n;
 	}
+	return -1;
 }
 
-int MyRingBuffer::find_bytes(byte* p, size_t n)
+bool MyRingBuffer::compile(Pattern& pattern, const byte* p, size_t n)
 {
-	int next[FINDBYTES_MAX_SIZE + 1];
-	Next(p, next, n);
-	int i = 1;
-	int j = 1;
-	int s_size = length();
-	while (i <= s_size && j <= n) {
-		if (j == 0 || read_byte(i - 1) == p[j - 1]) {
-			i++;
-			j++;
-		}
-		else {
-			j = next[j];
-		}
+	if (n == 0 || n > FINDBYTES_MAX_SIZE)
+		return false;
+	pattern.bytes = p;
+	pattern.size = n;
+	pattern.fail[0] = 0;
+	size_t k = 0;
+	for (size_t i = 1; i < n; i++)
+	{
+		while (k > 0 && p[i] != p[k])
+			k = pattern.fail[k - 1];
+		if (p[i] == p[k])
+			k++;
+		pattern.fail[i] = k;
 	}
-	if (j > n) {
-		return i - n - 1;
+	return true;
+}
+
+int MyRingBuffer::find_bytes(const Pattern& pattern, int begin, int end)
+{
+	int len = length();
+	if (end == -1 || end > len) end = len;
+	const byte* t = pattern.bytes;
+	size_t j = 0; // bytes of the pattern matched, carried over the wrap point
+	while (begin < end)
+	{
+		uint8_t* p;
+		size_t n = segment(begin, end, &p);
+		const uint8_t* s = p;
+		const uint8_t* e = p + n;
+		while (s < e)
+		{
+			if (j == 0)
+			{
+				// nothing matched yet, skip to the next first byte
+				s = (const uint8_t*)memchr(s, t[0], e - s);
+				if (s == NULL)
+					break;
+			}
+			uint8_t c = *s++;
+			while (j > 0 && c != t[j])
+				j = pattern.fail[j - 1];
+			if (c == t[j])
+				j++;
+			if (j == pattern.size)
+				return begin + (s - p) - (int)pattern.size;
+		}
+		begin += n;
 	}
 	return -1;
 }
 
+int MyRingBuffer::find_bytes(byte* p, size_t n)
+{
+	Pattern pattern;
+	if (!compile(pattern, p, n))
+		return -1;
+	return find_bytes(pattern);
+}
+
 int MyRingBuffer::find_word(uint16_t w, int begin)
 {
-	if (begin >= length()) return -1;
-	int i = _iTail + begin, j = begin;
+	int len = length();
 	uint8_t L = w & 0xff;
 	uint8_t H = w >> 8;
-	while (i != _iHead)
+	while (true)
 	{
-		if (_aucBuffer[i] == L)
-		{
-			int k = (uint32_t)(i + 1) % BUFFER_MAX_SIZE;
-			if (k != _iHead)
-			{
-				if (_aucBuffer[k] == H)
-				{
-					return j;
-				}
-			}
-		}
-		i = (uint32_t)(i + 1) % BUFFER_MAX_SIZE;
-		j++;
+		int k = find_byte(L, begin, len - 1);
+		if (k == -1 || read_byte(k + 1) == H)
+			return k;
+		begin = k + 1;
 	}
-	return -1;
 }
 
 bool MyRingBuffer::cmp_bytes(byte* p, size_t n, int begin)
@@ -120,18 +285,9 @@ bool MyRingBuffer::cmp_bytes(byte* p, size_t n, int begin)
 		n = strlen((char*)p);
 	}
 	if (begin + n > length()) return false;
-	int i = (uint32_t)(_iTail + begin) % BUFFER_MAX_SIZE;
-	int j = 0;
-	while (j < n)
-	{
-		if (p[j] != _aucBuffer[i])
-		{
-			return false;
-		}
-		i = (uint32_t)(i + 1) % BUFFER_MAX_SIZE;
-		j++;
-	}
-	return true;
+	int i = wrap(_iTail + begin);
+	size_t c = min_size(n, _iSize - i); // up to the wrap point
+	return memcmp(_aucBuffer + i, p, c) == 0 && memcmp(_aucBuffer, p + c, n - c) == 0;
 }
 
 void MyRingBuffer::cut(int count)
@@ -139,7 +295,7 @@ void MyRingBuffer::cut(int count)
 	if (count > length())
 		clear();
 	else
-		_iTail = (uint32_t)(_iTail + count) % BUFFER_MAX_SIZE;
+		_iTail = wrap(_iTail + count);
 }
 
 int MyRingBuffer::length(void)
@@ -147,7 +303,7 @@ int MyRingBuffer::length(void)
 	if (_iTail <= _iHead)
 		return _iHead - _iTail;
 	else
-		return _iHead + BUFFER_MAX_SIZE - _iTail;
+		return _iHead + _iSize - _iTail;
 }
 
 void MyRingBuffer::clear(void)
@@ -162,28 +318,39 @@ uint8_t MyRingBuffer::operator[](int index)
 
 uint8_t MyRingBuffer::read_byte(int index)
 {
-	int i = (uint32_t)(_iTail + index) % BUFFER_MAX_SIZE;
+	int i = wrap(_iTail + index);
 	return _aucBuffer[i];
 }
 
 size_t MyRingBuffer::read_bytes(uint8_t* buffer, size_t n, int begin)
 {
-	if (begin >= length()) return 0;
-	int i = (uint32_t)(_iTail + begin) % BUFFER_MAX_SIZE;
-	int j = 0;
-	while (i != _iHead && j < n)
+	size_t j = 0;
+	while (j < n)
 	{
-		buffer[j] = _aucBuffer[i];
-		i = (uint32_t)(i + 1) % BUFFER_MAX_SIZE;
-		j++;
+		uint8_t* p;
+		size_t c = segment(begin + j, begin + n, &p);
+		if (c == 0)
+			break;
+		memcpy(buffer + j, p, c);
+		j += c;
 	}
 	return j;
 }
 
+size_t MyRingBuffer::segment(int begin, int end, uint8_t** p)
+{
+	int len = length();
+	if (end > len) end = len;
+	if (begin >= end) return 0;
+	int i = wrap(_iTail + begin);
+	*p = _aucBuffer + i;
+	return min_size(end - begin, _iSize - i);
+}
+
 void MyRingBuffer::set_byte(int index, byte v)
 {
 	if (index >= length()) return;
-	int i = (uint32_t)(_iTail + index) % BUFFER_MAX_SIZE;
+	int i = wrap(_iTail + index);
 	_aucBuffer[i] = v;
 }
 
@@ -192,17 +359,48 @@ void MyRingBuffer::set_bytes(int begin, int end, byte v)
 	int len = length();
 	if (end > len) end = len;
 	if (begin >= end) return;
-	int i = (uint32_t)(_iTail + begin) % BUFFER_MAX_SIZE;
-	end = (uint32_t)(_iTail + end) % BUFFER_MAX_SIZE;
+	int i = wrap(_iTail + begin);
+	end = wrap(_iTail + end);
 	while (i != end)
 	{
-		_aucBuffer[i] == v;
-		i = (uint32_t)(i + 1) % BUFFER_MAX_SIZE;
+		_aucBuffer[i] = v;
+		i = wrap(i + 1);
 	}
 }
 
 Esp32::Esp32()
 	: m_pSerial(NULL)
+	, m_pClock(&systemClock)
+	, m_timers(systemClock)
+	, m_retries(0)
+	, m_retryCMD(CMD_NONE)
+	, m_sendLinkID(0)
+	, m_sendMUX(false)
+	, m_sendRest(0)
+	, m_sendTaken(0)
+	, m_sendIP(0)
+	, m_sendPort(0)
+	, m_writablePending(false)
+	, m_connLinkID(0)
+	, m_connType(TCP)
+	, m_connIP(0)
+	, m_connPort(0)
+	, m_reusedLinks(0)
+	, m_poolLinks((1 << LINK_MAX) - 1)
+	, m_poolTick(0)
+	, m_poolLinkID(-1)
+	, m_poolWifi(NULL)
+	, m_poolType(TCP)
+	, m_poolIP(0)
+	, m_poolPort(0)
+	, m_burst(NULL)
+	, m_burstCount(0)
+	, m_burstIndex(0)
+	, m_burstSent(0)
+	, m_burstInFlight(false)
+	, m_burstLinkID(0)
+	, m_burstWifi(NULL)
+	, m_serverWifi(NULL)
 	, m_lastSendTime(0)
 	, m_busy(false)
 	, m_lastCMD(CMD_NONE)
@@ -210,728 +408,1209 @@ Esp32::Esp32()
 	, m_isMUX(false)
 	, m_rxDataLinkID(0)
 	, m_rxDataRestSize(0)
+	, m_rxToken(TOKEN_NONE)
 	, m_rxGetAPIP(0)
 	, m_rxGetSTAIP(0)
 	, m_rxGetAPMask(0)
 	, m_rxGetSTAMask(0)
+	, m_rxQuery(0)
+	, m_rxLinks(0)
+	, m_modeSet(MODE_STATION)
 	, m_apFound(false)
+	, m_eventDriven(false)
+	, m_rxReady(false)
+#ifdef __linux__
+	, m_epollFd(-1)
+	, m_serialFd(-1)
+#endif
+	, m_cmdLine(NULL)
+	, m_cmdMax(0)
+	, m_cmdLen(0)
+	, m_rxTime(0)
+	, m_directLinks(0)
+{
+	resetRxStats();
+	m_rxSSID[0] = 0;
+	memset(&m_state, 0, sizeof(m_state));
+	m_state.mode = MODE_STATION;
+	memset(m_links, 0, sizeof(m_links));
+	memset(m_connStats, 0, sizeof(m_connStats));
+	memset(&m_poolStats, 0, sizeof(m_poolStats));
+	m_cmdTimer.init(onCmdTimeout, this);
+	m_retryTimer.init(onRetry, this);
+	initCMDStats();
+	setRetryPolicy(CMD_MAX, RETRY_MAX, RETRY_BACKOFF_MIN, RETRY_BACKOFF_MAX);
+	setSendWindow(SEND_WINDOW_MIN, SEND_MAXSIZE, SEND_WINDOW_STEP);
+	setLineRate(115200);
+	m_memConfig.rx_size = FRAME_MAX_SIZE;
+	m_memConfig.cmd_size = CMD_MAX_LEN;
+	m_memConfig.trace_events = Esp32Trace::SIZE;
+#ifndef WIFI_NO_DEFAULT_ARENA
+	setArena(m_defaultArena, sizeof(m_defaultArena), m_memConfig);
+#endif
+}
+
+#ifdef __linux__
+Esp32::~Esp32()
 {
+	if (m_epollFd != -1)
+		close(m_epollFd);
 }
+#endif
 
-void Esp32::loop(void)
+size_t Esp32::loop(size_t budget)
 {
 	bool hasRead = false;
-	while (m_pSerial->available())
-	{
-		m_rxBuffer.store_byte(m_pSerial->read());
-		hasRead = true;
-	}
-#ifdef WIFI_DEBUG
-	static uint32_t tick = 0;
-	if (hasRead || g_ul_ms_ticks - tick > 3000)
-	{
-		int len = m_rxBuffer.length();
-		char* str = new char[len + 1];
-		int i;
-		for (i = 0; i < len; i++)
+	size_t total = 0;
+	uint64_t lost = m_rxStats.bytes_lost;
+	if (!m_eventDriven || m_rxReady)
+	{
+		m_rxReady = false; // clear before draining so a byte arriving meanwhile raises it again
+		uint8_t chunk[64];
+		size_t n;
+		m_rxTime = m_pClock->micros();
+		while (true)
 		{
-			str[i] = m_rxBuffer[i];
+			size_t limit = sizeof(chunk);
+			if (budget > 0)
+			{
+				if (total >= budget)
+				{
+					m_rxReady = true; // more may be pending, come back on the next pass
+					break;
+				}
+				limit = min_size(limit, budget - total);
+			}
+			// payload for a link with an application buffer skips the ring
+			if (m_rxDataRestSize > 0 && m_links[m_rxDataLinkID].rx_buffer != NULL)
+			{
+				n = readDirect(budget > 0 ? budget - total : m_rxDataRestSize);
+				if (n == 0)
+					break;
+				total += n;
+				continue;
+			}
+			n = m_pSerial->read(chunk, limit);
+			if (n == 0)
+				break;
+			total += n;
+			m_rxStats.bytes_lost += m_rxBuffer.store_bytes(chunk, n);
+			m_rxStats.bytes_received += n;
+			hasRead = true;
+			// parse headers as they arrive so the payload can be read directly, there
+			// is nothing to find while the ring only holds the rest of a ring payload
+			if (m_directLinks != 0 && m_rxBuffer.length() > (int)m_rxDataRestSize)
+				parseReceived();
 		}
-		str[i] = 0;
-		WIFI_DEBUG_printf("\r\nRECEIVE %d:\r\n%s\r\n", len, str);
-		tick = g_ul_ms_ticks;
-		delete[] str;
 	}
-#endif
+	if (total > 0)
+		trace(Esp32Trace::TRACE_RX, 0, total);
 	if (hasRead)
 	{
 		parseReceived();
 	}
+	if (m_rxStats.bytes_lost != lost)
+	{
+		trace(Esp32Trace::TRACE_OVERFLOW, 0, m_rxStats.bytes_lost - lost);
+		m_state.valid = 0; // a URC may have been in what was lost
+	}
 	checkTimeout();
+	if (m_reusedLinks != 0)
+		notifyReused();
+	if (m_burst != NULL && !m_busy)
+		burstNext();
+	if (m_poolLinkID != -1 && !m_busy)
+		poolConnect();
+	if (m_writablePending && !m_busy)
+		notifyWritable();
+	return total;
 }
 
-void Esp32::init(void)
+void Esp32::setEventDriven(bool en)
 {
-	setSerial(WIFI_SERIAL, WIFI_BAUDRATE, WIFI_FLOWCTR);
+	m_eventDriven = en;
+	m_rxReady = true; // drain whatever arrived before the switch
 }
 
-void Esp32::setSerial(USARTClass& hSerial, int aBaud, bool en)
+void Esp32::notifyRxReady(void)
 {
-	m_pSerial = &hSerial;
-	m_pSerial->setCTSPin(DIGIFI_CTS);
-	m_pSerial->enableCTS(en);
-	m_pSerial->begin(aBaud);
+	m_rxReady = true;
 }
 
-USARTClass& Esp32::getSerial()
+bool Esp32::isRxReady(void)
 {
-	return *m_pSerial;
+	// bytes the serial already holds count too, the Arduino core's USART interrupt
+	// fills its own ring and never calls notifyRxReady()
+	if (!m_rxReady && m_pSerial != NULL && m_pSerial->available() > 0)
+		m_rxReady = true;
+	return m_rxReady;
 }
 
-bool Esp32::reset(IWifi* pWifi)
+uint32_t Esp32::nextTimeout(void)
 {
-	if (m_busy)
-	{
-		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_RESET;
-	m_pSerial->println("AT+RST");
-	return true;
+	return m_timers.nextTimeout();
 }
 
-bool Esp32::recovery(IWifi* pWifi)
+void Esp32::setClock(Esp32Clock& clock)
 {
-	if (m_busy)
-	{
-		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_RECOVERY;
-	m_pSerial->println("AT+RESTORE");
-	return true;
+	m_pClock = &clock;
+	m_lastSendTime = clock.micros();
+	m_timers.setClock(clock);
 }
 
-bool Esp32::startSoftAP(IWifi* pWifi)
+Esp32Clock& Esp32::getClock(void)
 {
-	if (m_busy)
-	{
-		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SETMODE;
-	m_pSerial->println("AT+CWMODE=2");
-	return true;
+	return *m_pClock;
 }
 
-bool Esp32::startStation(IWifi* pWifi)
+Esp32TimerWheel& Esp32::getTimers(void)
 {
-	if (m_busy)
-	{
-		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SETMODE;
-	m_pSerial->println("AT+CWMODE=1");
-	return true;
+	return m_timers;
 }
 
-bool Esp32::startAPStation(IWifi* pWifi)
+#ifdef __linux__
+bool Esp32::setEventFd(int fd)
 {
-	if (m_busy)
+	if (m_epollFd == -1)
 	{
-		return false;
+		m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (m_epollFd == -1)
+			return false;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SETMODE;
-	m_pSerial->println("AT+CWMODE=3");
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		return false;
+	m_rxReady = true;
 	return true;
 }
 
-bool Esp32::setSoftAP(IWifi* pWifi, const char ssid[], const char pwd[], int ch, EncryptType ecn, int max_conn, bool hidden)
+bool Esp32::waitEvent(void)
 {
-	if (m_busy)
-	{
+	if (m_rxReady)
+		return true;
+	uint32_t timeout = nextTimeout();
+	if (m_epollFd == -1)
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SETSOFTAP;
-	char str[4];
-	m_pSerial->print("AT+CWSAP=\"");
-	m_pSerial->print(ssid);
-	m_pSerial->print("\",\"");
-	m_pSerial->print(pwd);
-	m_pSerial->print("\",");
-	m_pSerial->print(itoa(ch, str, 10));
-	m_pSerial->write(',');
-	m_pSerial->print(itoa(ecn, str, 10));
-	if (max_conn > 0)
+	struct epoll_event ev;
+	int n = epoll_wait(m_epollFd, &ev, 1, timeout == NO_TIMEOUT ? -1 : (int)timeout);
+	if (n > 0)
+		m_rxReady = true;
+	return m_rxReady;
+}
+#elif defined(WIN32)
+bool Esp32::waitEvent(void)
+{
+	return true; // the test harness polls, never sleep
+}
+#else
+bool Esp32::waitEvent(void)
+{
+	while (true)
 	{
-		m_pSerial->write(',');
-		m_pSerial->print(itoa(max_conn, str, 10));
-		m_pSerial->write(',');
-		m_pSerial->write('0' + hidden);
+		// interrupts stay off from the check to __WFI(), which still wakes on a pending
+		// one, so an RX interrupt in between does not wait for the next SysTick
+		__disable_irq();
+		bool ready = isRxReady();
+		bool expired = nextTimeout() == 0;
+		if (!ready && !expired)
+			__WFI();
+		__enable_irq();
+		if (ready || expired)
+			return ready;
 	}
-	m_pSerial->println();
-	return true;
 }
+#endif
 
-bool Esp32::connectAP(IWifi* pWifi, const char ssid[], const char pwd[], const char* bssid)
+void Esp32::init(void)
 {
-	if (m_busy)
-	{
-		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_CONNECTAP;
-	m_pSerial->print("AT+CWJAP=\"");
-	m_pSerial->print(ssid);
-	m_pSerial->print("\",\"");
-	m_pSerial->print(pwd);
-	m_pSerial->write('"');
-	if (bssid != NULL)
-	{
-		m_pSerial->print(",\"");
-		m_pSerial->print(bssid);
-		m_pSerial->write('"');
-	}
-	m_pSerial->println();
-	return true;
+#ifndef __linux__
+	setSerial(WIFI_SERIAL, WIFI_BAUDRATE, WIFI_FLOWCTR);
+#endif
 }
 
-bool Esp32::configSanAP(IWifi* pWifi, bool sort, uint8_t mask)
+bool Esp32::init(void* arena, size_t size, const MemConfig* config)
 {
-	if (m_busy)
-	{
+	if (!setArena(arena, size, config != NULL ? *config : m_memConfig))
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_CONFIGSCANAP;
-	m_pSerial->print("AT+CWLAPOPT=");
-	m_pSerial->write('0' + sort);
-	m_pSerial->write(',');
-	m_pSerial->print(mask, 10);
-	m_pSerial->println();
+	init();
 	return true;
 }
 
-bool Esp32::scanAP(IWifi* pWifi, const char ssid[])
+const Esp32::MemConfig& Esp32::getMemConfig(void)
 {
-	if (m_busy)
-	{
+	return m_memConfig;
+}
+
+size_t Esp32::arenaSize(const MemConfig& config)
+{
+	size_t size = WIFI_ARENA_ALIGN(config.rx_size + 1) + WIFI_ARENA_ALIGN(config.cmd_size + 2);
+#ifdef WIFI_TRACE
+	size += WIFI_ARENA_ALIGN(config.trace_events * sizeof(Esp32Trace::TraceEvent));
+#endif
+	return size + Esp32Arena::ALIGN - 1; // for a start that is not aligned
+}
+
+const Esp32Arena::ArenaStats& Esp32::getMemStats(void)
+{
+	return m_arena.getStats();
+}
+
+bool Esp32::setArena(void* arena, size_t size, const MemConfig& config)
+{
+	if (config.rx_size < RX_MIN_SIZE || config.cmd_size < CMD_MIN_LEN)
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SCANAP;
-	m_pSerial->print("AT+CWLAP");
-	if (ssid != NULL)
+	// laid out aside first, so a refused layout leaves the buffers in use alone
+	Esp32Arena layout;
+	layout.reset(arena, size);
+	uint8_t* rx = (uint8_t*)layout.alloc(config.rx_size + 1, Esp32Arena::REGION_RX);
+	char* cmd = (char*)layout.alloc(config.cmd_size + 2, Esp32Arena::REGION_CMD);
+	if (rx == NULL || cmd == NULL)
+		return false;
+#ifdef WIFI_TRACE
+	if ((config.trace_events & (config.trace_events - 1)) != 0)
+		return false;
+	Esp32Trace::TraceEvent* events = (Esp32Trace::TraceEvent*)layout.alloc(
+		config.trace_events * sizeof(Esp32Trace::TraceEvent), Esp32Arena::REGION_TRACE);
+	if (events == NULL)
+		return false;
+	m_trace.attach(events, config.trace_events);
+#endif
+	m_arena = layout;
+	m_memConfig = config;
+	m_rxBuffer.attach(rx, config.rx_size + 1);
+	m_rxDataRestSize = 0;
+	m_rxToken = TOKEN_NONE;
+	m_cmdLine = cmd;
+	m_cmdMax = config.cmd_size;
+#ifdef WIFI_DEBUG
+	const Esp32Arena::ArenaStats& st = m_arena.getStats();
+	for (int i = 0; i < Esp32Arena::REGION_MAX; i++)
 	{
-		m_apFound = true;
-		m_pSerial->print("=\"");
-		m_pSerial->print(ssid);
-		m_pSerial->write('"');
+		WIFI_DEBUG_printf("arena %s\t%u\r\n", Esp32Arena::regionName((Esp32Arena::Region)i), (unsigned)st.used[i]);
 	}
-	m_pSerial->println();
+	WIFI_DEBUG_printf("arena free\t%u of %u\r\n", (unsigned)st.free, (unsigned)st.size);
+#endif
 	return true;
 }
 
-bool Esp32::autoConnAP(IWifi* pWifi, bool isAuto)
+#ifndef __linux__
+void Esp32::setSerial(USARTClass& hSerial, int aBaud, bool en)
 {
-	if (m_busy)
-	{
-		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_AUTOCONN;
-	m_pSerial->print("AT+CWAUTOCONN=");
-	m_pSerial->write('0' + isAuto);
-	m_pSerial->println();
-	return true;
+	m_usart.begin(hSerial, aBaud, en);
+	setLineRate(aBaud);
+	setSerial(m_usart);
+}
+#endif
+
+void Esp32::setSerial(Esp32Serial& serial)
+{
+	m_pSerial = &serial;
+#ifdef __linux__
+	int fd = serial.fd();
+	if (fd == m_serialFd)
+		return;
+	// the previous port would keep waking waitEvent()
+	if (m_serialFd != -1 && m_epollFd != -1)
+		epoll_ctl(m_epollFd, EPOLL_CTL_DEL, m_serialFd, NULL);
+	m_serialFd = -1;
+	if (fd != -1 && setEventFd(fd))
+		m_serialFd = fd;
+#endif
 }
 
-bool Esp32::getIP(IWifi* pWifi)
+#ifndef __linux__
+USARTClass& Esp32::getSerial()
 {
-	if (m_busy)
+	return m_usart.getUsart();
+}
+#endif
+
+Esp32Serial& Esp32::getPort(void)
+{
+	return *m_pSerial;
+}
+
+bool Esp32::beginCMD(IWifi* pWifi, CMDType cmd)
+{
+	if (m_busy || m_cmdLine == NULL)
 	{
 		return false;
 	}
 	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
+	m_lastSendTime = m_pClock->micros();
 	m_pWifi = pWifi;
-	m_lastCMD = CMD_GETIP;
-	m_pSerial->println("AT+CIFSR");
-	m_rxGetAPIP = 0;
-	m_rxGetSTAIP = 0;
+	m_lastCMD = cmd;
+	m_cmdLen = 0;
+	m_retries = 0;
+	m_timers.arm(m_cmdTimer, cmdTimeout(cmd));
 	return true;
 }
 
-bool Esp32::getAPIP(IWifi* pWifi)
+void Esp32::cmdAppend(const char s[])
 {
-	if (m_busy)
+	while (*s && m_cmdLen < m_cmdMax)
 	{
-		return false;
+		m_cmdLine[m_cmdLen++] = *s++;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_GETAPIP;
-	m_pSerial->println("AT+CIPAP?");
-	return true;
 }
 
-bool Esp32::getSTAIP(IWifi* pWifi)
+void Esp32::cmdAppendChar(char c)
 {
-	if (m_busy)
+	if (m_cmdLen < m_cmdMax)
+		m_cmdLine[m_cmdLen++] = c;
+}
+
+void Esp32::cmdAppendNum(uint32_t n)
+{
+	char s[11];
+	int i = sizeof(s) - 1;
+	s[i] = 0;
+	do
 	{
+		s[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	cmdAppend(s + i);
+}
+
+void Esp32::cmdAppendIP(uint32_t ip)
+{
+	cmdAppendNum(ip >> 24);
+	cmdAppendChar('.');
+	cmdAppendNum((ip >> 16) & 0xff);
+	cmdAppendChar('.');
+	cmdAppendNum((ip >> 8) & 0xff);
+	cmdAppendChar('.');
+	cmdAppendNum(ip & 0xff);
+}
+
+void Esp32::cmdSend(void)
+{
+	// the whole line goes out in one write, m_cmdMax leaves room for CRLF
+	m_cmdLine[m_cmdLen++] = '\r';
+	m_cmdLine[m_cmdLen++] = '\n';
+	trace(Esp32Trace::TRACE_CMD, m_lastCMD, m_cmdLen);
+	m_pSerial->write((const uint8_t*)m_cmdLine, m_cmdLen);
+}
+
+bool Esp32::reset(IWifi* pWifi)
+{
+	if (!beginCMD(pWifi, CMD_RESET))
 		return false;
+	cmdAppend("AT+RST");
+	cmdSend();
+	m_state.valid = 0;
+	for (int i = 0; i < LINK_MAX; i++)
+	{
+		m_links[i].connected = false;
+		m_links[i].accepted = false;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_GETSTAIP;
-	m_pSerial->println("AT+CIPSTA?");
+	m_poolLinkID = -1;
 	return true;
 }
 
-bool Esp32::getNetStatus(IWifi* pWifi)
+bool Esp32::recovery(IWifi* pWifi)
 {
-	if (m_busy)
-	{
+	if (!beginCMD(pWifi, CMD_RECOVERY))
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_GETNETSTATUS;
-	m_pSerial->println("AT+CIPSTATUS");
+	cmdAppend("AT+RESTORE");
+	cmdSend();
+	m_state.valid = 0;
 	return true;
 }
 
-bool Esp32::setMUX(IWifi* pWifi, bool isMUX)
+bool Esp32::startSoftAP(IWifi* pWifi)
 {
-	if (m_busy)
-	{
+	return setMode(pWifi, MODE_SOFTAP);
+}
+
+bool Esp32::startStation(IWifi* pWifi)
+{
+	return setMode(pWifi, MODE_STATION);
+}
+
+bool Esp32::startAPStation(IWifi* pWifi)
+{
+	return setMode(pWifi, MODE_APSTATION);
+}
+
+bool Esp32::setMode(IWifi* pWifi, WifiMode mode, bool save)
+{
+	if (!beginCMD(pWifi, CMD_SETMODE))
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SETMUX;
-	m_pSerial->print("AT+CIPMUX=");
-	m_pSerial->write('0' + isMUX);
-	m_pSerial->println();
-	m_isMUX = isMUX;
+	cmdAppend(save ? "AT+CWMODE=" : "AT+CWMODE_CUR=");
+	cmdAppendChar('0' + mode);
+	cmdSend();
+	m_modeSet = mode;
 	return true;
 }
 
-bool Esp32::startTCPServer(IWifi* pWifi, uint16_t port)
+bool Esp32::getMode(IWifi* pWifi)
 {
-	if (m_busy)
+	if (cachedState(STATE_MODE))
 	{
-		return false;
+		if (pWifi != NULL)
+			pWifi->cbGetMode(RESPONSE_OK, m_state.mode);
+		return true;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_TCPSERVER;
-	m_pSerial->print("AT+CIPSERVER=1,");
-	m_pSerial->println(port, 10);
+	if (!beginCMD(pWifi, CMD_GETMODE))
+		return false;
+	cmdAppend("AT+CWMODE?");
+	cmdSend();
+	m_rxQuery = 0;
 	return true;
 }
 
-bool Esp32::stopTCPServer(IWifi* pWifi, uint16_t port)
+bool Esp32::setSoftAP(IWifi* pWifi, const char ssid[], const char pwd[], int ch, EncryptType ecn, int max_conn, bool hidden)
 {
-	if (m_busy)
-	{
+	if (!beginCMD(pWifi, CMD_SETSOFTAP))
 		return false;
+	cmdAppend("AT+CWSAP=\"");
+	cmdAppend(ssid);
+	cmdAppend("\",\"");
+	cmdAppend(pwd);
+	cmdAppend("\",");
+	cmdAppendNum(ch);
+	cmdAppendChar(',');
+	cmdAppendNum(ecn);
+	if (max_conn > 0)
+	{
+		cmdAppendChar(',');
+		cmdAppendNum(max_conn);
+		cmdAppendChar(',');
+		cmdAppendChar('0' + hidden);
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_TCPSERVER_STOP;
-	m_pSerial->print("AT+CIPSERVER=0,");
-	m_pSerial->println(port, 10);
+	cmdSend();
 	return true;
 }
 
-bool Esp32::TCPConnectMUX(IWifi* pWifi, uint8_t link_id, uint32_t remote_ip, uint16_t remote_port)
+bool Esp32::connectAP(IWifi* pWifi, const char ssid[], const char pwd[], const char* bssid, bool save)
 {
-	if (m_busy)
-	{
+	if (!beginCMD(pWifi, CMD_CONNECTAP))
 		return false;
+	cmdAppend(save ? "AT+CWJAP=\"" : "AT+CWJAP_CUR=\"");
+	cmdAppend(ssid);
+	cmdAppend("\",\"");
+	cmdAppend(pwd);
+	cmdAppendChar('"');
+	if (bssid != NULL)
+	{
+		cmdAppend(",\"");
+		cmdAppend(bssid);
+		cmdAppendChar('"');
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_TCPCONNECT;
-	m_pSerial->print("AT+CIPSTART=");
-	m_pSerial->write('0' + link_id);
-	m_pSerial->print(",\"TCP\",\"");
-	m_pSerial->print(remote_ip >> 24, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print(remote_ip & 0xff, 10);
-	m_pSerial->print("\",");
-	m_pSerial->println(remote_port, 10);
+	cmdSend();
+	m_state.valid &= ~(STATE_STA_IP | STATE_STA_MASK | STATE_AP); // the module leaves the AP it is on
 	return true;
 }
 
-bool Esp32::TCPConnect(IWifi* pWifi, uint32_t remote_ip, uint16_t remote_port)
+bool Esp32::getAP(IWifi* pWifi)
 {
-	if (m_busy)
+	if (cachedState(STATE_AP))
 	{
-		return false;
+		if (pWifi != NULL)
+			pWifi->cbGetAP(RESPONSE_OK, m_state.ssid);
+		return true;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_TCPCONNECT;
-	m_pSerial->print("AT+CIPSTART=");
-	m_pSerial->print("\"TCP\",\"");
-	m_pSerial->print(remote_ip >> 24, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print(remote_ip & 0xff, 10);
-	m_pSerial->print("\",");
-	m_pSerial->println(remote_port, 10);
+	if (!beginCMD(pWifi, CMD_GETAP))
+		return false;
+	cmdAppend("AT+CWJAP?");
+	cmdSend();
+	m_rxSSID[0] = 0;
 	return true;
 }
 
-bool Esp32::UDPConnectMUX(IWifi* pWifi, uint8_t link_id, uint32_t remote_ip, uint16_t remote_port, uint16_t local_port, int mode)
+bool Esp32::configSanAP(IWifi* pWifi, bool sort, uint8_t mask)
 {
-	if (m_busy)
-	{
+	if (!beginCMD(pWifi, CMD_CONFIGSCANAP))
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_UDPCONNECT;
-	m_pSerial->print("AT+CIPSTART=");
-	m_pSerial->write('0' + link_id);
-	m_pSerial->print(",\"UDP\",\"");
-	m_pSerial->print(remote_ip >> 24, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print(remote_ip & 0xff, 10);
-	m_pSerial->print("\",");
-	m_pSerial->print(remote_port, 10);
-	if (local_port > 0)
+	cmdAppend("AT+CWLAPOPT=");
+	cmdAppendChar('0' + sort);
+	cmdAppendChar(',');
+	cmdAppendNum(mask);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::scanAP(IWifi* pWifi, const char ssid[])
+{
+	if (!beginCMD(pWifi, CMD_SCANAP))
+		return false;
+	cmdAppend("AT+CWLAP");
+	if (ssid != NULL)
 	{
-		m_pSerial->write(',');
-		m_pSerial->print(local_port, 10);
-		m_pSerial->write(',');
-		m_pSerial->write('0' + mode);
+		m_apFound = true;
+		cmdAppend("=\"");
+		cmdAppend(ssid);
+		cmdAppendChar('"');
 	}
-	m_pSerial->println();
+	cmdSend();
 	return true;
 }
 
-bool Esp32::UDPConnect(IWifi* pWifi, uint32_t remote_ip, uint16_t remote_port, uint16_t local_port, int mode)
+bool Esp32::autoConnAP(IWifi* pWifi, bool isAuto)
 {
-	if (m_busy)
-	{
+	if (!beginCMD(pWifi, CMD_AUTOCONN))
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_UDPCONNECT;
-	m_pSerial->print("AT+CIPSTART=");
-	m_pSerial->print("\"UDP\",\"");
-	m_pSerial->print(remote_ip >> 24, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-	m_pSerial->write('.');
-	m_pSerial->print(remote_ip & 0xff, 10);
-	m_pSerial->print("\",");
-	m_pSerial->print(remote_port, 10);
-	if (local_port > 0)
+	cmdAppend("AT+CWAUTOCONN=");
+	cmdAppendChar('0' + isAuto);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::getIP(IWifi* pWifi)
+{
+	if (cachedState(STATE_AP_IP | STATE_STA_IP))
 	{
-		m_pSerial->write(',');
-		m_pSerial->print(local_port, 10);
-		m_pSerial->write(',');
-		m_pSerial->write('0' + mode);
+		if (pWifi != NULL)
+			pWifi->cbGetIP(RESPONSE_OK, m_state.ap_ip, m_state.sta_ip);
+		return true;
 	}
-	m_pSerial->println();
+	if (!beginCMD(pWifi, CMD_GETIP))
+		return false;
+	cmdAppend("AT+CIFSR");
+	cmdSend();
+	m_rxGetAPIP = 0;
+	m_rxGetSTAIP = 0;
 	return true;
 }
 
-bool Esp32::sendBytesMUX(IWifi* pWifi, uint8_t link_id, byte* buffer, size_t size, uint32_t remote_ip, uint16_t remote_port)
+bool Esp32::getAPIP(IWifi* pWifi)
 {
-	if (m_busy)
+	if (cachedState(STATE_AP_IP | STATE_AP_MASK))
 	{
-		return false;
+		if (pWifi != NULL)
+			pWifi->cbGetAPIP(RESPONSE_OK, m_state.ap_ip, m_state.ap_mask);
+		return true;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SENDBYTES;
-	m_sendBuffer = buffer;
-	m_sendSize = size;
-	m_pSerial->print("AT+CIPSEND=");
-	m_pSerial->write('0' + link_id);
-	m_pSerial->write(',');
-	m_pSerial->print(size, 10);
-	if (remote_ip != 0 && remote_port != 0)
-	{
-		m_pSerial->print(",\"");
-		m_pSerial->print(remote_ip >> 24, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print(remote_ip & 0xff, 10);
-		m_pSerial->print("\",");
-		m_pSerial->print(remote_port, 10);
-	}
-	m_pSerial->println();
+	if (!beginCMD(pWifi, CMD_GETAPIP))
+		return false;
+	cmdAppend("AT+CIPAP?");
+	cmdSend();
+	m_rxGetAPIP = 0;
+	m_rxGetAPMask = 0;
 	return true;
 }
 
-bool Esp32::sendBytes(IWifi* pWifi, byte* buffer, size_t size, uint32_t remote_ip, uint16_t remote_port)
+bool Esp32::getSTAIP(IWifi* pWifi)
 {
-	if (m_busy)
+	if (cachedState(STATE_STA_IP | STATE_STA_MASK))
 	{
-		return false;
+		if (pWifi != NULL)
+			pWifi->cbGetSTAIP(RESPONSE_OK, m_state.sta_ip, m_state.sta_mask);
+		return true;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SENDBYTES;
-	m_sendBuffer = buffer;
-	m_sendSize = size;
-	m_pSerial->print("AT+CIPSEND=");
-	m_pSerial->print(size, 10);
-	if (remote_ip != 0 && remote_port != 0)
-	{
-		m_pSerial->print(",\"");
-		m_pSerial->print(remote_ip >> 24, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print(remote_ip & 0xff, 10);
-		m_pSerial->print("\",");
-		m_pSerial->print(remote_port, 10);
-	}
-	m_pSerial->println();
+	if (!beginCMD(pWifi, CMD_GETSTAIP))
+		return false;
+	cmdAppend("AT+CIPSTA?");
+	cmdSend();
+	m_rxGetSTAIP = 0;
+	m_rxGetSTAMask = 0;
 	return true;
 }
 
-bool Esp32::sendStringMUX(IWifi* pWifi, uint8_t link_id, const char s[], uint32_t remote_ip, uint16_t remote_port)
+bool Esp32::getNetStatus(IWifi* pWifi)
 {
-	return false;
-	if (m_busy)
+	if (cachedState(STATE_LINKS))
 	{
-		return false;
+		if (pWifi != NULL)
+			reportLinks(pWifi);
+		return true;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SENDSTRING;
-	m_sendBuffer = (byte*)s;
-	m_pSerial->print("AT+CIPSENDEX=");
-	m_pSerial->write('0' + link_id);
-	m_pSerial->write(',');
-	m_pSerial->print(SEND_MAXSIZE, 10);
-	if (remote_ip != 0 && remote_port != 0)
-	{
-		m_pSerial->print(",\"");
-		m_pSerial->print(remote_ip >> 24, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print(remote_ip & 0xff, 10);
-		m_pSerial->print("\",");
-		m_pSerial->print(remote_port, 10);
-	}
-	m_pSerial->println();
+	if (!beginCMD(pWifi, CMD_GETNETSTATUS))
+		return false;
+	cmdAppend("AT+CIPSTATUS");
+	cmdSend();
+	m_rxLinks = 0;
 	return true;
 }
 
-bool Esp32::sendString(IWifi* pWifi, const char s[], uint32_t remote_ip, uint16_t remote_port)
+const Esp32::ModemState& Esp32::getState(void)
 {
-	if (m_busy)
-	{
+	return m_state;
+}
+
+void Esp32::invalidateState(uint8_t mask)
+{
+	m_state.valid &= ~mask;
+}
+
+bool Esp32::setMUX(IWifi* pWifi, bool isMUX)
+{
+	if (!beginCMD(pWifi, CMD_SETMUX))
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_SENDSTRING;
-	m_sendBuffer = (byte*)s;
-	m_pSerial->print("AT+CIPSENDEX=");
-	m_pSerial->print(SEND_MAXSIZE, 10);
-	if (remote_ip != 0 && remote_port != 0)
-	{
-		m_pSerial->print(",\"");
-		m_pSerial->print(remote_ip >> 24, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 16) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print((remote_ip >> 8) & 0xff, 10);
-		m_pSerial->write('.');
-		m_pSerial->print(remote_ip & 0xff, 10);
-		m_pSerial->print("\",");
-		m_pSerial->print(remote_port, 10);
-	}
-	m_pSerial->println();
+	cmdAppend("AT+CIPMUX=");
+	cmdAppendChar('0' + isMUX);
+	cmdSend();
+	m_isMUX = isMUX;
 	return true;
 }
 
-bool Esp32::closeConnect(IWifi* pWifi, uint8_t link_id)
+bool Esp32::getMUX(IWifi* pWifi)
 {
-	if (m_busy)
+	if (cachedState(STATE_MUX))
 	{
-		return false;
+		if (pWifi != NULL) // m_isMUX already follows an AT+CIPMUX the module may refuse
+			pWifi->cbGetMUX(RESPONSE_OK, m_state.mux);
+		return true;
 	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_CLOSECONNECT;
-	m_pSerial->print("AT+CIPCLOSE=");
-	m_pSerial->write('0' + link_id);
-	m_pSerial->println();
+	if (!beginCMD(pWifi, CMD_GETMUX))
+		return false;
+	cmdAppend("AT+CIPMUX?");
+	cmdSend();
+	m_rxQuery = 0;
 	return true;
 }
 
-bool Esp32::DomainResolution(IWifi* pWifi, char domain[])
+bool Esp32::startTCPServer(IWifi* pWifi, uint16_t port)
 {
-	if (m_busy)
-	{
+	if (!beginCMD(pWifi, CMD_TCPSERVER))
 		return false;
-	}
-	m_busy = true;
-	m_lastSendTime = g_ul_ms_ticks;
-	m_pWifi = pWifi;
-	m_lastCMD = CMD_DOMAIN;
-	m_pSerial->print("AT+CIPDOMAIN=\"");
-	m_pSerial->print(domain);
-	m_pSerial->println("\"");
+	m_serverWifi = pWifi;
+	cmdAppend("AT+CIPSERVER=1,");
+	cmdAppendNum(port);
+	cmdSend();
 	return true;
 }
 
-void Esp32::doSend(void)
+bool Esp32::stopTCPServer(IWifi* pWifi, uint16_t port)
 {
-	m_lastSendTime = g_ul_ms_ticks;
-	if (m_lastCMD == CMD_SENDSTRING)
+	if (!beginCMD(pWifi, CMD_TCPSERVER_STOP))
+		return false;
+	cmdAppend("AT+CIPSERVER=0,");
+	cmdAppendNum(port);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::setServerMaxConn(IWifi* pWifi, uint8_t max_conn)
+{
+	if (!beginCMD(pWifi, CMD_SERVERCONFIG))
+		return false;
+	cmdAppend("AT+CIPSERVERMAXCONN=");
+	cmdAppendNum(max_conn);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::setServerTimeout(IWifi* pWifi, uint16_t timeout)
+{
+	if (!beginCMD(pWifi, CMD_SERVERCONFIG))
+		return false;
+	cmdAppend("AT+CIPSTO=");
+	cmdAppendNum(timeout);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::TCPConnectMUX(IWifi* pWifi, uint8_t link_id, uint32_t remote_ip, uint16_t remote_port)
+{
+	if (!beginCMD(pWifi, CMD_TCPCONNECT))
+		return false;
+	beginConnect(link_id, TCP, remote_ip, remote_port);
+	cmdAppend("AT+CIPSTART=");
+	cmdAppendChar('0' + link_id);
+	cmdAppend(",\"TCP\",\"");
+	cmdAppendIP(remote_ip);
+	cmdAppend("\",");
+	cmdAppendNum(remote_port);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::TCPConnect(IWifi* pWifi, uint32_t remote_ip, uint16_t remote_port)
+{
+	if (!beginCMD(pWifi, CMD_TCPCONNECT))
+		return false;
+	beginConnect(0, TCP, remote_ip, remote_port);
+	cmdAppend("AT+CIPSTART=");
+	cmdAppend("\"TCP\",\"");
+	cmdAppendIP(remote_ip);
+	cmdAppend("\",");
+	cmdAppendNum(remote_port);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::UDPConnectMUX(IWifi* pWifi, uint8_t link_id, uint32_t remote_ip, uint16_t remote_port, uint16_t local_port, int mode)
+{
+	if (!beginCMD(pWifi, CMD_UDPCONNECT))
+		return false;
+	beginConnect(link_id, UDP, remote_ip, remote_port);
+	cmdAppend("AT+CIPSTART=");
+	cmdAppendChar('0' + link_id);
+	cmdAppend(",\"UDP\",\"");
+	cmdAppendIP(remote_ip);
+	cmdAppend("\",");
+	cmdAppendNum(remote_port);
+	if (local_port > 0)
 	{
-		m_lastCMD = CMD_DOSEND;
-		size_t size = strnlen((const char*)m_sendBuffer, SEND_MAXSIZE);
-		wdt_restart(WDT);
-		m_pSerial->write(m_sendBuffer, size);
+		cmdAppendChar(',');
+		cmdAppendNum(local_port);
+		cmdAppendChar(',');
+		cmdAppendChar('0' + mode);
 	}
-	else if (m_lastCMD == CMD_SENDBYTES)
+	cmdSend();
+	return true;
+}
+
+bool Esp32::UDPConnect(IWifi* pWifi, uint32_t remote_ip, uint16_t remote_port, uint16_t local_port, int mode)
+{
+	if (!beginCMD(pWifi, CMD_UDPCONNECT))
+		return false;
+	beginConnect(0, UDP, remote_ip, remote_port);
+	cmdAppend("AT+CIPSTART=");
+	cmdAppend("\"UDP\",\"");
+	cmdAppendIP(remote_ip);
+	cmdAppend("\",");
+	cmdAppendNum(remote_port);
+	if (local_port > 0)
 	{
-		m_lastCMD = CMD_DOSEND;
-		wdt_restart(WDT);
-		m_pSerial->write(m_sendBuffer, m_sendSize);
+		cmdAppendChar(',');
+		cmdAppendNum(local_port);
+		cmdAppendChar(',');
+		cmdAppendChar('0' + mode);
 	}
+	cmdSend();
+	return true;
 }
 
-void Esp32::parseReceived(void)
+bool Esp32::SSLConnectMUX(IWifi* pWifi, uint8_t link_id, uint32_t remote_ip, uint16_t remote_port, uint16_t keep_alive)
 {
-	while (true)
+	if (link_id >= LINK_MAX)
+		return false;
+	LinkState& link = m_links[link_id];
+	if (link.connected && link.type == SSL && link.remote_ip == remote_ip && link.remote_port == remote_port)
 	{
-		int len = m_rxBuffer.length();
-		if (len == 0)
-			break;
-		if (processNetworkData()) // if matched command but not enough data
-			break;
-		if (processDisconnectAP()) // if matched command but not enough data
-			break;
-		if (processGetIP()) // if matched command but not enough data
-			break;
-		if (processGetAPIP()) // if matched command but not enough data
-			break;
-		if (processGetSTAIP()) // if matched command but not enough data
-			break;
-		if (processDomainResolution()) // if matched command but not enough data
-			break;
-		if (processSend()) // if matched command but not enough data
-			break;
-		if (processSendEnd()) // if matched command but not enough data
-			break;
-		if (processReset()) // if matched command but not enough data
-			break;
-		if (processBusy()) // if matched command but not enough data
-			break;
-		if (processError()) // if matched command but not enough data
-			break;
-		if (processOK()) // if matched command but not enough data
-			break;
-		if (len == m_rxBuffer.length()) // if not processed
-		{
-			int index = m_rxBuffer.find_word(WORD_CRLF);
-			if (index != -1)
-				m_rxBuffer.cut(index + 2);
-			else if (m_rxBuffer.is_full())
-			{
-				m_rxBuffer.clear();
-			}
-			else
-				break;
-		}
+		// nothing to connect, the link stays as it is
+		link.reuse_waiter = pWifi;
+		m_reusedLinks |= 1 << link_id;
+		m_connStats[SSL].reused++;
+		return true;
 	}
+	if (!beginCMD(pWifi, CMD_SSLCONNECT))
+		return false;
+	beginConnect(link_id, SSL, remote_ip, remote_port);
+	cmdAppend("AT+CIPSTART=");
+	cmdAppendChar('0' + link_id);
+	cmdAppend(",\"SSL\",\"");
+	cmdAppendIP(remote_ip);
+	cmdAppend("\",");
+	cmdAppendNum(remote_port);
+	if (keep_alive > 0)
+	{
+		cmdAppendChar(',');
+		cmdAppendNum(keep_alive);
+	}
+	cmdSend();
+	return true;
 }
 
-bool Esp32::processNetworkData(void)
+bool Esp32::SSLConnect(IWifi* pWifi, uint32_t remote_ip, uint16_t remote_port, uint16_t keep_alive)
 {
-	int len = m_rxBuffer.length();
-	// if receiving network data not end
-	if (m_rxDataRestSize > 0)
+	LinkState& link = m_links[0];
+	if (link.connected && link.type == SSL && link.remote_ip == remote_ip && link.remote_port == remote_port)
 	{
-		if (m_rxDataRestSize > len)
-		{
-			if (m_pWifi != NULL)
-				m_pWifi->cbReceivedData(m_rxDataLinkID, m_rxBuffer, 0, len);
+		link.reuse_waiter = pWifi;
+		m_reusedLinks |= 1;
+		m_connStats[SSL].reused++;
+		return true;
+	}
+	if (!beginCMD(pWifi, CMD_SSLCONNECT))
+		return false;
+	beginConnect(0, SSL, remote_ip, remote_port);
+	cmdAppend("AT+CIPSTART=");
+	cmdAppend("\"SSL\",\"");
+	cmdAppendIP(remote_ip);
+	cmdAppend("\",");
+	cmdAppendNum(remote_port);
+	if (keep_alive > 0)
+	{
+		cmdAppendChar(',');
+		cmdAppendNum(keep_alive);
+	}
+	cmdSend();
+	return true;
+}
+
+bool Esp32::setSSLBufferSize(IWifi* pWifi, size_t size)
+{
+	if (!beginCMD(pWifi, CMD_SSLCONFIG))
+		return false;
+	cmdAppend("AT+CIPSSLSIZE=");
+	cmdAppendNum(size);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::setSSLConfig(IWifi* pWifi, uint8_t link_id, uint8_t auth_mode, uint8_t pki_number, uint8_t ca_number)
+{
+	if (!beginCMD(pWifi, CMD_SSLCONFIG))
+		return false;
+	cmdAppend("AT+CIPSSLCCONF=");
+	cmdAppendChar('0' + link_id);
+	cmdAppendChar(',');
+	cmdAppendNum(auth_mode);
+	if (auth_mode != 0)
+	{
+		cmdAppendChar(',');
+		cmdAppendNum(pki_number);
+		cmdAppendChar(',');
+		cmdAppendNum(ca_number);
+	}
+	cmdSend();
+	return true;
+}
+
+bool Esp32::setSSLServerName(IWifi* pWifi, uint8_t link_id, const char name[])
+{
+	if (!beginCMD(pWifi, CMD_SSLCONFIG))
+		return false;
+	cmdAppend("AT+CIPSSLCSNI=");
+	cmdAppendChar('0' + link_id);
+	cmdAppend(",\"");
+	cmdAppend(name);
+	cmdAppendChar('"');
+	cmdSend();
+	return true;
+}
+
+bool Esp32::isConnected(uint8_t link_id)
+{
+	return link_id < LINK_MAX && m_links[link_id].connected;
+}
+
+bool Esp32::isBusy(void)
+{
+	return m_busy;
+}
+
+const Esp32::ConnStats& Esp32::getConnStats(ConnType type)
+{
+	return m_connStats[type];
+}
+
+int Esp32::connectPooled(IWifi* pWifi, ConnType type, uint32_t remote_ip, uint16_t remote_port)
+{
+	int free_id = -1;
+	int lru_id = -1;
+	for (int i = 0; i < LINK_MAX; i++)
+	{
+		LinkState& link = m_links[i];
+		if ((m_poolLinks & (1 << i)) == 0 || link.in_use)
+			continue;
+		if (link.pooled && link.connected)
+		{
+			if (link.type == type && link.remote_ip == remote_ip && link.remote_port == remote_port)
+			{
+				link.in_use = true;
+				link.last_used = ++m_poolTick;
+				link.reuse_waiter = pWifi;
+				m_reusedLinks |= 1 << i;
+				m_connStats[type].reused++;
+				m_poolStats.hits++;
+				return i;
+			}
+			if (lru_id == -1 || link.last_used < m_links[lru_id].last_used)
+				lru_id = i;
+		}
+		else if (!link.connected && free_id == -1)
+		{
+			free_id = i;
+		}
+	}
+	if (m_busy || m_poolLinkID != -1)
+		return -1;
+	int link_id = free_id != -1 ? free_id : lru_id;
+	if (link_id == -1)
+	{
+		m_poolStats.exhausted++;
+		return -1;
+	}
+	m_poolStats.misses++;
+	if (link_id == free_id)
+	{
+		if (!startConnect(pWifi, link_id, type, remote_ip, remote_port))
+			return -1;
+	}
+	else
+	{
+		// AT+CIPSTART fails on an open link, the connect follows the close from loop()
+		if (!closeConnect(pWifi, link_id))
+			return -1;
+		m_poolStats.evictions++;
+		m_poolLinkID = link_id;
+		m_poolWifi = pWifi;
+		m_poolType = type;
+		m_poolIP = remote_ip;
+		m_poolPort = remote_port;
+	}
+	LinkState& link = m_links[link_id];
+	link.pooled = true;
+	link.in_use = true;
+	link.last_used = ++m_poolTick;
+	return link_id;
+}
+
+void Esp32::releaseLink(uint8_t link_id)
+{
+	if (link_id >= LINK_MAX)
+		return;
+	m_links[link_id].in_use = false;
+	m_links[link_id].last_used = ++m_poolTick;
+}
+
+void Esp32::setPoolLinks(uint8_t mask)
+{
+	m_poolLinks = mask & ((1 << LINK_MAX) - 1);
+}
+
+const Esp32::PoolStats& Esp32::getPoolStats(void)
+{
+	return m_poolStats;
+}
+
+bool Esp32::sendBytesMUX(IWifi* pWifi, uint8_t link_id, byte* buffer, size_t size, uint32_t remote_ip, uint16_t remote_port)
+{
+	if (!acquireSend(pWifi, link_id) || !beginCMD(pWifi, CMD_SENDBYTES))
+		return false;
+	m_sendLinkID = link_id;
+	m_sendMUX = true;
+	m_sendBuffer = buffer;
+	m_sendRest = size;
+	m_sendIP = remote_ip;
+	m_sendPort = remote_port;
+	sendPiece();
+	return true;
+}
+
+bool Esp32::sendBytes(IWifi* pWifi, byte* buffer, size_t size, uint32_t remote_ip, uint16_t remote_port)
+{
+	if (!acquireSend(pWifi, 0) || !beginCMD(pWifi, CMD_SENDBYTES))
+		return false;
+	m_sendLinkID = 0;
+	m_sendMUX = false;
+	m_sendBuffer = buffer;
+	m_sendRest = size;
+	m_sendIP = remote_ip;
+	m_sendPort = remote_port;
+	sendPiece();
+	return true;
+}
+
+bool Esp32::sendStringMUX(IWifi* pWifi, uint8_t link_id, const char s[], uint32_t remote_ip, uint16_t remote_port)
+{
+	return false;
+	if (!acquireSend(pWifi, link_id) || !beginCMD(pWifi, CMD_SENDSTRING))
+		return false;
+	m_sendLinkID = link_id;
+	m_sendBuffer = (byte*)s;
+	cmdAppend("AT+CIPSENDEX=");
+	cmdAppendChar('0' + link_id);
+	cmdAppendChar(',');
+	cmdAppendNum(SEND_MAXSIZE);
+	if (remote_ip != 0 && remote_port != 0)
+	{
+		cmdAppend(",\"");
+		cmdAppendIP(remote_ip);
+		cmdAppend("\",");
+		cmdAppendNum(remote_port);
+	}
+	cmdSend();
+	return true;
+}
+
+bool Esp32::sendString(IWifi* pWifi, const char s[], uint32_t remote_ip, uint16_t remote_port)
+{
+	if (!acquireSend(pWifi, 0) || !beginCMD(pWifi, CMD_SENDSTRING))
+		return false;
+	m_sendLinkID = 0;
+	m_sendBuffer = (byte*)s;
+	cmdAppend("AT+CIPSENDEX=");
+	cmdAppendNum(SEND_MAXSIZE);
+	if (remote_ip != 0 && remote_port != 0)
+	{
+		cmdAppend(",\"");
+		cmdAppendIP(remote_ip);
+		cmdAppend("\",");
+		cmdAppendNum(remote_port);
+	}
+	cmdSend();
+	return true;
+}
+
+bool Esp32::sendBurstMUX(IWifi* pWifi, uint8_t link_id, Datagram* datagrams, size_t count)
+{
+	if (pWifi == NULL || link_id >= LINK_MAX || count == 0 || m_busy || m_burst != NULL)
+		return false;
+	for (size_t i = 0; i < count; i++)
+	{
+		datagrams[i].result = RESPONSE_TIMEOUT;
+	}
+	m_burst = datagrams;
+	m_burstCount = count;
+	m_burstIndex = 0;
+	m_burstSent = 0;
+	m_burstLinkID = link_id;
+	m_burstWifi = pWifi;
+	burstNext();
+	return true;
+}
+
+bool Esp32::closeConnect(IWifi* pWifi, uint8_t link_id)
+{
+	if (!beginCMD(pWifi, CMD_CLOSECONNECT))
+		return false;
+	m_connLinkID = link_id;
+	cmdAppend("AT+CIPCLOSE=");
+	cmdAppendChar('0' + link_id);
+	cmdSend();
+	return true;
+}
+
+bool Esp32::DomainResolution(IWifi* pWifi, char domain[])
+{
+	if (!beginCMD(pWifi, CMD_DOMAIN))
+		return false;
+	cmdAppend("AT+CIPDOMAIN=\"");
+	cmdAppend(domain);
+	cmdAppend("\"");
+	cmdSend();
+	return true;
+}
+
+void Esp32::doSend(void)
+{
+	if (m_lastCMD == CMD_SENDSTRING)
+		m_sendSize = strnlen((const char*)m_sendBuffer, SEND_MAXSIZE);
+	else if (m_lastCMD != CMD_SENDBYTES)
+		return;
+	sampleRTT(m_lastCMD); // the prompt closes the command phase
+	m_retries = 0; // the payload phase has not been retried
+	m_lastCMD = CMD_DOSEND;
+	m_lastSendTime = m_pClock->micros();
+	m_timers.arm(m_cmdTimer, cmdTimeout(CMD_DOSEND));
+	m_sendTaken = 0;
+	trace(Esp32Trace::TRACE_PROMPT, m_sendLinkID, m_sendSize);
+#ifndef __linux__
+	wdt_restart(WDT);
+#endif
+	m_pSerial->write(m_sendBuffer, m_sendSize);
+}
+
+void Esp32::parseReceived(void)
+{
+	while (true)
+	{
+		int len = m_rxBuffer.length();
+		if (len == 0)
+			break;
+		if (processNetworkData()) // if matched command but not enough data
+			break;
+		if (processWifiStatus()) // if matched command but not enough data
+			break;
+		if (processLinkStatus()) // if matched command but not enough data
+			break;
+		if (processGetIP()) // if matched command but not enough data
+			break;
+		if (processGetAPIP()) // if matched command but not enough data
+			break;
+		if (processGetSTAIP()) // if matched command but not enough data
+			break;
+		if (processDomainResolution()) // if matched command but not enough data
+			break;
+		if (processQuery()) // if matched command but not enough data
+			break;
+		if (processNetStatus()) // if matched command but not enough data
+			break;
+		if (processSend()) // if matched command but not enough data
+			break;
+		if (processSendEnd()) // if matched command but not enough data
+			break;
+		if (processReset()) // if matched command but not enough data
+			break;
+		if (processBusy()) // if matched command but not enough data
+			break;
+		if (processError()) // if matched command but not enough data
+			break;
+		if (processOK()) // if matched command but not enough data
+			break;
+		if (len == m_rxBuffer.length()) // if not processed
+		{
+			int index = m_rxBuffer.find_word(WORD_CRLF);
+			if (index != -1)
+				m_rxBuffer.cut(index + 2);
+			else if (m_rxBuffer.is_full())
+			{
+				m_rxStats.bytes_lost += m_rxBuffer.length();
+				m_rxBuffer.clear();
+			}
+			else
+				break;
+		}
+	}
+}
+
+bool Esp32::processNetworkData(void)
+{
+	int len = m_rxBuffer.length();
+	// if receiving network data not end
+	if (m_rxDataRestSize > 0)
+	{
+		if (m_rxDataRestSize > len)
+		{
+			deliverData(m_rxDataLinkID, 0, len);
 			m_rxBuffer.clear();
 			m_rxDataRestSize -= len;
 			return true;
 		}
 		else
 		{
-			if (m_pWifi != NULL)
-				m_pWifi->cbReceivedData(m_rxDataLinkID, m_rxBuffer, 0, m_rxDataRestSize);
+			deliverData(m_rxDataLinkID, 0, m_rxDataRestSize);
 			m_rxBuffer.cut(m_rxDataRestSize);
 			m_rxDataRestSize = 0;
+			flushDirect(m_rxDataLinkID);
 		}
 	}
 	while (true)
 	{
 		strip();
 		len = m_rxBuffer.length();
-		int index = m_rxBuffer.find_word(WORD_CRLF);
 		// if received network data
-		if (m_rxBuffer.cmp_bytes((byte*)"+IPD,", 5))
+		if (m_rxToken == TOKEN_IPD)
 		{
 			bool hasError = false;
-			int offset = (int)m_isMUX << 1;
-			if (len < 7 + offset && index == -1) // if command not end, wait for more data
+			int head = s_tokens[TOKEN_IPD].size + ((int)m_isMUX << 1); // and "<link>," in multi-connection mode
+			if (len < head + 2 && m_rxBuffer.find_word(WORD_CRLF) == -1) // if command not end, wait for more data
 				return true;
-			int index1 = m_rxBuffer.find_byte(':', 6 + offset, index); // get the start sign of the network data
+			// one pass over the header for the start sign of the network data and the
+			// first ',' before it, the payload is never scanned
+			int index1 = -1;
+			int index2 = -1;
+			int k = head + 1;
+			while ((k = m_rxBuffer.find_delim(k, len)) != -1)
+			{
+				byte c = m_rxBuffer.read_byte(k);
+				if (c == ':')
+				{
+					index1 = k;
+					break;
+				}
+				if (c == ',' && index2 == -1)
+					index2 = k;
+				else if (c == '\r' && k + 1 < len && m_rxBuffer.read_byte(k + 1) == '\n')
+					break; // the header ended without one
+				k++;
+			}
 			if (index1 != -1)
 			{
 				int link_id;
 				if (m_isMUX) // if multi-connection mode
 				{
-					link_id = m_rxBuffer.read_byte(5) - '0';
+					link_id = m_rxBuffer.read_byte(s_tokens[TOKEN_IPD].size) - '0';
 				}
 				else
 				{
@@ -939,24 +1618,21 @@ bool Esp32::processNetworkData(void)
 				}
 				if (link_id >= 0 && link_id <= 4) // if link_id in the correct range
 				{
-					int index2 = m_rxBuffer.find_byte(',', 6 + offset, index1);
-					if (index2 == -1 || index2 > index1)
+					if (index2 == -1)
 					{
 						index2 = index1;
 					}
-					int n_len = index2 - 5 - offset;
+					int n_len = index2 - head;
 					if (n_len > 0 && n_len < 6) // data length should be less than 6 figures
 					{
 						char s[6];
-						int c = m_rxBuffer.read_bytes((byte*)s, n_len, 5 + offset);
+						int c = m_rxBuffer.read_bytes((byte*)s, n_len, head);
 						s[c] = 0;
 						int n = atoi(s);
 						if (len < index1 + n + 1)
 						{
-							if (m_pWifi != NULL)
-							{
-								m_pWifi->cbReceivedData(link_id, m_rxBuffer, index1 + 1, len);
-							}
+							m_rxStats.frames++;
+							deliverData(link_id, index1 + 1, len);
 							m_rxDataLinkID = link_id;
 							m_rxDataRestSize = n - (len - (index1 + 1));
 							m_rxBuffer.clear();
@@ -964,8 +1640,9 @@ bool Esp32::processNetworkData(void)
 						}
 						else if (n > 0)
 						{
-							if (m_pWifi != NULL)
-								m_pWifi->cbReceivedData(link_id, m_rxBuffer, index1 + 1, index1 + 1 + n);
+							m_rxStats.frames++;
+							deliverData(link_id, index1 + 1, index1 + 1 + n);
+							flushDirect(link_id);
 							m_rxBuffer.cut(index1 + 1 + n);
 							continue;
 						}
@@ -985,6 +1662,7 @@ bool Esp32::processNetworkData(void)
 			else
 				return true;
 
+			int index = m_rxBuffer.find_word(WORD_CRLF);
 			if (index != -1)
 			{
 				m_rxBuffer.cut(index + 2);
@@ -992,6 +1670,7 @@ bool Esp32::processNetworkData(void)
 			}
 			else
 			{
+				m_rxStats.bytes_lost += m_rxBuffer.length();
 				m_rxBuffer.clear();
 				return false;
 			}
@@ -1004,18 +1683,190 @@ bool Esp32::processNetworkData(void)
 	return false;
 }
 
-bool Esp32::processDisconnectAP(void)
+void Esp32::deliverData(int link_id, int begin, int end)
+{
+	LinkState& link = m_links[link_id];
+	if (link.rx_buffer != NULL)
+	{
+		// header and payload arrived in the same chunk, move the payload out of the ring
+		while (begin < end)
+		{
+			size_t c = m_rxBuffer.read_bytes(link.rx_buffer + link.rx_len, min_size(end - begin, link.rx_size - link.rx_len), begin);
+			link.rx_len += c;
+			begin += c;
+			if (link.rx_len == link.rx_size)
+				flushDirect(link_id);
+		}
+		return;
+	}
+	uint32_t latency = Esp32Clock::elapsed(m_pClock->micros(), m_rxTime);
+	m_rxStats.bytes_delivered[link_id] += end - begin;
+	m_rxStats.deliveries++;
+	m_rxStats.latency_sum += latency;
+	if (latency > m_rxStats.latency_max)
+		m_rxStats.latency_max = latency;
+	trace(Esp32Trace::TRACE_DATA, link_id, end - begin);
+	IWifi* pWifi = link.owner != NULL ? link.owner : m_pWifi;
+	if (pWifi != NULL)
+		pWifi->cbReceivedData(link_id, m_rxBuffer, begin, end);
+}
+
+size_t Esp32::readDirect(size_t n)
+{
+	LinkState& link = m_links[m_rxDataLinkID];
+	n = min_size(n, min_size(m_rxDataRestSize, link.rx_size - link.rx_len));
+	size_t c = m_pSerial->read(link.rx_buffer + link.rx_len, n);
+	link.rx_len += c;
+	m_rxDataRestSize -= c;
+	m_rxStats.bytes_received += c;
+	if (link.rx_len == link.rx_size || (c > 0 && m_rxDataRestSize == 0))
+		flushDirect(m_rxDataLinkID);
+	return c;
+}
+
+void Esp32::flushDirect(int link_id)
+{
+	LinkState& link = m_links[link_id];
+	if (link.rx_buffer == NULL || link.rx_len == 0)
+		return;
+	uint32_t latency = Esp32Clock::elapsed(m_pClock->micros(), m_rxTime);
+	m_rxStats.bytes_delivered[link_id] += link.rx_len;
+	m_rxStats.deliveries++;
+	m_rxStats.latency_sum += latency;
+	if (latency > m_rxStats.latency_max)
+		m_rxStats.latency_max = latency;
+	size_t len = link.rx_len;
+	link.rx_len = 0;
+	trace(Esp32Trace::TRACE_DATA, link_id, len);
+	IWifi* pWifi = link.owner != NULL ? link.owner : m_pWifi;
+	if (pWifi != NULL)
+		pWifi->cbReceivedDirect(link_id, link.rx_buffer, len);
+}
+
+bool Esp32::setLinkBuffer(uint8_t link_id, byte* buffer, size_t size)
+{
+	if (link_id >= LINK_MAX || (buffer != NULL && size == 0))
+		return false;
+	LinkState& link = m_links[link_id];
+	flushDirect(link_id);
+	link.rx_buffer = buffer;
+	link.rx_size = size;
+	link.rx_len = 0;
+	if (buffer != NULL)
+		m_directLinks |= 1 << link_id;
+	else
+		m_directLinks &= ~(1 << link_id);
+	return true;
+}
+
+bool Esp32::setLinkOwner(uint8_t link_id, IWifi* owner)
+{
+	if (link_id >= LINK_MAX)
+		return false;
+	m_links[link_id].owner = owner;
+	return true;
+}
+
+const Esp32::RxStats& Esp32::getRxStats(void)
+{
+	return m_rxStats;
+}
+
+#ifdef WIFI_TRACE
+Esp32Trace& Esp32::getTrace(void)
+{
+	return m_trace;
+}
+#endif
+
+void Esp32::resetRxStats(void)
+{
+	memset(&m_rxStats, 0, sizeof(m_rxStats));
+}
+
+bool Esp32::processWifiStatus(void)
 {
 	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"WIFI DISCONNECT\r\n", 17))
+	if (m_rxToken == TOKEN_WIFI_DISCONNECT)
 	{
+		m_state.valid &= ~(STATE_STA_IP | STATE_STA_MASK | STATE_AP);
 		if (m_pWifi != NULL)
 			m_pWifi->cbDisconnectAP();
-		m_rxBuffer.cut(17);
+		m_rxBuffer.cut(s_tokens[TOKEN_WIFI_DISCONNECT].size);
+	}
+	else if (m_rxToken == TOKEN_WIFI_CONNECTED)
+	{
+		m_state.valid &= ~STATE_AP;
+		m_rxBuffer.cut(s_tokens[TOKEN_WIFI_CONNECTED].size);
+	}
+	else if (m_rxToken == TOKEN_WIFI_GOT_IP) // a new lease may bring a new address
+	{
+		m_state.valid &= ~(STATE_STA_IP | STATE_STA_MASK);
+		m_rxBuffer.cut(s_tokens[TOKEN_WIFI_GOT_IP].size);
+	}
+	return false;
+}
+
+bool Esp32::processLinkStatus(void)
+{
+	strip();
+	int link_id = 0;
+	int offset = 0;
+	if (m_rxBuffer.length() >= 2 && m_rxBuffer[1] == ',' && m_rxBuffer[0] >= '0' && m_rxBuffer[0] < '0' + LINK_MAX)
+	{
+		link_id = m_rxBuffer[0] - '0';
+		offset = 2;
+	}
+	uint8_t token = offset == 0 ? m_rxToken : matchToken(offset);
+	if (token == TOKEN_CLOSED)
+	{
+		m_rxBuffer.cut(offset + s_tokens[TOKEN_CLOSED].size);
+		linkClosed(link_id);
+	}
+	else if (token == TOKEN_CONNECT)
+	{
+		// also sent for a client accepted by the server, whose end is not known
+		LinkState& link = m_links[link_id];
+		m_rxBuffer.cut(offset + s_tokens[TOKEN_CONNECT].size);
+		if (link.connected)
+			return false;
+		link.connected = true;
+		link.type = TCP;
+		link.remote_ip = 0;
+		link.remote_port = 0;
+		trace(Esp32Trace::TRACE_LINK, link_id, 1);
+		if (!connectPending(link_id))
+		{
+			link.accepted = true;
+			if (m_serverWifi != NULL)
+				m_serverWifi->cbLinkAccepted(link_id);
+		}
 	}
 	return false;
 }
 
+// our AT+CIPSTART on the link is in flight or waits out a retry backoff, during
+// which m_lastCMD is CMD_NONE and a late "CONNECT" still answers it
+bool Esp32::connectPending(int link_id)
+{
+	CMDType cmd = m_retryCMD != CMD_NONE ? m_retryCMD : m_lastCMD;
+	return m_busy && m_connLinkID == link_id
+		&& (cmd == CMD_TCPCONNECT || cmd == CMD_UDPCONNECT || cmd == CMD_SSLCONNECT);
+}
+
+void Esp32::linkClosed(int link_id)
+{
+	LinkState& link = m_links[link_id];
+	if (!link.connected)
+		return;
+	link.connected = false;
+	trace(Esp32Trace::TRACE_LINK, link_id, 0);
+	IWifi* pWifi = link.owner != NULL ? link.owner : (link.accepted ? m_serverWifi : NULL);
+	link.accepted = false;
+	if (pWifi != NULL)
+		pWifi->cbLinkClosed(link_id);
+}
+
 bool Esp32::processGetIP(void)
 {
 	if (m_lastCMD != CMD_GETIP)
@@ -1023,42 +1874,43 @@ bool Esp32::processGetIP(void)
 	while (true)
 	{
 		strip();
-		bool isAPIP = m_rxBuffer.cmp_bytes((byte*)"+CIFSR:APIP,\"", 13);
-		bool isSTAIP = m_rxBuffer.cmp_bytes((byte*)"+CIFSR:STAIP,\"", 14);
+		if (m_rxToken != TOKEN_CIFSR)
+			break;
+		int head = s_tokens[TOKEN_CIFSR].size;
+		bool isAPIP = cmpToken(TOKEN_APIP, head);
+		bool isSTAIP = !isAPIP && cmpToken(TOKEN_STAIP, head);
 		if (!(isAPIP || isSTAIP))
 			break;
+		head += s_tokens[isAPIP ? TOKEN_APIP : TOKEN_STAIP].size;
 		int len = m_rxBuffer.length();
 		int index = m_rxBuffer.find_word(WORD_CRLF);
-		int offset = (int)isSTAIP;
-		if (len < 30 + offset && index == -1) // if command not end, wait more data
+		if (len < head + IP_TEXT_MAX + 3 && index == -1) // if command not end, wait more data
 			return true;
 		else if (index == -1) // if line too long and no CRLF, clear incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbGetIP(RESPONSE_UNKNOWN_ERROR, 0, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.clear();
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			return false;
 		}
-		else if (index > 31 + offset) // if line too long with CRLF, cut incorrect data
+		else if (index > head + IP_TEXT_MAX + 1) // if line too long with CRLF, cut incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbGetIP(RESPONSE_UNKNOWN_ERROR, 0, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.cut(index + 2); // cut this line
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			break;
 		}
 		int p1, p2, p3, p4;
-		char s[18];
-		int c = m_rxBuffer.read_bytes((byte*)s, 17, 13 + offset);
+		char s[IP_TEXT_MAX + 1];
+		int c = m_rxBuffer.read_bytes((byte*)s, IP_TEXT_MAX, head);
 		s[c] = 0;
 		int n = sscanf(s, "%d.%d.%d.%d", &p1, &p2, &p3, &p4);
 		if (n < 4)
@@ -1075,13 +1927,13 @@ bool Esp32::processGetIP(void)
 	}
 
 	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"OK\r\n", 4))
+	if (m_rxToken == TOKEN_OK)
 	{
+		updateState();
 		if (m_pWifi != NULL)
 			m_pWifi->cbGetIP(RESPONSE_OK, m_rxGetAPIP, m_rxGetSTAIP);
-		m_rxBuffer.cut(4); // cut this line
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		m_rxBuffer.cut(s_tokens[TOKEN_OK].size); // cut this line
+		endCMD();
 	}
 	return false;
 }
@@ -1093,15 +1945,16 @@ bool Esp32::processGetAPIP(void)
 	while (true)
 	{
 		strip();
+		if (m_rxToken != TOKEN_CIPAP)
+			break;
 		int len = m_rxBuffer.length();
+		int head = s_tokens[TOKEN_CIPAP].size;
 		bool isIP = false, isMask = false, isGateway = false;
-		if (len < 11)
-			break;
-		else if (m_rxBuffer.cmp_bytes((byte*)"+CIPAP:ip:\"", 11))
+		if (cmpToken(TOKEN_IP, head))
 			isIP = true;
-		else if (m_rxBuffer.cmp_bytes((byte*)"+CIPAP:netmask:\"", 16))
+		else if (cmpToken(TOKEN_NETMASK, head))
 			isMask = true;
-		else if (m_rxBuffer.cmp_bytes((byte*)"+CIPAP:gateway:\"", 16))
+		else if (cmpToken(TOKEN_GATEWAY, head))
 			isGateway = true;
 		if (!(isIP || isMask || isGateway))
 			break;
@@ -1116,36 +1969,34 @@ bool Esp32::processGetAPIP(void)
 			else
 				return true;
 		}
-		int offset = (int)isMask + ((int)isMask << 2);
-		if (len < 29 + offset && index == -1) // if command not end, wait more data
+		head += s_tokens[isIP ? TOKEN_IP : TOKEN_NETMASK].size;
+		if (len < head + IP_TEXT_MAX + 3 && index == -1) // if command not end, wait more data
 			return true;
 		else if (index == -1) // if line too long and no CRLF, clear incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbGetAPIP(RESPONSE_UNKNOWN_ERROR, 0, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.clear();
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			return false;
 		}
-		else if (index > 27 + offset) // if line too long with CRLF, cut incorrect data
+		else if (index > head + IP_TEXT_MAX + 1) // if line too long with CRLF, cut incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbGetAPIP(RESPONSE_UNKNOWN_ERROR, 0, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.cut(index + 2); // cut this line
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			continue;
 		}
 		int p1, p2, p3, p4;
-		char s[18];
-		int c = m_rxBuffer.read_bytes((byte*)s, 15, 11 + offset);
+		char s[IP_TEXT_MAX + 1];
+		int c = m_rxBuffer.read_bytes((byte*)s, IP_TEXT_MAX, head);
 		s[c] = 0;
 		int n = sscanf(s, "%d.%d.%d.%d", &p1, &p2, &p3, &p4);
 		if (n < 4)
@@ -1162,13 +2013,13 @@ bool Esp32::processGetAPIP(void)
 	}
 
 	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"OK\r\n", 4))
+	if (m_rxToken == TOKEN_OK)
 	{
+		updateState();
 		if (m_pWifi != NULL)
 			m_pWifi->cbGetAPIP(RESPONSE_OK, m_rxGetAPIP, m_rxGetAPMask);
-		m_rxBuffer.cut(4); // cut this line
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		m_rxBuffer.cut(s_tokens[TOKEN_OK].size); // cut this line
+		endCMD();
 	}
 	return false;
 }
@@ -1180,15 +2031,16 @@ bool Esp32::processGetSTAIP(void)
 	while (true)
 	{
 		strip();
+		if (m_rxToken != TOKEN_CIPSTA)
+			break;
 		int len = m_rxBuffer.length();
+		int head = s_tokens[TOKEN_CIPSTA].size;
 		bool isIP = false, isMask = false, isGateway = false;
-		if (len < 11)
-			break;
-		else if (m_rxBuffer.cmp_bytes((byte*)"+CIPSTA:ip:\"", 12))
+		if (cmpToken(TOKEN_IP, head))
 			isIP = true;
-		else if (m_rxBuffer.cmp_bytes((byte*)"+CIPSTA:netmask:\"", 17))
+		else if (cmpToken(TOKEN_NETMASK, head))
 			isMask = true;
-		else if (m_rxBuffer.cmp_bytes((byte*)"+CIPSTA:gateway:\"", 17))
+		else if (cmpToken(TOKEN_GATEWAY, head))
 			isGateway = true;
 		if (!(isIP || isMask || isGateway))
 			break;
@@ -1203,36 +2055,34 @@ bool Esp32::processGetSTAIP(void)
 			else
 				return true;
 		}
-		int offset = (int)isMask + ((int)isMask << 2);
-		if (len < 30 + offset && index == -1) // if command not end, wait more data
+		head += s_tokens[isIP ? TOKEN_IP : TOKEN_NETMASK].size;
+		if (len < head + IP_TEXT_MAX + 3 && index == -1) // if command not end, wait more data
 			return true;
 		else if (index == -1) // if line too long and no CRLF, clear incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbGetSTAIP(RESPONSE_UNKNOWN_ERROR, 0, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.clear();
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			return false;
 		}
-		else if (index > 28 + offset) // if line too long with CRLF, cut incorrect data
+		else if (index > head + IP_TEXT_MAX + 1) // if line too long with CRLF, cut incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbGetSTAIP(RESPONSE_UNKNOWN_ERROR, 0, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.cut(index + 2); // cut this line
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			break;
 		}
 		int p1, p2, p3, p4;
-		char s[18];
-		int c = m_rxBuffer.read_bytes((byte*)s, 15, 12 + offset);
+		char s[IP_TEXT_MAX + 1];
+		int c = m_rxBuffer.read_bytes((byte*)s, IP_TEXT_MAX, head);
 		s[c] = 0;
 		int n = sscanf(s, "%d.%d.%d.%d", &p1, &p2, &p3, &p4);
 		if (n < 4)
@@ -1249,13 +2099,13 @@ bool Esp32::processGetSTAIP(void)
 	}
 
 	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"OK\r\n", 4))
+	if (m_rxToken == TOKEN_OK)
 	{
+		updateState();
 		if (m_pWifi != NULL)
 			m_pWifi->cbGetSTAIP(RESPONSE_OK, m_rxGetSTAIP, m_rxGetSTAMask);
-		m_rxBuffer.cut(4); // cut this line
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		m_rxBuffer.cut(s_tokens[TOKEN_OK].size); // cut this line
+		endCMD();
 	}
 	return false;
 }
@@ -1265,39 +2115,38 @@ bool Esp32::processDomainResolution(void)
 	if (m_lastCMD != CMD_DOMAIN)
 		return false;
 	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"+CIPDOMAIN:", 11))
+	if (m_rxToken == TOKEN_CIPDOMAIN)
 	{
 		int len = m_rxBuffer.length();
+		int head = s_tokens[TOKEN_CIPDOMAIN].size;
 		int index = m_rxBuffer.find_word(WORD_CRLF);
-		if (len < 28 && index == -1) // if command not end, wait more data
+		if (len < head + IP_TEXT_MAX + 2 && index == -1) // if command not end, wait more data
 			return true;
 		else if (index == -1) // if line too long and no CRLF, clear incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbDomainResolution(RESPONSE_UNKNOWN_ERROR, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.clear();
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			return false;
 		}
-		else if (index > 26) // if line too long with CRLF, cut incorrect data
+		else if (index > head + IP_TEXT_MAX) // if line too long with CRLF, cut incorrect data
 		{
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbDomainResolution(RESPONSE_UNKNOWN_ERROR, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.cut(index + 2); // cut this line
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			return false;
 		}
 		int p1, p2, p3, p4;
-		char s[18];
-		int c = m_rxBuffer.read_bytes((byte*)s, 17, 11);
+		char s[IP_TEXT_MAX + 1];
+		int c = m_rxBuffer.read_bytes((byte*)s, IP_TEXT_MAX, head);
 		s[c] = 0;
 		int n = sscanf(s, "%d.%d.%d.%d", &p1, &p2, &p3, &p4);
 		if (n < 4)
@@ -1305,11 +2154,10 @@ bool Esp32::processDomainResolution(void)
 			if (m_pWifi != NULL)
 			{
 				m_pWifi->cbDomainResolution(RESPONSE_UNKNOWN_ERROR, 0);
-				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+				WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
 			}
 			m_rxBuffer.cut(index + 2);
-			m_lastCMD = CMD_NONE;
-			m_busy = false;
+			endCMD();
 			return false;
 		}
 		uint32_t ip = ((uint32_t)p1 << 24) | ((uint32_t)p2 << 16) | ((uint32_t)p3 << 8) | (uint32_t)p4;
@@ -1318,252 +2166,924 @@ bool Esp32::processDomainResolution(void)
 			m_pWifi->cbDomainResolution(RESPONSE_OK, ip);
 		}
 		m_rxBuffer.cut(index + 2); // processed, cut this line
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		endCMD();
+	}
+	else if (m_rxToken == TOKEN_ERROR)
+	{
+		if (m_pWifi != NULL)
+		{
+			m_pWifi->cbDomainResolution(RESPONSE_DOMAIN_FAIL, 0);
+			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
+		}
+		m_rxBuffer.cut(s_tokens[TOKEN_ERROR].size);
+		endCMD();
 	}
-	else if (m_rxBuffer.cmp_bytes((byte*)"ERROR\r\n", 7))
+	return false;
+}
+
+bool Esp32::processQuery(void)
+{
+	if (m_lastCMD != CMD_GETMODE && m_lastCMD != CMD_GETMUX && m_lastCMD != CMD_GETAP)
+		return false;
+	strip();
+	if (m_lastCMD == CMD_GETAP && m_rxToken == TOKEN_NO_AP)
+	{
+		m_rxSSID[0] = 0;
+		m_rxBuffer.cut(s_tokens[TOKEN_NO_AP].size);
+		return false;
+	}
+	uint8_t token = m_lastCMD == CMD_GETMODE ? TOKEN_CWMODE : (m_lastCMD == CMD_GETMUX ? TOKEN_CIPMUX : TOKEN_CWJAP);
+	if (m_rxToken != token)
+		return false;
+	int index = m_rxBuffer.find_word(WORD_CRLF);
+	if (index == -1) // if command not end, wait more data
+		return true;
+	int head = s_tokens[token].size;
+	if (m_lastCMD == CMD_GETAP)
+	{
+		// "<ssid>","<bssid>",<channel>,<rssi>
+		char s[SSID_MAX_LEN + 4];
+		int c = m_rxBuffer.read_bytes((byte*)s, min_size(index - head, sizeof(s) - 1), head);
+		s[c] = 0;
+		char* end = s[0] == '"' ? strstr(s + 1, "\",") : NULL;
+		int n = end != NULL ? end - (s + 1) : 0;
+		if (n > SSID_MAX_LEN)
+			n = SSID_MAX_LEN;
+		memcpy(m_rxSSID, s + 1, n);
+		m_rxSSID[n] = 0;
+	}
+	else
+	{
+		char s[4];
+		int c = m_rxBuffer.read_bytes((byte*)s, min_size(index - head, sizeof(s) - 1), head);
+		s[c] = 0;
+		m_rxQuery = atoi(s);
+		if (m_lastCMD == CMD_GETMUX) // follow the module, a reset or another host may have changed it
+			m_isMUX = m_rxQuery == 1;
+	}
+	m_rxBuffer.cut(index + 2); // processed, cut this line
+	return false;
+}
+
+bool Esp32::processNetStatus(void)
+{
+	if (m_lastCMD != CMD_GETNETSTATUS)
+		return false;
+	strip();
+	// "STATUS:<stat>" before the links is dropped as an unknown line
+	if (m_rxToken != TOKEN_NONE || !cmpToken(TOKEN_CIPSTATUS, 0))
+		return false;
+	int index = m_rxBuffer.find_word(WORD_CRLF);
+	if (index == -1) // if command not end, wait more data
+		return true;
+	// <link>,"<type>","<remote ip>",<remote port>,<local port>,<1 if accepted by the server>
+	int head = s_tokens[TOKEN_CIPSTATUS].size;
+	char s[48];
+	int c = m_rxBuffer.read_bytes((byte*)s, min_size(index - head, sizeof(s) - 1), head);
+	s[c] = 0;
+	int link_id, p1, p2, p3, p4, port, local_port, server;
+	char type[4];
+	int n = sscanf(s, "%d,\"%3[A-Z]\",\"%d.%d.%d.%d\",%d,%d,%d", &link_id, type, &p1, &p2, &p3, &p4, &port, &local_port, &server);
+	if (n >= 1 && link_id >= 0 && link_id < LINK_MAX)
+	{
+		m_rxLinks |= 1 << link_id;
+		LinkState& link = m_links[link_id];
+		if (!link.connected && n == 9) // its "CONNECT" was not seen
+		{
+			link.connected = true;
+			link.type = strcmp(type, "UDP") == 0 ? UDP : (strcmp(type, "SSL") == 0 ? SSL : TCP);
+			link.remote_ip = ((uint32_t)p1 << 24) | ((uint32_t)p2 << 16) | ((uint32_t)p3 << 8) | (uint32_t)p4;
+			link.remote_port = port;
+			link.accepted = server == 1;
+			trace(Esp32Trace::TRACE_LINK, link_id, 1);
+		}
+	}
+	m_rxBuffer.cut(index + 2); // processed, cut this line
+	return false;
+}
+
+bool Esp32::processSend(void)
+{
+	if (m_lastCMD != CMD_SENDBYTES && m_lastCMD != CMD_SENDSTRING)
+		return false;
+	strip();
+	if (m_rxBuffer[0] == '>')
+	{
+		doSend();
+		m_rxBuffer.cut(1);
+	}
+	return false;
+}
+
+bool Esp32::processSendEnd(void)
+{
+	if (m_lastCMD != CMD_DOSEND)
+		return false;
+	strip();
+	if (m_rxToken == TOKEN_RECV)
+	{
+		int index = m_rxBuffer.find_word(WORD_CRLF);
+		if (index == -1) // if command not end, wait more data
+			return true;
+		// the module took the payload off the UART, a short count means it dropped some
+		char s[8];
+		int head = s_tokens[TOKEN_RECV].size;
+		int c = m_rxBuffer.read_bytes((byte*)s, min_size(index - head, sizeof(s) - 1), head);
+		s[c] = 0;
+		m_sendTaken = atoi(s);
+		if (m_sendTaken != m_sendSize)
+			shrinkWindow(m_sendLinkID);
+		m_rxBuffer.cut(index + 2);
+	}
+	else if (m_rxToken == TOKEN_SEND_OK)
+	{
+		releaseSend(true);
+		if (m_sendRest > 0) // the caller hears once the last piece is sent
+		{
+			m_rxBuffer.cut(s_tokens[TOKEN_SEND_OK].size);
+			nextPiece();
+			return false;
+		}
+		if (m_pWifi != NULL)
+			sendDone(RESPONSE_OK);
+		m_rxBuffer.cut(s_tokens[TOKEN_SEND_OK].size);
+		endCMD();
+	}
+	else if (m_rxToken == TOKEN_SEND_FAIL)
+	{
+		releaseSend(false);
+		if (m_pWifi != NULL)
+		{
+			sendDone(RESPONSE_SEND_FAILED);
+			WIFI_DEBUG_printf("\r\FAILED %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
+		}
+		m_rxBuffer.cut(s_tokens[TOKEN_SEND_FAIL].size);
+		endCMD();
+	}
+	else if (m_rxToken == TOKEN_ERROR)
+	{
+		releaseSend(false);
+		if (m_pWifi != NULL)
+		{
+			sendDone(RESPONSE_SEND_ERROR);
+			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
+		}
+		m_rxBuffer.cut(s_tokens[TOKEN_ERROR].size);
+		endCMD();
+	}
+	return false;
+}
+
+bool Esp32::processScanAP(void)
+{
+	if (m_lastCMD != CMD_SCANAP)
+		return false;
+	strip();
+	if (m_rxToken == TOKEN_CWLAP)
+	{
+		int len = m_rxBuffer.length();
+		int index = m_rxBuffer.find_word(WORD_CRLF);
+		if (index == -1) // if command not end, wait more data
+			return true;
+		m_apFound = true;
+		m_rxBuffer.cut(index + 2);
+	}
+	return false;
+}
+
+bool Esp32::processConnectAP(void)
+{
+	if (m_lastCMD != CMD_CONNECTAP)
+		return false;
+	strip();
+	int head = s_tokens[TOKEN_WIFI_GOT_IP].size + 2; // and the CRLF before "OK"
+	if (m_rxToken == TOKEN_WIFI_GOT_IP && cmpToken(TOKEN_OK, head))
+	{
+		if (m_pWifi != NULL)
+			m_pWifi->cbConnectAP(RESPONSE_OK);
+		m_rxBuffer.cut(head + s_tokens[TOKEN_OK].size);
+		endCMD();
+	}
+	else if (m_rxToken == TOKEN_ERROR)
+	{
+		if (m_pWifi != NULL)
+		{
+			m_pWifi->cbConnectAP(RESPONSE_CONNECTAP_FAIL);
+			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
+		}
+		m_rxBuffer.cut(s_tokens[TOKEN_ERROR].size);
+		endCMD();
+	}
+	return false;
+}
+
+bool Esp32::processReset(void)
+{
+	if (m_lastCMD != CMD_RESET)
+		return false;
+	strip();
+	if (m_rxToken == TOKEN_READY)
+	{
+		// the module starts single-connection with every link closed
+		m_isMUX = false;
+		m_state.mux = false;
+		m_state.valid |= STATE_MUX | STATE_LINKS;
+		if (m_pWifi != NULL)
+			m_pWifi->cbReset(RESPONSE_OK);
+		m_rxBuffer.cut(s_tokens[TOKEN_READY].size);
+		endCMD();
+	}
+	return false;
+}
+
+bool Esp32::processBusy(void)
+{
+	strip();
+	if (m_rxToken == TOKEN_BUSY)
+	{
+		if (m_retryCMD != CMD_NONE) // left over from the attempt being retried, the slot stays taken
+		{
+			m_rxBuffer.cut(s_tokens[TOKEN_BUSY].size);
+			return false;
+		}
+		// the module still holds earlier data, send less at a time on this link
+		if (m_lastCMD == CMD_SENDBYTES || m_lastCMD == CMD_SENDSTRING || m_lastCMD == CMD_DOSEND)
+			shrinkWindow(m_sendLinkID);
+		if (m_lastCMD == CMD_DOSEND) // the payload is still being taken, "SEND OK" follows
+		{
+			m_rxBuffer.cut(s_tokens[TOKEN_BUSY].size);
+			return false;
+		}
+		if (m_lastCMD != CMD_NONE && retryCMD())
+		{
+			m_rxBuffer.cut(s_tokens[TOKEN_BUSY].size);
+			return false;
+		}
+		if (m_pWifi != NULL)
+		{
+			responseStatus(RESPONSE_BUSY);
+			WIFI_DEBUG_printf("\r\busy %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
+		}
+		m_rxBuffer.cut(s_tokens[TOKEN_BUSY].size);
+		endCMD();
+	}
+	return false;
+}
+
+bool Esp32::processError(void)
+{
+	strip();
+	if (m_rxToken == TOKEN_ERROR)
+	{
+		if (m_retryCMD != CMD_NONE) // not an answer to the retry, which is not sent yet
+		{
+			m_rxBuffer.cut(s_tokens[TOKEN_ERROR].size);
+			return false;
+		}
+		if (m_pWifi != NULL)
+		{
+			responseStatus(RESPONSE_UNKNOWN_ERROR);
+			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), m_pClock->micros(), m_lastSendTime);
+		}
+		m_rxBuffer.cut(s_tokens[TOKEN_ERROR].size);
+		endCMD();
+	}
+	return false;
+}
+
+bool Esp32::processOK(void)
+{
+	strip();
+	if (m_rxToken == TOKEN_OK)
+	{
+		updateState();
+		if (m_pWifi != NULL)
+		{
+			// reset, geting ip, geting AP/STA ip, domain resolution, sending data and connecting AP are judged to be OK in a specific way
+			switch (m_lastCMD)
+			{
+			case Esp32::CMD_SETMODE:
+				m_pWifi->cbSetMode(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_SETSOFTAP:
+				m_pWifi->cbSetMode(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_SETMUX:
+				m_pWifi->cbSetMUX(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_SCANAP:
+				m_pWifi->cbScanAP(RESPONSE_OK, m_apFound);
+				endCMD();
+				break;
+			case Esp32::CMD_AUTOCONN:
+				m_pWifi->cbAutoConnAP(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_CONNECTAP:
+				m_pWifi->cbConnectAP(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_TCPCONNECT:
+			case Esp32::CMD_UDPCONNECT:
+			case Esp32::CMD_SSLCONNECT:
+				connectDone(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_SSLCONFIG:
+				m_pWifi->cbSSLConfig(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_GETMODE:
+				m_pWifi->cbGetMode(RESPONSE_OK, m_rxQuery);
+				endCMD();
+				break;
+			case Esp32::CMD_GETMUX:
+				m_pWifi->cbGetMUX(RESPONSE_OK, m_isMUX);
+				endCMD();
+				break;
+			case Esp32::CMD_GETAP:
+				m_pWifi->cbGetAP(RESPONSE_OK, m_rxSSID);
+				endCMD();
+				break;
+			case Esp32::CMD_CLOSECONNECT:
+				m_links[m_connLinkID].connected = false;
+				m_links[m_connLinkID].accepted = false;
+				endCMD();
+				break;
+			case Esp32::CMD_TCPSERVER:
+			case Esp32::CMD_TCPSERVER_STOP:
+			case Esp32::CMD_SERVERCONFIG:
+				m_pWifi->cbServer(RESPONSE_OK);
+				endCMD();
+				break;
+			case Esp32::CMD_GETNETSTATUS:
+				reportLinks(m_pWifi);
+				endCMD();
+				break;
+			case Esp32::CMD_RECOVERY:
+			case Esp32::CMD_CONFIGSCANAP:
+				// no callback, but must not hold the command slot until the timeout
+				endCMD();
+				break;
+			default:
+				break;
+			}
+		}
+		m_rxBuffer.cut(s_tokens[TOKEN_OK].size);
+	}
+	return false;
+}
+
+// true if the snapshot holds every field of mask, the query is then answered from it
+bool Esp32::cachedState(uint8_t mask)
+{
+	if ((m_state.valid & mask) != mask)
+		return false;
+	m_state.hits++;
+	return true;
+}
+
+// the command in flight was answered OK, before its callback
+void Esp32::updateState(void)
+{
+	switch (m_lastCMD)
+	{
+	case Esp32::CMD_SETMODE:
+		m_state.mode = m_modeSet;
+		m_state.valid |= STATE_MODE;
+		// the interfaces came or went with their addresses
+		m_state.valid &= ~(STATE_AP_IP | STATE_AP_MASK | STATE_STA_IP | STATE_STA_MASK | STATE_AP);
+		break;
+	case Esp32::CMD_SETMUX:
+	case Esp32::CMD_GETMUX:
+		m_state.mux = m_isMUX;
+		m_state.valid |= STATE_MUX;
+		break;
+	case Esp32::CMD_GETMODE:
+		if (m_rxQuery >= MODE_STATION && m_rxQuery <= MODE_APSTATION)
+		{
+			m_state.mode = (WifiMode)m_rxQuery;
+			m_state.valid |= STATE_MODE;
+		}
+		break;
+	case Esp32::CMD_GETAP:
+		strcpy(m_state.ssid, m_rxSSID);
+		m_state.valid |= STATE_AP;
+		break;
+	case Esp32::CMD_GETIP:
+		m_state.ap_ip = m_rxGetAPIP;
+		m_state.sta_ip = m_rxGetSTAIP;
+		m_state.valid |= STATE_AP_IP | STATE_STA_IP;
+		break;
+	case Esp32::CMD_GETAPIP:
+		m_state.ap_ip = m_rxGetAPIP;
+		m_state.ap_mask = m_rxGetAPMask;
+		m_state.valid |= STATE_AP_IP | STATE_AP_MASK;
+		break;
+	case Esp32::CMD_GETSTAIP:
+		m_state.sta_ip = m_rxGetSTAIP;
+		m_state.sta_mask = m_rxGetSTAMask;
+		m_state.valid |= STATE_STA_IP | STATE_STA_MASK;
+		break;
+	case Esp32::CMD_GETNETSTATUS:
+		for (int i = 0; i < LINK_MAX; i++)
+		{
+			if ((m_rxLinks & (1 << i)) == 0)
+				linkClosed(i); // its "CLOSED" was not seen
+		}
+		m_state.valid |= STATE_LINKS;
+		break;
+	default:
+		break;
+	}
+}
+
+void Esp32::reportLinks(IWifi* pWifi)
+{
+	for (int i = 0; i < LINK_MAX; i++)
+	{
+		if (m_links[i].connected)
+			pWifi->cbGetNetStatus(RESPONSE_OK, i);
+	}
+	pWifi->cbGetNetStatus(RESPONSE_OK, -1);
+}
+
+void Esp32::initCMDStats(void)
+{
+	memset(m_cmdStats, 0, sizeof(m_cmdStats));
+	for (int i = 0; i < CMD_MAX; i++)
+	{
+		CMDStats& st = m_cmdStats[i];
+		switch (i)
+		{
+		case Esp32::CMD_RESET: // reset will take more time
+			st.timeout_min = LONG_MIN_TIMEOUT;
+			st.timeout_max = RESET_TIMEOUT;
+			break;
+		case Esp32::CMD_SCANAP: // scaning ap will take more time
+			st.timeout_min = LONG_MIN_TIMEOUT;
+			st.timeout_max = SCANAP_TIMEOUT;
+			break;
+		case Esp32::CMD_CONNECTAP: // connecting ap will take more time
+			st.timeout_min = LONG_MIN_TIMEOUT;
+			st.timeout_max = CONNECTAP_TIMEOUT;
+			break;
+		case Esp32::CMD_TCPCONNECT: // depend on the remote end
+		case Esp32::CMD_UDPCONNECT:
+		case Esp32::CMD_DOMAIN:
+			st.timeout_min = MIN_TIMEOUT;
+			st.timeout_max = CONNECT_TIMEOUT;
+			break;
+		case Esp32::CMD_SSLCONNECT: // the handshake is computed on the module
+			st.timeout_min = LONG_MIN_TIMEOUT;
+			st.timeout_max = SSL_CONNECT_TIMEOUT;
+			break;
+		default:
+			st.timeout_min = MIN_TIMEOUT;
+			st.timeout_max = NORMAL_TIMEOUT;
+			break;
+		}
+	}
+}
+
+uint32_t Esp32::cmdTimeout(CMDType cmd)
+{
+	// RFC 6298 style: srtt + 4 * rttvar, doubled after each timeout until a new
+	// sample arrives, and the ceiling until the first sample
+	CMDStats& st = m_cmdStats[cmd];
+	uint32_t timeout = st.timeout_max;
+	if (st.samples > 0)
+	{
+		uint32_t var = st.rttvar << 2;
+		if (var < Esp32TimerWheel::TICK_US)
+			var = Esp32TimerWheel::TICK_US;
+		timeout = ((st.srtt + var + 999) / 1000) << st.backoff;
+		if (timeout < st.timeout_min)
+			timeout = st.timeout_min;
+		if (timeout > st.timeout_max)
+			timeout = st.timeout_max;
+	}
+	if (cmd == CMD_DOSEND) // the payload has to cross the UART first
+		timeout += (m_sendSize * m_byteTime + 999) / 1000;
+	return timeout;
+}
+
+void Esp32::sampleRTT(CMDType cmd)
+{
+	CMDStats& st = m_cmdStats[cmd];
+	st.count++;
+	st.backoff = 0;
+	if (m_retries > 0) // ambiguous which attempt was answered
+		return;
+	uint32_t rtt = Esp32Clock::elapsed(m_pClock->micros(), m_lastSendTime);
+	if (cmd == CMD_DOSEND)
+	{
+		uint32_t wire = m_sendSize * m_byteTime;
+		rtt = rtt > wire ? rtt - wire : 0;
+	}
+	if (st.samples == 0)
+	{
+		st.srtt = rtt;
+		st.rttvar = rtt >> 1;
+	}
+	else
+	{
+		uint32_t err = rtt > st.srtt ? rtt - st.srtt : st.srtt - rtt;
+		st.rttvar = st.rttvar - (st.rttvar >> 2) + (err >> 2);
+		st.srtt = st.srtt - (st.srtt >> 3) + (rtt >> 3);
+	}
+	st.samples++;
+}
+
+void Esp32::setTimeoutBounds(CMDType cmd, uint32_t min_ms, uint32_t max_ms)
+{
+	if (cmd >= CMD_MAX || min_ms > max_ms)
+		return;
+	m_cmdStats[cmd].timeout_min = min_ms;
+	m_cmdStats[cmd].timeout_max = max_ms;
+}
+
+void Esp32::setLineRate(uint32_t baud)
+{
+	if (baud > 0)
+		m_byteTime = 10000000 / baud; // start + 8 data + stop bits
+}
+
+const Esp32::CMDStats& Esp32::getCMDStats(CMDType cmd)
+{
+	return m_cmdStats[cmd];
+}
+
+void Esp32::checkTimeout(void)
+{
+	m_timers.advance();
+}
+
+void Esp32::onCmdTimeout(void* arg)
+{
+	Esp32* self = (Esp32*)arg;
+	CMDStats& st = self->m_cmdStats[self->m_lastCMD];
+	st.timeouts++;
+	if (st.backoff < MAX_BACKOFF)
+		st.backoff++;
+	if (self->m_lastCMD == CMD_DOSEND)
+		self->releaseSend(false);
+	if (self->m_pWifi != NULL)
 	{
-		if (m_pWifi != NULL)
-		{
-			m_pWifi->cbDomainResolution(RESPONSE_DOMAIN_FAIL, 0);
-			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
-		}
-		m_rxBuffer.cut(7);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		self->responseStatus(RESPONSE_TIMEOUT);
+		WIFI_DEBUG_printf("\r\ntimeout %s\t%u %u %u\r\n", self->printCMD(self->m_lastCMD), self->m_pClock->micros(), self->m_lastSendTime, self->cmdTimeout(self->m_lastCMD));
 	}
-	return false;
+	self->releaseCMD();
 }
 
-bool Esp32::processSend(void)
+void Esp32::endCMD(void)
 {
-	if (m_lastCMD != CMD_SENDBYTES && m_lastCMD != CMD_SENDSTRING)
-		return false;
-	strip();
-	if (m_rxBuffer[0] == '>')
+	// any answer from the module, error or not, is a valid round trip
+	if (m_lastCMD != CMD_NONE)
 	{
-		doSend();
-		m_rxBuffer.cut(1);
+		sampleRTT(m_lastCMD);
+		trace(Esp32Trace::TRACE_END, m_lastCMD, Esp32Clock::elapsed(m_pClock->micros(), m_lastSendTime) / 1000);
 	}
-	return false;
+	releaseCMD();
 }
 
-bool Esp32::processSendEnd(void)
+void Esp32::releaseCMD(void)
 {
-	if (m_lastCMD != CMD_DOSEND)
+	m_lastCMD = CMD_NONE;
+	m_retryCMD = CMD_NONE;
+	m_busy = false;
+	m_sendRest = 0;
+	m_writablePending = true;
+	m_timers.cancel(m_cmdTimer);
+	m_timers.cancel(m_retryTimer);
+}
+
+bool Esp32::acquireSend(IWifi* pWifi, uint8_t link_id)
+{
+	if (link_id >= LINK_MAX)
 		return false;
-	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"SEND OK\r\n", 9))
+	if (m_busy)
 	{
-		if (m_pWifi != NULL)
-			m_pWifi->cbSend(RESPONSE_OK);
-		m_rxBuffer.cut(9);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		m_links[link_id].tx_waiter = pWifi; // told through cbWritable once the slot is free
+		return false;
 	}
-	else if (m_rxBuffer.cmp_bytes((byte*)"SEND FAIL\r\n", 11))
+	return true;
+}
+
+void Esp32::releaseSend(bool ok)
+{
+	LinkState& link = m_links[m_sendLinkID];
+	m_sendTaken = 0;
+	if (ok && link.tx_window + m_sendWindowStep <= m_sendWindowMax)
+		link.tx_window += m_sendWindowStep;
+	else if (ok)
+		link.tx_window = m_sendWindowMax;
+}
+
+// AT+CIPSEND for the next bytes of the send at m_sendBuffer. A stream goes in
+// pieces no larger than the window of the link, a datagram always whole
+void Esp32::sendPiece(void)
+{
+	LinkState& link = m_links[m_sendLinkID];
+	m_sendSize = m_sendRest;
+	if (link.type != UDP && m_sendSize > link.tx_window)
+		m_sendSize = link.tx_window;
+	m_sendRest -= m_sendSize;
+	cmdAppend("AT+CIPSEND=");
+	if (m_sendMUX)
 	{
-		if (m_pWifi != NULL)
-		{
-			m_pWifi->cbSend(RESPONSE_SEND_FAILED);
-			WIFI_DEBUG_printf("\r\FAILED %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
-		}
-		m_rxBuffer.cut(11);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		cmdAppendChar('0' + m_sendLinkID);
+		cmdAppendChar(',');
 	}
-	else if (m_rxBuffer.cmp_bytes((byte*)"ERROR\r\n", 7))
+	cmdAppendNum(m_sendSize);
+	if (m_sendIP != 0 && m_sendPort != 0)
 	{
-		if (m_pWifi != NULL)
-		{
-			m_pWifi->cbSend(RESPONSE_SEND_ERROR);
-			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
-		}
-		m_rxBuffer.cut(7);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		cmdAppend(",\"");
+		cmdAppendIP(m_sendIP);
+		cmdAppend("\",");
+		cmdAppendNum(m_sendPort);
 	}
-	return false;
+	cmdSend();
 }
 
-bool Esp32::processScanAP(void)
+// "SEND OK" of a piece, the slot goes on to the next one without being freed
+void Esp32::nextPiece(void)
 {
-	if (m_lastCMD != CMD_SCANAP)
-		return false;
-	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"+CWLAP:", 7))
-	{
-		int len = m_rxBuffer.length();
-		int index = m_rxBuffer.find_word(WORD_CRLF);
-		if (index == -1) // if command not end, wait more data
-			return true;
-		m_apFound = true;
-		m_rxBuffer.cut(index + 2);
-	}
-	return false;
+	size_t rest = m_sendRest;
+	byte* buffer = m_sendBuffer + m_sendSize;
+	endCMD();
+	beginCMD(m_pWifi, CMD_SENDBYTES);
+	m_sendBuffer = buffer;
+	m_sendRest = rest;
+	sendPiece();
 }
 
-bool Esp32::processConnectAP(void)
+void Esp32::shrinkWindow(int link_id)
 {
-	if (m_lastCMD != CMD_CONNECTAP)
-		return false;
-	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"WIFI GOT IP\r\n\r\nOK\r\n", 19))
-	{
-		if (m_pWifi != NULL)
-			m_pWifi->cbConnectAP(RESPONSE_OK);
-		m_rxBuffer.cut(19);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
-	}
-	else if (m_rxBuffer.cmp_bytes((byte*)"ERROR\r\n", 7))
+	LinkState& link = m_links[link_id];
+	link.tx_window >>= 1;
+	if (link.tx_window < m_sendWindowMin)
+		link.tx_window = m_sendWindowMin;
+}
+
+void Esp32::notifyWritable(void)
+{
+	m_writablePending = false;
+	for (int i = 0; i < LINK_MAX && !m_busy; i++)
 	{
-		if (m_pWifi != NULL)
+		LinkState& link = m_links[i];
+		if (link.tx_waiter != NULL)
 		{
-			m_pWifi->cbConnectAP(RESPONSE_CONNECTAP_FAIL);
-			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+			IWifi* pWifi = link.tx_waiter;
+			link.tx_waiter = NULL;
+			pWifi->cbWritable(i, link.tx_window);
 		}
-		m_rxBuffer.cut(7);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
 	}
-	return false;
 }
 
-bool Esp32::processReset(void)
+void Esp32::beginConnect(uint8_t link_id, ConnType type, uint32_t remote_ip, uint16_t remote_port)
 {
-	if (m_lastCMD != CMD_RESET)
-		return false;
-	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"ready\r\n", 7))
+	m_links[link_id].pooled = false; // connectPooled marks it again
+	m_connLinkID = link_id;
+	m_connType = type;
+	m_connIP = remote_ip;
+	m_connPort = remote_port;
+}
+
+void Esp32::connectDone(ResponseType state)
+{
+	ConnStats& st = m_connStats[m_connType];
+	LinkState& link = m_links[m_connLinkID];
+	if (state == RESPONSE_OK)
 	{
-		if (m_pWifi != NULL)
-			m_pWifi->cbReset(RESPONSE_OK);
-		m_rxBuffer.cut(7);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+		uint32_t t = Esp32Clock::elapsed(m_pClock->micros(), m_lastSendTime);
+		st.connects++;
+		st.time_sum += t;
+		if (t > st.time_max)
+			st.time_max = t;
+		link.connected = true;
+		link.type = m_connType;
+		link.remote_ip = m_connIP;
+		link.remote_port = m_connPort;
+	}
+	else
+	{
+		st.failures++;
+		link.in_use = false; // a pooled link goes back to the pool
+	}
+	if (m_pWifi == NULL)
+		return;
+	switch (m_connType)
+	{
+	case TCP:
+		m_pWifi->cbTCPConnect(state);
+		break;
+	case UDP:
+		m_pWifi->cbUDPConnect(state);
+		break;
+	case SSL:
+		m_pWifi->cbSSLConnect(state, m_connLinkID, false);
+		break;
+	default:
+		break;
 	}
-	return false;
 }
 
-bool Esp32::processBusy(void)
+void Esp32::notifyReused(void)
 {
-	if (m_lastCMD == CMD_DOSEND)
-		return false;
-	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"busy p...\r\n", 11))
+	uint8_t mask = m_reusedLinks;
+	m_reusedLinks = 0;
+	for (int i = 0; i < LINK_MAX; i++)
 	{
-		if (m_pWifi != NULL)
+		LinkState& link = m_links[i];
+		if ((mask & (1 << i)) == 0 || link.reuse_waiter == NULL)
+			continue;
+		IWifi* pWifi = link.reuse_waiter;
+		link.reuse_waiter = NULL;
+		switch (link.type)
 		{
-			responseStatus(RESPONSE_BUSY);
-			WIFI_DEBUG_printf("\r\busy %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
+		case TCP:
+			pWifi->cbTCPConnect(RESPONSE_OK);
+			break;
+		case UDP:
+			pWifi->cbUDPConnect(RESPONSE_OK);
+			break;
+		case SSL:
+			pWifi->cbSSLConnect(RESPONSE_OK, i, true);
+			break;
+		default:
+			break;
 		}
-		m_rxBuffer.cut(11);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
 	}
-	return false;
 }
 
-bool Esp32::processError(void)
+bool Esp32::startConnect(IWifi* pWifi, uint8_t link_id, ConnType type, uint32_t remote_ip, uint16_t remote_port)
 {
-	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"ERROR\r\n", 7))
+	switch (type)
 	{
-		if (m_pWifi != NULL)
-		{
-			responseStatus(RESPONSE_UNKNOWN_ERROR);
-			WIFI_DEBUG_printf("\r\ERROR %s\t%u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime);
-		}
-		m_rxBuffer.cut(7);
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
+	case TCP:
+		return TCPConnectMUX(pWifi, link_id, remote_ip, remote_port);
+	case UDP:
+		return UDPConnectMUX(pWifi, link_id, remote_ip, remote_port);
+	case SSL:
+		return SSLConnectMUX(pWifi, link_id, remote_ip, remote_port);
+	default:
+		return false;
 	}
-	return false;
 }
 
-bool Esp32::processOK(void)
+void Esp32::burstNext(void)
 {
-	strip();
-	if (m_rxBuffer.cmp_bytes((byte*)"OK\r\n", 4))
+	while (m_burstIndex < m_burstCount)
 	{
-		if (m_pWifi != NULL)
+		Datagram& d = m_burst[m_burstIndex];
+		if (d.size == 0 || d.size > SEND_MAXSIZE)
 		{
-			// reset, geting ip, geting AP/STA ip, domain resolution, sending data and connecting AP are judged to be OK in a specific way
-			switch (m_lastCMD)
+			d.result = RESPONSE_SEND_ERROR;
+			m_burstIndex++;
+			continue;
+		}
+		if (!beginCMD(m_burstWifi, CMD_SENDBYTES))
+		{
+			// no command line to send with, none of the rest can go
+			for (; m_burstIndex < m_burstCount; m_burstIndex++)
 			{
-			case Esp32::CMD_SETMODE:
-				m_pWifi->cbSetMode(RESPONSE_OK);
-				m_lastCMD = CMD_NONE;
-				m_busy = false;
-				break;
-			case Esp32::CMD_SETSOFTAP:
-				m_pWifi->cbSetMode(RESPONSE_OK);
-				m_lastCMD = CMD_NONE;
-				m_busy = false;
-				break;
-			case Esp32::CMD_SETMUX:
-				m_pWifi->cbSetMUX(RESPONSE_OK);
-				m_lastCMD = CMD_NONE;
-				m_busy = false;
-				break;
-			case Esp32::CMD_SCANAP:
-				m_pWifi->cbScanAP(RESPONSE_OK, m_apFound);
-				m_lastCMD = CMD_NONE;
-				m_busy = false;
-				break;
-			case Esp32::CMD_AUTOCONN:
-				m_pWifi->cbAutoConnAP(RESPONSE_OK);
-				m_lastCMD = CMD_NONE;
-				m_busy = false;
-				break;
-			case Esp32::CMD_CONNECTAP:
-				m_pWifi->cbConnectAP(RESPONSE_OK);
-				m_lastCMD = CMD_NONE;
-				m_busy = false;
-				break;
-			case Esp32::CMD_UDPCONNECT:
-				m_pWifi->cbUDPConnect(RESPONSE_OK);
-				m_lastCMD = CMD_NONE;
-				m_busy = false;
-				break;
-			default:
-				break;
+				m_burst[m_burstIndex].result = RESPONSE_SEND_ERROR;
 			}
+			break;
 		}
-		m_rxBuffer.cut(4);
+		m_sendLinkID = m_burstLinkID;
+		m_sendMUX = true;
+		m_sendBuffer = (byte*)d.payload;
+		m_sendRest = d.size;
+		m_sendIP = d.remote_ip;
+		m_sendPort = d.remote_port;
+		sendPiece();
+		m_burstInFlight = true;
+		return;
 	}
-	return false;
+	Datagram* datagrams = m_burst;
+	m_burst = NULL;
+	m_burstWifi->cbSendBurst(m_burstLinkID, datagrams, m_burstCount, m_burstSent);
 }
 
-void Esp32::checkTimeout(void)
+void Esp32::sendDone(ResponseType state)
 {
-	uint32_t timeout = NORMAL_TIMEOUT;
-	switch (m_lastCMD)
+	if (!m_burstInFlight)
 	{
-	case Esp32::CMD_NONE:
+		m_pWifi->cbSend(state);
+		return;
+	}
+	m_burstInFlight = false;
+	m_burst[m_burstIndex++].result = state;
+	if (state == RESPONSE_OK)
+		m_burstSent++;
+	else if (state == RESPONSE_TIMEOUT) // the module is not answering, leave the rest unsent
+		m_burstIndex = m_burstCount;
+}
+
+void Esp32::poolConnect(void)
+{
+	int link_id = m_poolLinkID;
+	m_poolLinkID = -1;
+	LinkState& link = m_links[link_id];
+	// a link the close left open would take the AT+CIPSTART for its old peer
+	if (!link.connected && startConnect(m_poolWifi, link_id, m_poolType, m_poolIP, m_poolPort))
+	{
+		link.pooled = true;
 		return;
-	case Esp32::CMD_RESET: // reset will take more time
-		timeout = RESET_TIMEOUT;
+	}
+	link.in_use = false; // back to the pool, the connect fails
+	m_connStats[m_poolType].failures++;
+	switch (m_poolType)
+	{
+	case TCP:
+		m_poolWifi->cbTCPConnect(RESPONSE_UNKNOWN_ERROR);
 		break;
-	case Esp32::CMD_SCANAP: // scaning ap will take more time
-		timeout = SCANAP_TIMEOUT;
+	case UDP:
+		m_poolWifi->cbUDPConnect(RESPONSE_UNKNOWN_ERROR);
 		break;
-	case Esp32::CMD_CONNECTAP: // connecting ap will take more time
-		timeout = CONNECTAP_TIMEOUT;
+	case SSL:
+		m_poolWifi->cbSSLConnect(RESPONSE_UNKNOWN_ERROR, link_id, false);
 		break;
 	default:
 		break;
 	}
-	if (g_ul_ms_ticks - m_lastSendTime > timeout)
+}
+
+size_t Esp32::getSendCredit(uint8_t link_id)
+{
+	if (link_id >= LINK_MAX)
+		return 0;
+	return m_links[link_id].tx_window;
+}
+
+void Esp32::setSendWindow(size_t min_size, size_t max_size, size_t step)
+{
+	if (min_size == 0 || min_size > max_size)
+		return;
+	m_sendWindowMin = min_size;
+	m_sendWindowMax = max_size;
+	m_sendWindowStep = step;
+	for (int i = 0; i < LINK_MAX; i++)
 	{
-		if (m_pWifi != NULL)
+		m_links[i].tx_window = max_size;
+	}
+}
+
+bool Esp32::retryCMD(void)
+{
+	RetryPolicy& policy = m_retryPolicy[m_lastCMD];
+	if (m_retries >= policy.max_retries)
+		return false;
+	uint32_t delay = policy.backoff_max;
+	if (m_retries < 16 && ((uint32_t)policy.backoff_min << m_retries) < delay)
+		delay = (uint32_t)policy.backoff_min << m_retries;
+	m_retries++;
+	m_cmdStats[m_lastCMD].retries++;
+	WIFI_DEBUG_printf("\r\nretry %s\t%u %u\r\n", printCMD(m_lastCMD), m_retries, delay);
+	// keep the slot busy but stop matching answers until the command is sent again
+	m_retryCMD = m_lastCMD;
+	m_lastCMD = CMD_NONE;
+	m_timers.cancel(m_cmdTimer);
+	m_timers.arm(m_retryTimer, delay);
+	return true;
+}
+
+void Esp32::onRetry(void* arg)
+{
+	Esp32* self = (Esp32*)arg;
+	self->m_lastCMD = self->m_retryCMD;
+	self->m_retryCMD = CMD_NONE;
+	self->m_lastSendTime = self->m_pClock->micros();
+	self->m_timers.arm(self->m_cmdTimer, self->cmdTimeout(self->m_lastCMD));
+	self->trace(Esp32Trace::TRACE_RETRY, self->m_lastCMD, self->m_retries);
+	if (self->m_lastCMD == CMD_SENDBYTES)
+	{
+		// the piece is cut again, to the window the "busy p..." left
+		self->m_sendRest += self->m_sendSize;
+		self->m_cmdLen = 0;
+		self->sendPiece();
+		return;
+	}
+	self->m_pSerial->write((const uint8_t*)self->m_cmdLine, self->m_cmdLen);
+}
+
+void Esp32::setRetryPolicy(CMDType cmd, uint8_t max_retries, uint16_t backoff_min, uint16_t backoff_max)
+{
+	if (cmd > CMD_MAX || backoff_min > backoff_max)
+		return;
+	for (int i = 0; i < CMD_MAX; i++)
+	{
+		if (cmd == CMD_MAX || cmd == i)
 		{
-			responseStatus(RESPONSE_TIMEOUT);
-			WIFI_DEBUG_printf("\r\ntimeout %s\t%u %u %u\r\n", printCMD(m_lastCMD), g_ul_ms_ticks, m_lastSendTime, timeout);
+			m_retryPolicy[i].max_retries = max_retries;
+			m_retryPolicy[i].backoff_min = backoff_min;
+			m_retryPolicy[i].backoff_max = backoff_max;
 		}
-		m_lastCMD = CMD_NONE;
-		m_busy = false;
 	}
 }
 
@@ -1579,10 +3099,39 @@ void Esp32::strip(void)
 			break;
 	}
 	m_rxBuffer.cut(i);
+	m_rxToken = matchToken(0);
+}
+
+// the line token at offset in the receive buffer, TOKEN_NONE if there is none
+// or not enough bytes yet to tell
+uint8_t Esp32::matchToken(int offset)
+{
+	int len = m_rxBuffer.length() - offset;
+	if (len < TOKEN_MIN_SIZE)
+		return TOKEN_NONE;
+	uint8_t c0 = m_rxBuffer[offset];
+	uint8_t c1 = m_rxBuffer[offset + 1];
+	uint32_t key;
+	if (!token_wide(c0, c1))
+		key = token_key(c0, c1, 0, 0);
+	else if (len >= TOKEN_WIDE_SIZE)
+		key = token_key(c0, c1, m_rxBuffer[offset + 3], m_rxBuffer[offset + 5]);
+	else
+		return TOKEN_NONE;
+	uint8_t t = s_tokenSlots[token_hash(key)];
+	if (t == TOKEN_NONE || !cmpToken(t, offset))
+		return TOKEN_NONE;
+	return t;
+}
+
+bool Esp32::cmpToken(uint8_t token, int offset)
+{
+	return m_rxBuffer.cmp_bytes((byte*)s_tokens[token].text, s_tokens[token].size, offset);
 }
 
 void Esp32::responseStatus(ResponseType state)
 {
+	trace(Esp32Trace::TRACE_RESPONSE, m_lastCMD, state);
 	switch (m_lastCMD)
 	{
 	case Esp32::CMD_NONE:
@@ -1619,32 +3168,48 @@ void Esp32::responseStatus(ResponseType state)
 		m_pWifi->cbGetSTAIP(state, 0, 0);
 		break;
 	case Esp32::CMD_GETNETSTATUS:
+		m_pWifi->cbGetNetStatus(state, -1);
 		break;
 	case Esp32::CMD_SETMUX:
 		m_pWifi->cbSetMUX(state);
 		break;
 	case Esp32::CMD_TCPSERVER:
-		break;
 	case Esp32::CMD_TCPSERVER_STOP:
+	case Esp32::CMD_SERVERCONFIG:
+		m_pWifi->cbServer(state);
 		break;
 	case Esp32::CMD_TCPCONNECT:
-		break;
 	case Esp32::CMD_UDPCONNECT:
-		m_pWifi->cbUDPConnect(state);
+	case Esp32::CMD_SSLCONNECT:
+		connectDone(state);
+		break;
+	case Esp32::CMD_SSLCONFIG:
+		m_pWifi->cbSSLConfig(state);
 		break;
 	case Esp32::CMD_SENDBYTES:
-		m_pWifi->cbSend(state);
+		sendDone(state);
 		break;
 	case Esp32::CMD_SENDSTRING:
-		m_pWifi->cbSend(state);
+		sendDone(state);
 		break;
 	case Esp32::CMD_DOSEND:
+		if (m_burstInFlight) // a single send is not told about a lost payload
+			sendDone(state);
 		break;
 	case Esp32::CMD_CLOSECONNECT:
 		break;
 	case Esp32::CMD_DOMAIN:
 		m_pWifi->cbDomainResolution(state, 0);
 		break;
+	case Esp32::CMD_GETMODE:
+		m_pWifi->cbGetMode(state, 0);
+		break;
+	case Esp32::CMD_GETMUX:
+		m_pWifi->cbGetMUX(state, m_isMUX);
+		break;
+	case Esp32::CMD_GETAP:
+		m_pWifi->cbGetAP(state, "");
+		break;
 	default:
 		break;
 	}
@@ -1720,10 +3285,139 @@ const char* Esp32::printCMD(CMDType cmd)
 	case Esp32::CMD_DOMAIN:
 		return("CMD_DOMAIN");
 		break;
+	case Esp32::CMD_SSLCONNECT:
+		return("CMD_SSLCONNECT");
+		break;
+	case Esp32::CMD_SSLCONFIG:
+		return("CMD_SSLCONFIG");
+		break;
+	case Esp32::CMD_SERVERCONFIG:
+		return("CMD_SERVERCONFIG");
+		break;
+	case Esp32::CMD_GETMODE:
+		return("CMD_GETMODE");
+		break;
+	case Esp32::CMD_GETMUX:
+		return("CMD_GETMUX");
+		break;
+	case Esp32::CMD_GETAP:
+		return("CMD_GETAP");
+		break;
 	default:
 		return("CMD_error!!!!!");
 		break;
 	}
 }
 
+Esp32Scheduler::Esp32Scheduler()
+	: m_count(0)
+	, m_next(0)
+#ifdef __linux__
+	, m_epollFd(-1)
+#endif
+{
+}
+
+#ifdef __linux__
+Esp32Scheduler::~Esp32Scheduler()
+{
+	if (m_epollFd != -1)
+		close(m_epollFd);
+}
+#endif
+
+bool Esp32Scheduler::add(Esp32& module)
+{
+	if (m_count >= MAX_MODULES)
+		return false;
+#ifdef __linux__
+	int fd = module.getPort().fd();
+	if (fd != -1)
+	{
+		if (m_epollFd == -1)
+		{
+			m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+			if (m_epollFd == -1)
+				return false;
+		}
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &module;
+		if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev) == -1)
+			return false;
+	}
+#endif
+	m_modules[m_count++] = &module;
+	return true;
+}
+
+size_t Esp32Scheduler::loop(size_t budget)
+{
+	// each module may read at most budget bytes per pass, and the module served
+	// first rotates, so a saturated link cannot starve the others
+	size_t total = 0;
+	for (int i = 0; i < m_count; i++)
+	{
+		total += m_modules[(m_next + i) % m_count]->loop(budget);
+	}
+	if (m_count > 0)
+		m_next = (m_next + 1) % m_count;
+	return total;
+}
+
+uint32_t Esp32Scheduler::nextTimeout(void)
+{
+	uint32_t timeout = Esp32::NO_TIMEOUT;
+	for (int i = 0; i < m_count; i++)
+	{
+		uint32_t t = m_modules[i]->nextTimeout();
+		if (t < timeout)
+			timeout = t;
+	}
+	return timeout;
+}
+
+#ifdef __linux__
+bool Esp32Scheduler::waitEvent(void)
+{
+	if (m_epollFd == -1)
+		return false;
+	uint32_t timeout = nextTimeout();
+	struct epoll_event ev[MAX_MODULES];
+	int n = epoll_wait(m_epollFd, ev, MAX_MODULES, timeout == Esp32::NO_TIMEOUT ? -1 : (int)timeout);
+	for (int i = 0; i < n; i++)
+	{
+		((Esp32*)ev[i].data.ptr)->notifyRxReady();
+	}
+	return n > 0;
+}
+#elif defined(WIN32)
+bool Esp32Scheduler::waitEvent(void)
+{
+	return true;
+}
+#else
+bool Esp32Scheduler::waitEvent(void)
+{
+	while (true)
+	{
+		__disable_irq(); // as in Esp32::waitEvent()
+		bool ready = false;
+		for (int i = 0; i < m_count; i++)
+		{
+			ready |= m_modules[i]->isRxReady();
+		}
+		bool expired = nextTimeout() == 0;
+		if (!ready && !expired)
+			__WFI();
+		__enable_irq();
+		if (ready || expired)
+			return ready;
+	}
+}
+#endif
+
+#ifndef WIFI_NO_DEFAULT_INSTANCE
 Esp32 esp32;
+#endif
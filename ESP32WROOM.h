@@ -10,12 +10,24 @@
 #include <string.h>
 #include <stdio.h>
 #include "conf_wifi.h"
+#elif defined(__linux__)
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "conf_wifi.h"
+typedef uint8_t byte;
 #else
 #include "Arduino.h"    
 #include "Print.h"
 #include <string.h>
 #include "conf_wifi.h"
 #endif
+#include "ESP32Serial.h"
+#include "ESP32Clock.h"
+#include "ESP32Timer.h"
+#include "ESP32Trace.h"
+#include "ESP32Arena.h"
 
 #ifdef WIFI_DEBUG
 #define WIFI_DEBUG_printf(...) printf(__VA_ARGS__)
@@ -23,30 +35,42 @@
 #define WIFI_DEBUG_printf(...) 
 #endif
 
-#define DIGIFI_RTS  57
-#define DIGIFI_CTS  58
-
 class IWifi;
 
 class MyRingBuffer
 {
 public:
-	const static int BUFFER_MAX_SIZE = FRAME_MAX_SIZE + 1;
+	const static int BUFFER_MAX_SIZE = FRAME_MAX_SIZE + 1; // default, see Esp32::MemConfig
 	const static int FINDBYTES_MAX_SIZE = 20;
-	uint8_t _aucBuffer[BUFFER_MAX_SIZE];
+	uint8_t* _aucBuffer;
+	int _iSize; // one more than it holds
 	int _iHead;
 	int _iTail;
 
+	// a search pattern with its KMP table, built once for a constant pattern
+	typedef struct _PATTERN {
+		const byte* bytes;
+		size_t size;
+		uint8_t fail[FINDBYTES_MAX_SIZE]; // length of the longest proper prefix that is also a suffix of bytes[0..i]
+	} Pattern;
+
 public:
-	MyRingBuffer(void);
+	MyRingBuffer(void); // holds nothing until attach()
+	void attach(uint8_t* buffer, size_t size); // holds size - 1 bytes, clears
+	int capacity(void);
+	static bool compile(Pattern& pattern, const byte* p, size_t n); // false if n is 0 or over FINDBYTES_MAX_SIZE
 	void store_byte(uint8_t c);
+	size_t store_bytes(const uint8_t* p, size_t n); // returns the oldest bytes overwritten
 	bool is_full(void);
 	int find_byte(byte c, int begin = 0, int end = -1);
-	int find_bytes(byte* p, size_t n);
+	int find_bytes(byte* p, size_t n); // builds the search table on every call
+	int find_bytes(const Pattern& pattern, int begin = 0, int end = -1);
 	int find_word(uint16_t w, int begin = 0);
+	int find_delim(int begin = 0, int end = -1); // next CR, LF, ':' or ','
 	bool cmp_bytes(byte* p, size_t n = 0, int begin = 0);
 	uint8_t read_byte(int index);
 	size_t read_bytes(uint8_t* buffer, size_t n, int begin = 0);
+	size_t segment(int begin, int end, uint8_t** p); // contiguous bytes from begin, read in place
 	void set_byte(int index, byte v);
 	void set_bytes(int begin, int end, byte v);
 	void cut(int count);
@@ -54,19 +78,45 @@ public:
 	void clear(void);
 
 	uint8_t operator[] (int index);
+
+private:
+	uint8_t _ucSpare;
+
+	inline int wrap(int i) // i below twice the size
+	{
+		return i >= _iSize ? i - _iSize : i;
+	}
 };
 
 class Esp32
 {
     public:
         Esp32();
+#ifdef __linux__
+		~Esp32();
+#endif
 		const static int SSID_MAX_LEN = 32;
 		const static int PWD_MAX_LEN = 63;
 		const static uint32_t NORMAL_TIMEOUT = 1000;
 		const static uint32_t RESET_TIMEOUT = 10000;
 		const static uint32_t SCANAP_TIMEOUT = 10000;
 		const static uint32_t CONNECTAP_TIMEOUT = 30000;
+		const static uint32_t CONNECT_TIMEOUT = 5000;
+		const static uint32_t SSL_CONNECT_TIMEOUT = 15000;
+		const static uint32_t MIN_TIMEOUT = 20;
+		const static uint32_t LONG_MIN_TIMEOUT = 1000;
+		const static uint8_t MAX_BACKOFF = 6;
+		const static uint8_t RETRY_MAX = 3;
+		const static uint16_t RETRY_BACKOFF_MIN = 20;
+		const static uint16_t RETRY_BACKOFF_MAX = 500;
+		const static uint32_t NO_TIMEOUT = 0xffffffff;
 		const static int SEND_MAXSIZE = 2048;
+		const static size_t SEND_WINDOW_MIN = 256;
+		const static size_t SEND_WINDOW_STEP = 256;
+		const static int LINK_MAX = 5;
+		const static int CMD_MAX_LEN = 254; // longest AT command line without CRLF, default
+		const static size_t RX_MIN_SIZE = 64; // any header or response line fits
+		const static size_t CMD_MIN_LEN = 64; // AT+CIPSTART and AT+CIPSEND with an address fit
 		const static uint16_t WORD_CRLF = '\r' + '\n' * 256;
 		
 		enum CMDType {
@@ -92,7 +142,14 @@ class Esp32
 			CMD_SENDSTRING,
 			CMD_DOSEND,
 			CMD_CLOSECONNECT,
-			CMD_DOMAIN
+			CMD_DOMAIN,
+			CMD_SSLCONNECT,
+			CMD_SSLCONFIG,
+			CMD_SERVERCONFIG,
+			CMD_GETMODE,
+			CMD_GETMUX,
+			CMD_GETAP,
+			CMD_MAX
 		};
 		enum ResponseType {
 			RESPONSE_OK = 0,
@@ -120,9 +177,28 @@ class Esp32
 			WPA2_PSK = 3,
 			WPA_WPA2_PSK = 4
 		} ;
+		enum WifiMode {
+			MODE_STATION = 1,
+			MODE_SOFTAP = 2,
+			MODE_APSTATION = 3
+		};
+		// fields of ModemState known to match the module
+		enum StateFlag {
+			STATE_AP_IP = 1,
+			STATE_AP_MASK = 2,
+			STATE_STA_IP = 4,
+			STATE_STA_MASK = 8,
+			STATE_MODE = 16,
+			STATE_MUX = 32,
+			STATE_AP = 64, // the joined SSID
+			STATE_LINKS = 128, // the connected flags of the links
+			STATE_ALL = 0xff
+		};
 		enum ConnType {
 			TCP,
-			UDP
+			UDP,
+			SSL,
+			CONN_TYPE_MAX
 		};
 		typedef struct _CONN_INFO {
 			uint8_t link_id;
@@ -132,11 +208,110 @@ class Esp32
 			uint16_t local_port;
 			bool is_server;
 		} ConnInfo;
+		// receive path accounting, latency is in us from reading a chunk to delivering it in cbReceivedData
+		typedef struct _RX_STATS {
+			uint64_t bytes_received; // raw bytes read from the serial
+			uint64_t bytes_delivered[LINK_MAX]; // network data passed to cbReceivedData
+			uint64_t bytes_lost; // ring overflow and discarded malformed data
+			uint32_t frames; // +IPD frames parsed
+			uint32_t deliveries;
+			uint64_t latency_sum;
+			uint32_t latency_max;
+		} RxStats;
+		// round trip estimate per command, the timeout is derived from it and
+		// clamped to [timeout_min, timeout_max] ms. CMD_DOSEND times the payload,
+		// excluding its time on the UART
+		typedef struct _CMD_STATS {
+			uint32_t count; // answered commands
+			uint32_t timeouts;
+			uint32_t retries; // re-issued after "busy p..."
+			uint32_t samples;
+			uint32_t srtt; // us
+			uint32_t rttvar; // us
+			uint32_t timeout_min;
+			uint32_t timeout_max;
+			uint8_t backoff; // timeouts since the last answer
+		} CMDStats;
+		// connect latency per ConnType, from AT+CIPSTART to its "OK"
+		typedef struct _CONN_STATS {
+			uint32_t connects; // completed handshakes
+			uint32_t reused; // answered by a link still open to the same endpoint
+			uint32_t failures;
+			uint64_t time_sum; // us
+			uint32_t time_max; // us
+		} ConnStats;
+		// link pool, a hit is a connect answered by an idle pooled link still open to the endpoint
+		typedef struct _POOL_STATS {
+			uint32_t hits;
+			uint32_t misses; // connects that went to the module
+			uint32_t evictions; // idle links closed to make room
+			uint32_t exhausted; // no free or idle link left
+		} PoolStats;
+		// sizes of the buffers the driver takes from its arena
+		typedef struct _MEM_CONFIG {
+			size_t rx_size; // receive ring, a +IPD frame longer than this is delivered in pieces
+			size_t cmd_size; // longest AT command line without CRLF
+			uint32_t trace_events; // a power of two, WIFI_TRACE only
+		} MemConfig;
+		// what the last answers of the module said, kept until a URC, a reset or a
+		// command that changes it. The addresses and masks are as passed to the callbacks
+		typedef struct _MODEM_STATE {
+			uint8_t valid; // StateFlag of the fields that can be used
+			uint32_t ap_ip;
+			uint32_t ap_mask;
+			uint32_t sta_ip;
+			uint32_t sta_mask;
+			WifiMode mode;
+			bool mux;
+			char ssid[SSID_MAX_LEN + 1]; // empty if none is joined
+			uint32_t hits; // queries answered without a round trip
+		} ModemState;
+		// one entry of a burst, remote_ip 0 sends to the peer of the link
+		typedef struct _DATAGRAM {
+			uint32_t remote_ip;
+			uint16_t remote_port;
+			const byte* payload;
+			size_t size;
+			ResponseType result; // set by the driver, RESPONSE_TIMEOUT if not sent
+		} Datagram;
         
-		void loop(void);
+		size_t loop(size_t budget = 0); // reads at most budget bytes if not 0, returns bytes read
 		void init(void);
+		// every buffer of the driver is carved out of arena as laid out by config, NULL
+		// for the current one. The arena must stay valid while the driver runs, call it
+		// before the first command. False if the arena is too small, the buffers in use
+		// are kept then. Without WIFI_NO_DEFAULT_ARENA each instance holds an arena for
+		// the defaults of conf_wifi.h, which this replaces
+		bool init(void* arena, size_t size, const MemConfig* config = NULL);
+		const MemConfig& getMemConfig(void); // the defaults until init() with an arena
+		static size_t arenaSize(const MemConfig& config); // what init() takes for config
+		const Esp32Arena::ArenaStats& getMemStats(void);
+		// event-driven mode: loop() only reads the serial port once rx data is flagged,
+		// by notifyRxReady() or by isRxReady()/waitEvent() finding bytes in the serial.
+		// On the Due the core owns the USART interrupt, which fills the USARTClass ring
+		// and wakes waitEvent(), nothing has to be connected. A serial of your own may
+		// call notifyRxReady() from its interrupt instead
+		void setEventDriven(bool en);
+		void notifyRxReady(void); // safe to call from the UART RX interrupt
+		bool isRxReady(void); // also true if the serial holds bytes
+		uint32_t nextTimeout(void); // ms until the next timer expires, NO_TIMEOUT if none
+		bool waitEvent(void); // sleep until rx data or the next deadline, true if rx data is ready
+#ifdef __linux__
+		bool setEventFd(int fd); // file descriptor watched by waitEvent()
+#endif
+#ifndef __linux__
         void setSerial(USARTClass& hSerial, int aBaud = 115200, bool en = false);
-		USARTClass& getSerial();
+        // the USART given to setSerial(), which init() does with WIFI_SERIAL. Only valid
+        // after that call, not with a serial set by setSerial(Esp32Serial&) alone
+        USARTClass& getSerial();
+#endif
+		void setSerial(Esp32Serial& serial); // the serial must already be opened
+		Esp32Serial& getPort(void); // the serial in use
+		void setClock(Esp32Clock& clock); // systemClock by default
+		Esp32Clock& getClock(void);
+		// shared deadline wheel, also drives the command timeout; expired
+		// timers run from loop()
+		Esp32TimerWheel& getTimers(void);
 
 		bool reset(IWifi* pWifi);
 		bool recovery(IWifi* pWifi);
@@ -144,9 +319,12 @@ class Esp32
 		bool startSoftAP(IWifi* pWifi);
 		bool startStation(IWifi* pWifi);
 		bool startAPStation(IWifi* pWifi);
+		bool setMode(IWifi* pWifi, WifiMode mode, bool save = true); // AT+CWMODE_CUR if not saved to flash
+		bool getMode(IWifi* pWifi); // AT+CWMODE?
 		bool setSoftAP(IWifi* pWifi, const char ssid[], const char pwd[], int ch, EncryptType ecn, int max_conn = 0, bool hidden = false);
 
-		bool connectAP(IWifi* pWifi, const char ssid[], const char pwd[], const char *bssid = NULL);
+		bool connectAP(IWifi* pWifi, const char ssid[], const char pwd[], const char *bssid = NULL, bool save = true); // AT+CWJAP_CUR if not saved
+		bool getAP(IWifi* pWifi); // AT+CWJAP?, cbGetAP has an empty SSID if none is joined
 		bool configSanAP(IWifi* pWifi, bool sort, uint8_t mask);
 		bool scanAP(IWifi* pWifi, const char ssid[]);
 		bool autoConnAP(IWifi* pWifi, bool isAuto); // switch on auto-connect-AP may cause scan-AP to fail
@@ -154,10 +332,19 @@ class Esp32
 		bool getAPIP(IWifi* pWifi);
 		bool getSTAIP(IWifi* pWifi);
 
-		bool getNetStatus(IWifi* pWifi);
+		bool getNetStatus(IWifi* pWifi); // AT+CIPSTATUS, cbGetNetStatus for each open link then with -1
+		// getMode, getAP, getIP, getAPIP, getSTAIP, getNetStatus and getMUX are answered from
+		// here when it holds what they ask for, the callback then runs before the call
+		// returns and the command slot is not taken
+		const ModemState& getState(void);
+		void invalidateState(uint8_t mask = STATE_ALL); // the next query of these fields goes to the module
 		bool setMUX(IWifi* pWifi, bool isMUX);
+		bool getMUX(IWifi* pWifi); // AT+CIPMUX?, the driver takes the answer as its mode
 		bool startTCPServer(IWifi* pWifi, uint16_t port);
 		bool stopTCPServer(IWifi* pWifi, uint16_t port);
+		// clients accepted by the server are reported to the caller of startTCPServer in cbLinkAccepted
+		bool setServerMaxConn(IWifi* pWifi, uint8_t max_conn); // AT+CIPSERVERMAXCONN, before starting the server
+		bool setServerTimeout(IWifi* pWifi, uint16_t timeout); // AT+CIPSTO, seconds, 0 never closes idle clients
 		// for multi-connect mode
 		bool TCPConnectMUX(IWifi* pWifi, uint8_t link_id, uint32_t remote_ip, uint16_t remote_port);
 		// for single-connect mode
@@ -170,13 +357,143 @@ class Esp32
 		bool sendBytes(IWifi* pWifi, byte* buffer, size_t size, uint32_t remote_ip = 0, uint16_t remote_port = 0);
 		bool sendStringMUX(IWifi* pWifi, uint8_t link_id, const char s[], uint32_t remote_ip = 0, uint16_t remote_port = 0);
 		bool sendString(IWifi* pWifi, const char s[], uint32_t remote_ip = 0, uint16_t remote_port = 0);
+		// sends count datagrams on a UDP link, per-datagram peers need mode 2. The driver
+		// issues the AT+CIPSEND of each entry as soon as the previous one is answered
+		// and reports them all in cbSendBurst, the array must stay valid until then. A
+		// timeout ends the burst, the entries after it are not sent
+		bool sendBurstMUX(IWifi* pWifi, uint8_t link_id, Datagram* datagrams, size_t count);
+		// TLS links, the handshake runs in the module. The firmware has no session
+		// resumption: connecting a link that is still open to the same endpoint sends
+		// nothing and cbSSLConnect reports already_open, any other connect runs the full
+		// handshake. keep_alive is in seconds, 0 for the firmware default
+		bool SSLConnectMUX(IWifi* pWifi, uint8_t link_id, uint32_t remote_ip, uint16_t remote_port, uint16_t keep_alive = 0);
+		bool SSLConnect(IWifi* pWifi, uint32_t remote_ip, uint16_t remote_port, uint16_t keep_alive = 0);
+		bool setSSLBufferSize(IWifi* pWifi, size_t size); // AT+CIPSSLSIZE, 2048 to 4096, ESP8266 firmware only
+		// AT+CIPSSLCCONF, auth_mode 0 none, 1 client cert, 2 server cert, 3 both
+		bool setSSLConfig(IWifi* pWifi, uint8_t link_id, uint8_t auth_mode, uint8_t pki_number = 0, uint8_t ca_number = 0);
+		bool setSSLServerName(IWifi* pWifi, uint8_t link_id, const char name[]); // AT+CIPSSLCSNI
+		bool isConnected(uint8_t link_id);
+		bool isBusy(void); // a command holds the slot
+		const ConnStats& getConnStats(ConnType type);
+		// link ids handed out by the driver in multi-connect mode. An idle pooled link open
+		// to the same endpoint is returned without a round trip, otherwise a free link, or the
+		// least recently used idle one which is closed first. The result comes in the connect
+		// callback of the type, -1 if no link is left or the command cannot go out. A link the
+		// close leaves open fails the connect and stays in the pool
+		int connectPooled(IWifi* pWifi, ConnType type, uint32_t remote_ip, uint16_t remote_port);
+		void releaseLink(uint8_t link_id); // idle again, stays open for the next connectPooled
+		void setPoolLinks(uint8_t mask); // links the pool may take, all by default
+		const PoolStats& getPoolStats(void);
 		bool closeConnect(IWifi* pWifi, uint8_t link_id);
 		bool DomainResolution(IWifi* pWifi, char domain[]);
+
+		// payload for link_id is read into buffer instead of the ring and handed to
+		// cbReceivedDirect when a frame ends or the buffer is full, NULL to go back to the ring
+		bool setLinkBuffer(uint8_t link_id, byte* buffer, size_t size);
+		// data of link_id goes to owner instead of the caller of the last command, NULL to undo
+		bool setLinkOwner(uint8_t link_id, IWifi* owner);
+
+		// a hung module is noticed after a few round trips rather than a fixed second,
+		// slow commands get more time as their answers come in
+		void setTimeoutBounds(CMDType cmd, uint32_t min_ms, uint32_t max_ms);
+		void setLineRate(uint32_t baud); // for the payload time on the UART
+		const CMDStats& getCMDStats(CMDType cmd);
+		// on "busy p..." the command is sent again after backoff_min, doubling up to
+		// backoff_max ms, and only the last attempt is reported. CMD_MAX sets every command
+		void setRetryPolicy(CMDType cmd, uint8_t max_retries, uint16_t backoff_min, uint16_t backoff_max);
+
+		// adaptive piece size per link: a TCP or SSL send larger than the window goes out
+		// in AT+CIPSEND pieces of the window and is reported once. The window halves on
+		// "busy p..." or a short "Recv N bytes" and grows by step on each "SEND OK". A send
+		// while a command is in flight returns false and the caller gets cbWritable, with
+		// the window of the link, once the slot is free
+		void setSendWindow(size_t min_size, size_t max_size, size_t step);
+		size_t getSendCredit(uint8_t link_id); // the window of the link, the largest piece
+
+		const RxStats& getRxStats(void);
+		void resetRxStats(void);
+#ifdef WIFI_TRACE
+		Esp32Trace& getTrace(void);
+#endif
        
     private:
+		const static size_t DEFAULT_ARENA_SIZE = WIFI_ARENA_ALIGN(FRAME_MAX_SIZE + 1) + WIFI_ARENA_ALIGN(CMD_MAX_LEN + 2)
+#ifdef WIFI_TRACE
+			+ WIFI_ARENA_ALIGN(WIFI_TRACE_SIZE * sizeof(Esp32Trace::TraceEvent))
+#endif
+			;
+
+		typedef struct _RETRY_POLICY {
+			uint8_t max_retries;
+			uint16_t backoff_min; // ms
+			uint16_t backoff_max; // ms
+		} RetryPolicy;
+
+		typedef struct _LINK_STATE {
+			byte* rx_buffer; // application buffer for direct receive
+			size_t rx_size;
+			size_t rx_len;
+			size_t tx_window;
+			IWifi* tx_waiter; // refused sender waiting for cbWritable
+			bool connected; // between the "CONNECT" and "CLOSED" of the link
+			ConnType type;
+			uint32_t remote_ip;
+			uint16_t remote_port;
+			IWifi* reuse_waiter; // gets the connect callback of a reused link from loop()
+			bool pooled; // opened by connectPooled
+			bool in_use; // handed out by the pool and not released
+			uint32_t last_used; // pool tick of the last hand out or release
+			bool accepted; // a client of the server
+			IWifi* owner; // receives the data of the link if set
+		} LinkState;
+
 		MyRingBuffer m_rxBuffer;
-        USARTClass* m_pSerial;
-		uint32_t m_lastSendTime;
+        Esp32Serial* m_pSerial;
+#ifndef __linux__
+		UsartSerial m_usart;
+#endif
+		Esp32Clock* m_pClock;
+		Esp32TimerWheel m_timers;
+		Esp32Timer m_cmdTimer;
+		CMDStats m_cmdStats[CMD_MAX];
+		RetryPolicy m_retryPolicy[CMD_MAX];
+		Esp32Timer m_retryTimer;
+		uint8_t m_retries; // of the command in flight
+		CMDType m_retryCMD; // command waiting for its retry, CMD_NONE if none
+		int m_sendLinkID;
+		bool m_sendMUX;
+		size_t m_sendRest; // of a send in pieces, after the piece in flight
+		size_t m_sendTaken; // "Recv N bytes" of the piece in flight
+		uint32_t m_sendIP;
+		uint16_t m_sendPort;
+		size_t m_sendWindowMin;
+		size_t m_sendWindowMax;
+		size_t m_sendWindowStep;
+		bool m_writablePending;
+		int m_connLinkID; // link of the connect or close in flight
+		ConnType m_connType;
+		uint32_t m_connIP;
+		uint16_t m_connPort;
+		ConnStats m_connStats[CONN_TYPE_MAX];
+		uint8_t m_reusedLinks; // mask of links whose reuse is not reported yet
+		uint8_t m_poolLinks;
+		uint32_t m_poolTick;
+		int m_poolLinkID; // evicted link waiting for its connect, -1 if none
+		IWifi* m_poolWifi;
+		ConnType m_poolType;
+		uint32_t m_poolIP;
+		uint16_t m_poolPort;
+		PoolStats m_poolStats;
+		Datagram* m_burst; // burst in progress, NULL if none
+		size_t m_burstCount;
+		size_t m_burstIndex; // entry in flight or next to send
+		size_t m_burstSent;
+		bool m_burstInFlight; // the send in flight belongs to the burst
+		uint8_t m_burstLinkID;
+		IWifi* m_burstWifi;
+		IWifi* m_serverWifi; // gets the clients of the server
+		uint32_t m_byteTime; // us per byte on the UART
+		uint32_t m_lastSendTime; // us
 		bool m_busy;
 		CMDType m_lastCMD;
 		byte* m_sendBuffer;
@@ -184,22 +501,88 @@ class Esp32
 		bool m_isMUX;
 		int m_rxDataLinkID;
 		size_t m_rxDataRestSize;
+		uint8_t m_rxToken; // ResponseToken at the start of the buffer, set by strip()
 		uint32_t m_rxGetAPIP;
 		uint32_t m_rxGetAPMask;
 		uint32_t m_rxGetSTAIP;
 		uint32_t m_rxGetSTAMask;
+		int m_rxQuery; // value of "+CWMODE:" or "+CIPMUX:"
+		char m_rxSSID[SSID_MAX_LEN + 1]; // of "+CWJAP:"
+		uint8_t m_rxLinks; // mask of the links listed by "+CIPSTATUS:"
+		ModemState m_state;
+		WifiMode m_modeSet; // of the CMD_SETMODE in flight
 		bool m_apFound;
 		IWifi* m_pWifi;
+		bool m_eventDriven;
+		volatile bool m_rxReady;
+#ifdef __linux__
+		int m_epollFd;
+		int m_serialFd; // of the serial in use, watched by waitEvent()
+#endif
+		char* m_cmdLine; // m_cmdMax and CRLF, NULL without an arena
+		int m_cmdMax;
+		int m_cmdLen;
+		Esp32Arena m_arena;
+		MemConfig m_memConfig;
+#ifndef WIFI_NO_DEFAULT_ARENA
+		uint64_t m_defaultArena[DEFAULT_ARENA_SIZE / sizeof(uint64_t)];
+#endif
+		RxStats m_rxStats;
+		uint32_t m_rxTime; // us, when the last chunk was read
+		LinkState m_links[LINK_MAX];
+		uint8_t m_directLinks; // mask of links with an application buffer
+#ifdef WIFI_TRACE
+		Esp32Trace m_trace;
+#endif
 
+		bool setArena(void* arena, size_t size, const MemConfig& config);
+		bool beginCMD(IWifi* pWifi, CMDType cmd);
+		void cmdAppend(const char s[]);
+		void cmdAppendChar(char c);
+		void cmdAppendNum(uint32_t n);
+		void cmdAppendIP(uint32_t ip);
+		void cmdSend(void);
 		void doSend(void);
 		void parseReceived(void);
 		void checkTimeout(void);
+		static void onCmdTimeout(void* arg);
+		void endCMD(void);
+		void releaseCMD(void);
+		bool retryCMD(void);
+		bool acquireSend(IWifi* pWifi, uint8_t link_id);
+		void releaseSend(bool ok);
+		void sendPiece(void);
+		void nextPiece(void);
+		void shrinkWindow(int link_id);
+		void notifyWritable(void);
+		void beginConnect(uint8_t link_id, ConnType type, uint32_t remote_ip, uint16_t remote_port);
+		void connectDone(ResponseType state);
+		bool connectPending(int link_id);
+		void notifyReused(void);
+		bool startConnect(IWifi* pWifi, uint8_t link_id, ConnType type, uint32_t remote_ip, uint16_t remote_port);
+		void poolConnect(void);
+		void burstNext(void);
+		void sendDone(ResponseType state);
+		static void onRetry(void* arg);
+		bool cachedState(uint8_t mask);
+		void updateState(void);
+		void reportLinks(IWifi* pWifi);
+		void linkClosed(int link_id);
+		void initCMDStats(void);
+		void sampleRTT(CMDType cmd);
+		uint32_t cmdTimeout(CMDType cmd);
 		bool processNetworkData(void); // NOTE: CRLF before "+IPD", none at the end
-		bool processDisconnectAP(void);
+		void deliverData(int link_id, int begin, int end);
+		size_t readDirect(size_t n);
+		void flushDirect(int link_id);
+		bool processWifiStatus(void);
+		bool processLinkStatus(void);
 		bool processGetIP(void);
 		bool processGetAPIP(void);
 		bool processGetSTAIP(void);
 		bool processDomainResolution(void);
+		bool processQuery(void);
+		bool processNetStatus(void);
 		bool processSend(void); // NOTE: if send too much data, "busy" will response before "SEND OK"
 		bool processSendEnd(void);
 		bool processScanAP(void);
@@ -209,11 +592,44 @@ class Esp32
 		bool processError(void);
 		bool processOK(void);
 		void strip(void);
+		uint8_t matchToken(int offset);
+		bool cmpToken(uint8_t token, int offset);
 		void responseStatus(ResponseType state);
+		inline void trace(uint8_t type, uint8_t arg, uint32_t value)
+		{
+#ifdef WIFI_TRACE
+			m_trace.record(m_pClock->micros(), type, arg, value);
+#endif
+		}
 
 		const char* printCMD(CMDType cmd);
 };
 
+// services several modules, each on its own serial, from one main loop
+class Esp32Scheduler
+{
+public:
+	const static int MAX_MODULES = 4;
+	const static size_t DEFAULT_BUDGET = 256;
+
+	Esp32Scheduler();
+#ifdef __linux__
+	~Esp32Scheduler();
+#endif
+	bool add(Esp32& module); // the module's serial must already be set
+	size_t loop(size_t budget = DEFAULT_BUDGET);
+	uint32_t nextTimeout(void);
+	bool waitEvent(void);
+
+private:
+	Esp32* m_modules[MAX_MODULES];
+	int m_count;
+	int m_next;
+#ifdef __linux__
+	int m_epollFd;
+#endif
+};
+
 class IWifi
 {
 public:
@@ -228,14 +644,28 @@ public:
 	virtual void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) = 0;
 	virtual void cbGetNetStatus(Esp32::ResponseType, int link_id) = 0;
 	virtual void cbSetMUX(Esp32::ResponseType) = 0;
+	virtual void cbGetMode(Esp32::ResponseType, int mode) {}
+	virtual void cbGetMUX(Esp32::ResponseType, bool isMUX) {}
+	virtual void cbGetAP(Esp32::ResponseType, const char ssid[]) {}
 	virtual void cbUDPConnect(Esp32::ResponseType) = 0;
 	virtual void cbDomainResolution(Esp32::ResponseType, uint32_t ip) = 0;
 	virtual void cbDisconnectAP(void) = 0;
 	virtual void cbReceivedData(int link_id, MyRingBuffer&, int begin, int end) = 0;
 	virtual void cbSend(Esp32::ResponseType) = 0;
+	virtual void cbReceivedDirect(int link_id, byte* buffer, size_t size) {}
+	virtual void cbWritable(int link_id, size_t window) {}
+	virtual void cbTCPConnect(Esp32::ResponseType) {}
+	virtual void cbSSLConnect(Esp32::ResponseType, int link_id, bool already_open) {}
+	virtual void cbSSLConfig(Esp32::ResponseType) {}
+	virtual void cbServer(Esp32::ResponseType) {} // AT+CIPSERVER, AT+CIPSERVERMAXCONN and AT+CIPSTO
+	virtual void cbLinkAccepted(int link_id) {} // before any data of the client
+	virtual void cbLinkClosed(int link_id) {} // to the owner of the link or the server
+	virtual void cbSendBurst(int link_id, Esp32::Datagram* datagrams, size_t count, size_t sent) {} // sent answered "SEND OK"
 };
 
+#ifndef WIFI_NO_DEFAULT_INSTANCE
 extern Esp32 esp32;
+#endif
 
 #endif
 
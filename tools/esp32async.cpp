@@ -0,0 +1,355 @@
+// Submission throughput and contention of Esp32Async from several threads, Linux only
+//
+//   g++ -O2 -I.. -I<dir of conf_wifi.h> -o esp32async esp32async.cpp ../ESP32Async.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp -lpthread
+//   ./esp32async [-t max threads] [-n sends]
+//
+// First the bare queue: producers push as fast as they can while one consumer
+// pops, against a ring guarded by a mutex. Then end to end: each thread keeps 4
+// sends in flight through submit() and waits on its own completion queue, the
+// I/O thread sleeps in waitEvent() and runs a module answering at once. Latency
+// is from submit() to the completion, so it includes the queue ahead of it. The
+// thread counts double from 1 up to the maximum
+
+
+#include "ESP32Async.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+const static int IN_FLIGHT = 4; // sends per thread
+const static int THREAD_MAX = 64;
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the module, on the I/O thread only: OK to every command, SEND OK to every payload
+class EchoModule : public Esp32Serial
+{
+public:
+	const static size_t RX_SIZE = 4096;
+
+	EchoModule() : m_rxLen(0), m_rxPos(0), m_cmdLen(0), m_payload(0) {}
+	int available(void) { return m_rxLen - m_rxPos; }
+	int read(void) { return m_rxPos < m_rxLen ? (uint8_t)m_rx[m_rxPos++] : -1; }
+	size_t read(uint8_t* buffer, size_t n)
+	{
+		size_t c = m_rxLen - m_rxPos < n ? m_rxLen - m_rxPos : n;
+		memcpy(buffer, m_rx + m_rxPos, c);
+		m_rxPos += c;
+		if (m_rxPos == m_rxLen)
+			m_rxPos = m_rxLen = 0;
+		return c;
+	}
+	size_t write(const uint8_t* buffer, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			if (m_payload > 0)
+			{
+				if (--m_payload == 0)
+					answer("\r\nRecv %d bytes\r\n\r\nSEND OK\r\n", m_payloadSize);
+				continue;
+			}
+			if (m_cmdLen < sizeof(m_cmd) - 1)
+				m_cmd[m_cmdLen++] = buffer[i];
+			if (m_cmdLen >= 2 && m_cmd[m_cmdLen - 2] == '\r' && m_cmd[m_cmdLen - 1] == '\n')
+			{
+				m_cmd[m_cmdLen] = 0;
+				int link_id;
+				if (sscanf(m_cmd, "AT+CIPSEND=%d,%d", &link_id, &m_payloadSize) == 2)
+				{
+					m_payload = m_payloadSize;
+					answer("\r\nOK\r\n> ");
+				}
+				else
+				{
+					answer("\r\nOK\r\n");
+				}
+				m_cmdLen = 0;
+			}
+		}
+		return n;
+	}
+
+private:
+	char m_rx[RX_SIZE];
+	size_t m_rxLen;
+	size_t m_rxPos;
+	char m_cmd[64];
+	size_t m_cmdLen;
+	int m_payload;
+	int m_payloadSize;
+
+	void answer(const char format[], int n = 0)
+	{
+		m_rxLen += snprintf(m_rx + m_rxLen, RX_SIZE - m_rxLen, format, n);
+	}
+};
+
+// ring of pointers under a mutex, what the queue is compared with
+class LockedRing
+{
+public:
+	LockedRing(size_t size) : m_size(size), m_head(0), m_tail(0)
+	{
+		m_slots = new AsyncRequest*[size];
+		pthread_mutex_init(&m_lock, NULL);
+	}
+	~LockedRing()
+	{
+		pthread_mutex_destroy(&m_lock);
+		delete[] m_slots;
+	}
+	void push(AsyncRequest* r) // never full, sized for every push of a run
+	{
+		pthread_mutex_lock(&m_lock);
+		m_slots[m_head++ % m_size] = r;
+		pthread_mutex_unlock(&m_lock);
+	}
+	AsyncRequest* pop(void)
+	{
+		AsyncRequest* r = NULL;
+		pthread_mutex_lock(&m_lock);
+		if (m_tail != m_head)
+			r = m_slots[m_tail++ % m_size];
+		pthread_mutex_unlock(&m_lock);
+		return r;
+	}
+
+private:
+	AsyncRequest** m_slots;
+	size_t m_size;
+	size_t m_head;
+	size_t m_tail;
+	pthread_mutex_t m_lock;
+};
+
+typedef struct _PRODUCER {
+	Esp32Queue* queue;
+	LockedRing* ring;
+	AsyncRequest* requests;
+	int count;
+	volatile bool* go;
+} Producer;
+
+static void* produce(void* arg)
+{
+	Producer* p = (Producer*)arg;
+	while (!*p->go)
+		;
+	for (int i = 0; i < p->count; i++)
+	{
+		if (p->queue != NULL)
+			p->queue->push(&p->requests[i]);
+		else
+			p->ring->push(&p->requests[i]);
+	}
+	return NULL;
+}
+
+// pushes per second of threads producers, and the pops that found the queue empty or a push half done
+static double pushRate(int threads, int count, bool locked, uint64_t* empty, uint64_t* halfDone)
+{
+	Esp32Queue queue;
+	LockedRing ring(threads * count);
+	AsyncRequest* requests = new AsyncRequest[threads * count];
+	volatile bool go = false;
+	pthread_t tid[THREAD_MAX];
+	Producer p[THREAD_MAX];
+	for (int t = 0; t < threads; t++)
+	{
+		p[t].queue = locked ? NULL : &queue;
+		p[t].ring = &ring;
+		p[t].requests = requests + t * count;
+		p[t].count = count;
+		p[t].go = &go;
+		pthread_create(&tid[t], NULL, produce, &p[t]);
+	}
+	*empty = 0;
+	*halfDone = 0;
+	long popped = 0;
+	double start = seconds();
+	go = true;
+	while (popped < (long)threads * count)
+	{
+		AsyncRequest* r = locked ? ring.pop() : queue.pop();
+		if (r != NULL)
+			popped++;
+		else if (!locked && queue.busy())
+			(*halfDone)++;
+		else
+			(*empty)++;
+	}
+	double t = seconds() - start;
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_join(tid[i], NULL);
+	}
+	delete[] requests;
+	return threads * count / t;
+}
+
+typedef struct _SENDER {
+	Esp32Async* async;
+	int link_id;
+	int count;
+	double latency_sum; // s
+	double latency_max;
+	int failed;
+} Sender;
+
+static void* sender(void* arg)
+{
+	Sender* s = (Sender*)arg;
+	static const byte payload[32] = { 'x' };
+	Esp32Completions completions;
+	AsyncRequest requests[IN_FLIGHT];
+	double submitted[IN_FLIGHT];
+	int sent = 0;
+	for (int i = 0; i < IN_FLIGHT && sent < s->count; i++)
+	{
+		AsyncRequest& r = requests[i];
+		r.op = ASYNC_SEND;
+		r.link_id = s->link_id;
+		r.remote_ip = 0;
+		r.remote_port = 0;
+		r.data = payload;
+		r.size = sizeof(payload);
+		r.completions = &completions;
+		r.context = (void*)(intptr_t)i;
+		submitted[i] = seconds();
+		s->async->submit(&r);
+		sent++;
+	}
+	for (int done = 0; done < s->count; done++)
+	{
+		AsyncRequest* r = completions.wait(-1);
+		if (r == NULL)
+		{
+			done--;
+			continue;
+		}
+		int i = (intptr_t)r->context;
+		double t = seconds() - submitted[i];
+		s->latency_sum += t;
+		if (t > s->latency_max)
+			s->latency_max = t;
+		if (r->result != Esp32::RESPONSE_OK)
+			s->failed++;
+		if (sent < s->count)
+		{
+			submitted[i] = seconds();
+			s->async->submit(r);
+			sent++;
+		}
+	}
+	return NULL;
+}
+
+typedef struct _IO_THREAD {
+	Esp32* esp;
+	Esp32Async* async;
+	EchoModule* module;
+	volatile bool stop;
+} IoThread;
+
+static void* io(void* arg)
+{
+	IoThread* io = (IoThread*)arg;
+	while (!io->stop)
+	{
+		if (io->module->available() == 0)
+			io->esp->waitEvent();
+		io->esp->loop();
+		io->async->loop();
+	}
+	return NULL;
+}
+
+static void endToEnd(int threads, int count)
+{
+	EchoModule module;
+	Esp32 esp;
+	esp.setSerial(module);
+	Esp32Async async(esp);
+	IoThread ctx = { &esp, &async, &module, false };
+	pthread_t io_tid;
+	pthread_create(&io_tid, NULL, io, &ctx);
+	pthread_t tid[THREAD_MAX];
+	Sender s[THREAD_MAX];
+	double start = seconds();
+	for (int t = 0; t < threads; t++)
+	{
+		s[t].async = &async;
+		s[t].link_id = t % Esp32::LINK_MAX;
+		s[t].count = count / threads;
+		s[t].latency_sum = 0;
+		s[t].latency_max = 0;
+		s[t].failed = 0;
+		pthread_create(&tid[t], NULL, sender, &s[t]);
+	}
+	double latency_sum = 0;
+	double latency_max = 0;
+	int failed = 0;
+	int done = 0;
+	for (int t = 0; t < threads; t++)
+	{
+		pthread_join(tid[t], NULL);
+		latency_sum += s[t].latency_sum;
+		if (s[t].latency_max > latency_max)
+			latency_max = s[t].latency_max;
+		failed += s[t].failed;
+		done += s[t].count;
+	}
+	double t = seconds() - start;
+	// a last request wakes the I/O thread to see the stop
+	ctx.stop = true;
+	Esp32Completions completions;
+	AsyncRequest r;
+	r.op = ASYNC_RELEASE;
+	r.link_id = 0;
+	r.completions = &completions;
+	async.submit(&r);
+	pthread_join(io_tid, NULL);
+	const Esp32Async::AsyncStats& st = async.getStats();
+	printf("%2d threads: %d sends in %.3f s, %.0f req/s, latency mean %.1f us max %.3f ms, %d failed, %u deferred\n",
+		threads, done, t, done / t, done > 0 ? latency_sum / done * 1e6 : 0.0, latency_max * 1e3, failed, st.deferred);
+}
+
+int main(int argc, char* argv[])
+{
+	int threads = 8;
+	int count = 20000;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-t") == 0)
+			threads = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-n") == 0)
+			count = atoi(argv[i + 1]);
+	}
+	if (threads < 1 || threads > THREAD_MAX || count < threads || argc % 2 == 0)
+	{
+		fprintf(stderr, "usage: %s [-t max threads, 1 to %d] [-n sends]\n", argv[0], THREAD_MAX);
+		return 2;
+	}
+	printf("queue, %d pushes per producer\n", count * 20);
+	for (int t = 1; t <= threads; t *= 2)
+	{
+		uint64_t empty, halfDone, unused;
+		double mpsc = pushRate(t, count * 20, false, &empty, &halfDone);
+		double locked = pushRate(t, count * 20, true, &unused, &unused);
+		printf("%2d producers: mpsc %.1f Mpush/s (%llu empty pops, %llu on a half done push), mutex %.1f Mpush/s\n",
+			t, mpsc / 1e6, (unsigned long long)empty, (unsigned long long)halfDone, locked / 1e6);
+	}
+	printf("end to end, %d sends in flight per thread\n", IN_FLIGHT);
+	for (int t = 1; t <= threads; t *= 2)
+	{
+		endToEnd(t, count);
+	}
+	return 0;
+}
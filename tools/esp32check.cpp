@@ -0,0 +1,722 @@
+// Scripted checks of the driver against a module that answers what each check tells it, Linux only
+//
+//   g++ -I.. -I<dir of conf_wifi.h> -o esp32check esp32check.cpp ../ESP32Bringup.cpp ../ESP32HTTP.cpp ../ESP32MQTT.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp
+//   ./esp32check [name]
+//
+// Every check runs on its own driver under a virtual clock and prints ok or the
+// line that failed. The exit status is the number of failed checks. Built with
+// -DWIFI_NO_DEFAULT_ARENA the drivers get their memory from the checks, which
+// also run one without any
+
+
+#include "ESP32Bringup.h"
+#include "ESP32HTTP.h"
+#include "ESP32MQTT.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(c) do { if (!(c)) { printf("  line %d: %s\n", __LINE__, #c); return false; } } while (0)
+
+// the module: replies are queued by the check, what the driver writes is kept
+class ScriptSerial : public Esp32Serial
+{
+public:
+	const static size_t RX_SIZE = 8192;
+	const static size_t TX_SIZE = 16384;
+
+	ScriptSerial() : m_rxLen(0), m_rxPos(0), m_txLen(0) {}
+	void reply(const char s[]) { reply(s, strlen(s)); }
+	void reply(const char s[], size_t n)
+	{
+		if (m_rxPos == m_rxLen)
+			m_rxPos = m_rxLen = 0;
+		if (m_rxLen + n <= RX_SIZE)
+		{
+			memcpy(m_rx + m_rxLen, s, n);
+			m_rxLen += n;
+		}
+	}
+	// the command lines written since the last call, payload bytes included
+	bool sent(const char s[]) { return strstr(m_tx, s) != NULL; }
+	int count(const char s[])
+	{
+		int n = 0;
+		for (const char* p = strstr(m_tx, s); p != NULL; p = strstr(p + 1, s))
+			n++;
+		return n;
+	}
+	void clear(void) { m_txLen = 0; m_tx[0] = 0; }
+	int available(void) { return m_rxLen - m_rxPos; }
+	int read(void) { return m_rxPos < m_rxLen ? (uint8_t)m_rx[m_rxPos++] : -1; }
+	size_t read(uint8_t* buffer, size_t n)
+	{
+		size_t c = m_rxLen - m_rxPos < n ? m_rxLen - m_rxPos : n;
+		memcpy(buffer, m_rx + m_rxPos, c);
+		m_rxPos += c;
+		return c;
+	}
+	size_t write(const uint8_t* buffer, size_t n)
+	{
+		if (m_txLen + n < TX_SIZE)
+		{
+			memcpy(m_tx + m_txLen, buffer, n);
+			m_txLen += n;
+			m_tx[m_txLen] = 0;
+		}
+		return n;
+	}
+
+private:
+	char m_rx[RX_SIZE];
+	size_t m_rxLen;
+	size_t m_rxPos;
+	char m_tx[TX_SIZE];
+	size_t m_txLen;
+};
+
+// counts the callbacks of the driver
+class Counter : public IWifi
+{
+public:
+	int sends;
+	Esp32::ResponseType send;
+	int connects;
+	Esp32::ResponseType connect;
+	int writable;
+	int servers;
+	Esp32::ResponseType server;
+	int bursts;
+	size_t burstSent;
+	int muxes;
+	bool mux;
+	int accepted;
+
+	Counter() : sends(0), send(Esp32::RESPONSE_OK), connects(0), connect(Esp32::RESPONSE_OK), writable(0),
+		servers(0), server(Esp32::RESPONSE_OK), bursts(0), burstSent(0), muxes(0), mux(false),
+		accepted(0) {}
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbGetMUX(Esp32::ResponseType, bool isMUX) { muxes++; mux = isMUX; }
+	void cbUDPConnect(Esp32::ResponseType state) { connects++; connect = state; }
+	void cbTCPConnect(Esp32::ResponseType state) { connects++; connect = state; }
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end) {}
+	void cbSend(Esp32::ResponseType state) { sends++; send = state; }
+	void cbWritable(int link_id, size_t window) { writable++; }
+	void cbServer(Esp32::ResponseType state) { servers++; server = state; }
+	void cbSendBurst(int link_id, Esp32::Datagram* datagrams, size_t count, size_t sent) { bursts++; burstSent = sent; }
+	void cbLinkAccepted(int link_id) { accepted++; }
+};
+
+// the last answer to a request
+class Response : public IHttp
+{
+public:
+	int done;
+	int status;
+	Esp32::ResponseType result;
+
+	Response() : done(0), status(0), result(Esp32::RESPONSE_OK) {}
+	void cbHttpResponse(int id, int status, int32_t content_length) { this->status = status; }
+	void cbHttpBody(int id, const byte* data, size_t size) {}
+	void cbHttpDone(int id, Esp32::ResponseType result) { done++; this->result = result; }
+};
+
+// counts the session callbacks
+class Session : public IMqtt
+{
+public:
+	int connected;
+	int code;
+	int disconnected;
+
+	Session() : connected(0), code(0), disconnected(0) {}
+	void cbMqttConnected(Esp32::ResponseType, int return_code) { connected++; code = return_code; }
+	void cbMqttPublished(uint16_t packet_id, Esp32::ResponseType) {}
+	void cbMqttMessage(const char topic[], const byte* data, size_t size, size_t offset, size_t total) {}
+	void cbMqttDisconnected(void) { disconnected++; }
+};
+
+// the end of a bring-up
+class Started : public IBringup
+{
+public:
+	int done;
+	Esp32::ResponseType result;
+
+	Started() : done(0), result(Esp32::RESPONSE_OK) {}
+	void cbBringupDone(Esp32::ResponseType result, uint32_t sta_ip) { done++; this->result = result; }
+};
+
+// a driver in multi-connect mode on a scripted module and a virtual clock
+class Bench
+{
+public:
+	VirtualClock clock;
+	ScriptSerial module;
+	Esp32 esp;
+	Counter app;
+
+	Bench(bool memory = true)
+	{
+#ifdef WIFI_NO_DEFAULT_ARENA
+		if (memory)
+			esp.init(m_arena, sizeof(m_arena));
+#endif
+		esp.setClock(clock);
+		esp.setSerial(module);
+		esp.setMUX(&app, true);
+		answer("\r\nOK\r\n");
+		module.clear();
+	}
+	void answer(const char s[])
+	{
+		module.reply(s);
+		esp.loop();
+	}
+	void answer(const char s[], size_t n)
+	{
+		module.reply(s, n);
+		esp.loop();
+	}
+	void wait(uint32_t ms) // lets the timers of the driver run
+	{
+		for (uint32_t i = 0; i < ms; i++)
+		{
+			clock.advance(1000);
+			esp.loop();
+		}
+	}
+	bool tcp(uint8_t link_id)
+	{
+		if (!esp.TCPConnectMUX(&app, link_id, 0x0a000001, 80))
+			return false;
+		char s[32];
+		snprintf(s, sizeof(s), "%d,CONNECT\r\n\r\nOK\r\n", link_id);
+		answer(s);
+		module.clear();
+		return esp.isConnected(link_id);
+	}
+	bool udp(uint8_t link_id)
+	{
+		if (!esp.UDPConnectMUX(&app, link_id, 0x0a000001, 5000, 5000, 2))
+			return false;
+		char s[32];
+		snprintf(s, sizeof(s), "%d,CONNECT\r\n\r\nOK\r\n", link_id);
+		answer(s);
+		module.clear();
+		return esp.isConnected(link_id);
+	}
+
+#ifdef WIFI_NO_DEFAULT_ARENA
+private:
+	uint64_t m_arena[2048];
+#endif
+};
+
+// two "busy p..." halve the window twice, a full-size stream send still goes, in pieces
+// of the window, and a send refused meanwhile hears cbWritable once the slot is free
+static bool checkWindow(void)
+{
+	Bench b;
+	static byte payload[2048];
+	memset(payload, 'x', sizeof(payload)); // the written text is searched as a string
+	b.esp.setSendWindow(256, 2048, 256);
+	CHECK(b.tcp(0));
+	CHECK(b.esp.sendBytesMUX(&b.app, 0, payload, 1024));
+	CHECK(b.module.sent("AT+CIPSEND=0,1024\r\n"));
+	b.answer(">");
+	b.answer("busy p...\r\nbusy p...\r\nRecv 1024 bytes\r\n\r\nSEND OK\r\n");
+	CHECK(b.app.sends == 1 && b.app.send == Esp32::RESPONSE_OK);
+	CHECK(b.esp.getSendCredit(0) == 512 + 256);
+	b.esp.setSendWindow(256, 512, 0); // pin the window at 512
+	b.module.clear();
+	CHECK(b.esp.sendBytesMUX(&b.app, 0, payload, 2048));
+	CHECK(!b.esp.sendBytesMUX(&b.app, 0, payload, 16));
+	for (int i = 0; i < 4; i++)
+	{
+		CHECK(b.app.sends == 1 && b.app.writable == 0);
+		CHECK(b.module.count("AT+CIPSEND=0,512\r\n") == i + 1);
+		b.answer(">");
+		b.answer("Recv 512 bytes\r\n\r\nSEND OK\r\n");
+	}
+	CHECK(b.app.sends == 2 && b.app.send == Esp32::RESPONSE_OK);
+	CHECK(!b.esp.isBusy());
+	b.esp.loop();
+	CHECK(b.app.writable == 1 && b.esp.getSendCredit(0) == 512);
+	return true;
+}
+
+// "busy p..." and ERROR left over while a retry waits out its backoff neither end
+// the command nor free the slot, the caller hears the answer to the retry only
+static bool checkRetry(void)
+{
+	Bench b;
+	b.esp.setRetryPolicy(Esp32::CMD_MAX, 3, 20, 500);
+	CHECK(b.esp.setServerTimeout(&b.app, 10));
+	b.answer("busy p...\r\n");
+	CHECK(b.esp.isBusy());
+	b.answer("busy p...\r\nERROR\r\n");
+	CHECK(b.esp.isBusy() && b.app.servers == 0);
+	CHECK(b.module.count("AT+CIPSTO=10\r\n") == 1);
+	b.wait(25);
+	CHECK(b.module.count("AT+CIPSTO=10\r\n") == 2);
+	b.answer("\r\nOK\r\n");
+	CHECK(b.app.servers == 1 && b.app.server == Esp32::RESPONSE_OK);
+	CHECK(!b.esp.isBusy());
+	return true;
+}
+
+// a send refused with "busy p..." before the prompt is retried at the halved window
+static bool checkRetrySend(void)
+{
+	Bench b;
+	static byte payload[2048];
+	memset(payload, 'x', sizeof(payload));
+	b.esp.setRetryPolicy(Esp32::CMD_MAX, 3, 20, 500);
+	b.esp.setSendWindow(256, 2048, 256);
+	CHECK(b.tcp(0));
+	CHECK(b.esp.sendBytesMUX(&b.app, 0, payload, 2048));
+	CHECK(b.module.sent("AT+CIPSEND=0,2048\r\n"));
+	b.answer("busy p...\r\n");
+	b.module.clear();
+	b.wait(25);
+	CHECK(b.module.sent("AT+CIPSEND=0,1024\r\n"));
+	b.answer(">");
+	b.answer("Recv 1024 bytes\r\n\r\nSEND OK\r\n");
+	CHECK(b.app.sends == 0 && b.module.count("AT+CIPSEND=0,1024\r\n") == 2);
+	b.answer(">");
+	b.answer("Recv 1024 bytes\r\n\r\nSEND OK\r\n");
+	CHECK(b.app.sends == 1 && b.app.send == Esp32::RESPONSE_OK && !b.esp.isBusy());
+	return true;
+}
+
+// a "CONNECT" that answers our connect while its retry waits is not a client of the server
+static bool checkRetryConnect(void)
+{
+	Bench b;
+	b.esp.setRetryPolicy(Esp32::CMD_MAX, 3, 20, 500);
+	CHECK(b.esp.startTCPServer(&b.app, 80));
+	b.answer("\r\nOK\r\n");
+	CHECK(b.esp.TCPConnectMUX(&b.app, 1, 0x0a000001, 80));
+	b.answer("busy p...\r\n");
+	b.answer("1,CONNECT\r\n");
+	CHECK(b.app.accepted == 0 && b.esp.isConnected(1));
+	b.answer("2,CONNECT\r\n");
+	CHECK(b.app.accepted == 1);
+	return true;
+}
+
+// each datagram of a burst is its own AT+CIPSEND, never cut to the window
+static bool checkBurst(void)
+{
+	Bench b;
+	static byte payload[3][600];
+	Esp32::Datagram d[3];
+	for (int i = 0; i < 3; i++)
+	{
+		memset(payload[i], 'a' + i, sizeof(payload[i]));
+		d[i].remote_ip = i == 1 ? 0x0a000002 : 0;
+		d[i].remote_port = i == 1 ? 5001 : 0;
+		d[i].payload = payload[i];
+		d[i].size = sizeof(payload[i]);
+	}
+	b.esp.setSendWindow(256, 512, 0);
+	CHECK(b.udp(1));
+	CHECK(b.esp.sendBurstMUX(&b.app, 1, d, 3));
+	for (int i = 0; i < 3; i++)
+	{
+		CHECK(b.module.count("AT+CIPSEND=1,600") == i + 1);
+		b.answer(">");
+		b.answer(i == 2 ? "Recv 600 bytes\r\n\r\nSEND FAIL\r\n" : "Recv 600 bytes\r\n\r\nSEND OK\r\n");
+	}
+	CHECK(b.module.sent("AT+CIPSEND=1,600,\"10.0.0.2\",5001\r\n"));
+	CHECK(b.app.bursts == 1 && b.app.burstSent == 2);
+	CHECK(d[0].result == Esp32::RESPONSE_OK && d[2].result == Esp32::RESPONSE_SEND_FAILED);
+	CHECK(!b.esp.isBusy());
+	return true;
+}
+
+// an eviction the module refuses fails the connect without an AT+CIPSTART on the open link
+static bool checkPool(void)
+{
+	Bench b;
+	b.esp.setPoolLinks(0x03);
+	for (int i = 0; i < 2; i++)
+	{
+		CHECK(b.esp.connectPooled(&b.app, Esp32::TCP, 0x0a000001 + i, 80) == i);
+		char s[32];
+		snprintf(s, sizeof(s), "%d,CONNECT\r\n\r\nOK\r\n", i);
+		b.answer(s);
+		b.esp.releaseLink(i);
+	}
+	CHECK(b.app.connects == 2 && b.app.connect == Esp32::RESPONSE_OK);
+	b.module.clear();
+	CHECK(b.esp.connectPooled(&b.app, Esp32::TCP, 0x0a000009, 80) == 0);
+	CHECK(b.module.sent("AT+CIPCLOSE=0\r\n"));
+	b.answer("\r\nERROR\r\n");
+	CHECK(b.app.connects == 3 && b.app.connect == Esp32::RESPONSE_UNKNOWN_ERROR);
+	CHECK(!b.module.sent("AT+CIPSTART") && b.esp.isConnected(0) && !b.esp.isBusy());
+	CHECK(b.esp.connectPooled(&b.app, Esp32::TCP, 0x0a000009, 80) == 1); // link 0 is idle again, not the oldest
+	b.answer("1,CLOSED\r\n\r\nOK\r\n");
+	CHECK(b.module.sent("AT+CIPSTART=1,\"TCP\",\"10.0.0.9\",80\r\n"));
+	b.answer("1,CONNECT\r\n\r\nOK\r\n");
+	CHECK(b.app.connects == 4 && b.app.connect == Esp32::RESPONSE_OK);
+	return true;
+}
+
+// a request answered or failed while its body is still going out sends no more of it
+static bool checkHttpBody(void)
+{
+	Bench b;
+	Esp32HTTP http(b.esp);
+	http.begin(0, 1);
+	http.setResponseTimeout(50);
+	Response response;
+	static byte body[3000];
+	memset(body, 'x', sizeof(body));
+	CHECK(http.request(&response, Esp32HTTP::METHOD_POST, "h", 0x0a000001, 80, "/", NULL, body, sizeof(body)) != -1);
+	http.loop();
+	CHECK(b.module.sent("AT+CIPSTART=0,\"TCP\""));
+	b.answer("0,CONNECT\r\n\r\nOK\r\n");
+	http.loop();
+	b.answer(">");
+	b.module.clear();
+	// a 413 before the body: done, and the connection is not used again
+	b.answer("\r\nSEND OK\r\n\r\n+IPD,0,38:HTTP/1.1 413 No\r\nContent-Length: 0\r\n\r\n");
+	http.loop();
+	CHECK(response.done == 1 && response.status == 413 && response.result == Esp32::RESPONSE_OK);
+	CHECK(!b.module.sent("AT+CIPSEND") && b.module.sent("AT+CIPCLOSE=0\r\n"));
+	b.answer("0,CLOSED\r\n\r\nOK\r\n");
+	http.loop();
+	// the response timeout during the first piece of the body
+	CHECK(http.request(&response, Esp32HTTP::METHOD_POST, "h", 0x0a000001, 80, "/", NULL, body, sizeof(body)) != -1);
+	http.loop();
+	b.answer("0,CONNECT\r\n\r\nOK\r\n");
+	http.loop();
+	b.answer(">");
+	b.answer("\r\nSEND OK\r\n");
+	b.module.clear();
+	http.loop();
+	CHECK(b.module.sent("AT+CIPSEND=0,2048\r\n"));
+	b.wait(60);
+	CHECK(response.done == 2 && response.result == Esp32::RESPONSE_TIMEOUT);
+	b.answer(">");
+	b.answer("Recv 2048 bytes\r\n\r\nSEND OK\r\n");
+	http.loop();
+	CHECK(b.module.count("AT+CIPSEND") == 1 && b.module.sent("AT+CIPCLOSE=0\r\n"));
+	return true;
+}
+
+// a disconnect while the link connects sends no CONNECT, a refused CONNACK is
+// reported once and not followed by a disconnect
+static bool checkMqttClose(void)
+{
+	Bench b;
+	Esp32MQTT mqtt(b.esp);
+	mqtt.begin(0);
+	Session session;
+	CHECK(mqtt.connect(&session, 0x0a000001, 1883, "c"));
+	mqtt.loop();
+	CHECK(b.module.sent("AT+CIPSTART=0,\"TCP\""));
+	mqtt.disconnect();
+	b.answer("0,CONNECT\r\n\r\nOK\r\n");
+	b.module.clear();
+	mqtt.loop();
+	CHECK(!b.module.sent("AT+CIPSEND") && b.module.sent("AT+CIPCLOSE=0\r\n"));
+	b.answer("0,CLOSED\r\n\r\nOK\r\n");
+	mqtt.loop();
+	CHECK(session.connected == 0 && session.disconnected == 0 && !b.esp.isConnected(0));
+	CHECK(mqtt.connect(&session, 0x0a000001, 1883, "c"));
+	mqtt.loop();
+	b.answer("0,CONNECT\r\n\r\nOK\r\n");
+	mqtt.loop();
+	CHECK(b.module.sent("AT+CIPSEND=0,"));
+	b.answer(">");
+	b.answer("\r\nSEND OK\r\n");
+	b.module.clear();
+	b.answer("\r\n+IPD,0,4:\x20\x02\x00\x05", 15); // CONNACK, not authorized
+	CHECK(session.connected == 1 && session.code == 5);
+	mqtt.loop();
+	CHECK(b.module.sent("AT+CIPCLOSE=0\r\n"));
+	b.answer("0,CLOSED\r\n\r\nOK\r\n");
+	mqtt.loop();
+	CHECK(session.connected == 1 && session.disconnected == 0 && !mqtt.isConnected());
+	return true;
+}
+
+// a refused AT+CIPMUX leaves the cached mode as the module has it
+static bool checkMuxCache(void)
+{
+	Bench b;
+	CHECK(b.esp.setMUX(&b.app, false));
+	b.answer("\r\nERROR\r\n");
+	b.module.clear();
+	CHECK(b.esp.getMUX(&b.app));
+	CHECK(b.app.muxes == 1 && b.app.mux && !b.module.sent("AT+CIPMUX?"));
+	return true;
+}
+
+static void run(Bench& b, Esp32Bringup& bringup)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		b.esp.loop();
+		bringup.loop();
+	}
+}
+
+// with a BSSID pinned the AP is joined without asking which network the module is on,
+// AT+CWJAP? gives the SSID only and another AP of the same network would pass
+static bool checkBringupBssid(void)
+{
+	Bench b;
+	Esp32Bringup bringup(b.esp);
+	Started started;
+	Esp32Bringup::BringupConfig config = { false, Esp32::MODE_STATION, true, "net", "pw", "aa:bb:cc:dd:ee:ff" };
+	CHECK(bringup.start(&started, config));
+	run(b, bringup);
+	CHECK(b.module.sent("AT+CWMODE?"));
+	b.answer("+CWMODE:1\r\n\r\nOK\r\n");
+	run(b, bringup);
+	CHECK(!b.module.sent("AT+CWJAP?") && b.module.sent("AT+CWJAP_CUR=\"net\",\"pw\",\"aa:bb:cc:dd:ee:ff\""));
+	b.answer("WIFI CONNECTED\r\nWIFI GOT IP\r\n\r\nOK\r\n");
+	run(b, bringup);
+	CHECK(b.module.sent("AT+CIFSR"));
+	b.answer("+CIFSR:STAIP,\"192.168.1.20\"\r\n\r\nOK\r\n");
+	run(b, bringup);
+	CHECK(started.done == 1 && started.result == Esp32::RESPONSE_OK);
+	return true;
+}
+
+static void nothing(void* arg) {}
+
+const static int WHEEL_TIMERS = 48;
+
+// the timers of the wheel check and the ticks they are due at, 0 if not armed
+typedef struct _WHEEL_REF {
+	Esp32TimerWheel* wheel;
+	Esp32Timer timers[WHEEL_TIMERS];
+	uint64_t due[WHEEL_TIMERS];
+	uint64_t now; // tick the running advance() goes to
+	uint64_t last; // due tick of the last callback
+	long bad;
+} WheelRef;
+
+static WheelRef s_wheel;
+static uint32_t s_seed = 3;
+
+static uint32_t random32(void)
+{
+	s_seed = s_seed * 1103515245 + 12345;
+	return s_seed >> 8;
+}
+
+// mostly short, often next to where a level ends, now and then past the top level
+static uint32_t randomDelay(void)
+{
+	const static uint32_t levels[] = { 64, 4096, 262144, 16777216 };
+	switch (random32() % 8)
+	{
+	case 0:
+		return random32() % 3;
+	case 1:
+	case 2:
+		return random32() % 64;
+	case 3:
+	case 4:
+		return levels[random32() % 4] * (1 + random32() % 2) - 3 + random32() % 7;
+	case 5:
+		return random32() % 300000;
+	case 6:
+		return random32() % 5000;
+	default:
+		return random32() % 20000000;
+	}
+}
+
+static void wheelArm(int i, uint64_t now, uint32_t ms)
+{
+	s_wheel.wheel->arm(s_wheel.timers[i], ms);
+	s_wheel.due[i] = now + (ms > 0 ? ms : 1);
+}
+
+static void wheelFired(void* arg)
+{
+	WheelRef& r = s_wheel;
+	int i = (int)(intptr_t)arg;
+	// due, not after the end of this advance() and not before an earlier callback
+	if (r.due[i] == 0 || r.due[i] > r.now || r.due[i] < r.last)
+		r.bad++;
+	uint64_t tick = r.due[i];
+	r.last = tick;
+	r.due[i] = 0;
+	// cancels and arms at the tick the levels above cascade into
+	int j = random32() % WHEEL_TIMERS;
+	switch (random32() % 4)
+	{
+	case 0:
+		r.wheel->cancel(r.timers[j]);
+		r.due[j] = 0;
+		break;
+	case 1:
+		wheelArm(j, tick, randomDelay());
+		break;
+	default:
+		break;
+	}
+}
+
+// random arms, cancels and clock steps against the due ticks: every timer runs at its
+// tick, none is left behind and nextTimeout() is the earliest due. Timers reach past
+// the top level and are cancelled or armed from callbacks while the levels above
+// cascade, micros() wraps 2 s in and every 71 minutes after
+static bool checkTimers(void)
+{
+	VirtualClock clock(0xffffffff - 2000000);
+	Esp32TimerWheel wheel(clock);
+	WheelRef& r = s_wheel;
+	r.wheel = &wheel;
+	memset(r.due, 0, sizeof(r.due));
+	r.now = 0;
+	r.last = 0;
+	r.bad = 0;
+	for (int i = 0; i < WHEEL_TIMERS; i++)
+	{
+		r.timers[i].init(wheelFired, (void*)(intptr_t)i);
+	}
+	wheel.advance(); // tick 0 is now, the wheel reads the clock on first use
+	uint64_t us = 0;
+	for (int step = 0; step < 100000; step++)
+	{
+		int i = random32() % WHEEL_TIMERS;
+		switch (random32() % 4)
+		{
+		case 0:
+			wheelArm(i, r.now, randomDelay());
+			break;
+		case 1:
+			wheel.cancel(r.timers[i]);
+			r.due[i] = 0;
+			break;
+		default:
+			break;
+		}
+		uint32_t d = random32() % 32 == 0 ? random32() % 120000000 : random32() % 5000;
+		clock.advance(d);
+		us += d;
+		r.now = us / 1000;
+		wheel.advance();
+		uint64_t first = 0;
+		int armed = 0;
+		for (int k = 0; k < WHEEL_TIMERS; k++)
+		{
+			if (r.timers[k].isArmed() != (r.due[k] != 0) || (r.due[k] != 0 && r.due[k] <= r.now))
+				r.bad++;
+			if (r.due[k] != 0 && (first == 0 || r.due[k] < first))
+				first = r.due[k];
+			armed += r.due[k] != 0;
+		}
+		CHECK(r.bad == 0 && wheel.count() == armed);
+		CHECK(wheel.nextTimeout() == (first == 0 ? Esp32TimerWheel::NO_TIMEOUT : (uint32_t)(first - r.now)));
+	}
+	CHECK(us > 4 * 0xffffffffULL); // the clock wrapped a few times
+	return true;
+}
+
+// after a switch of port only the new one wakes waitEvent(), setting it again changes nothing
+static bool checkPortSwitch(void)
+{
+	PtyLoopback a;
+	PtyLoopback b;
+	CHECK(a.open() && b.open());
+	Esp32 esp;
+	esp.setEventDriven(true);
+	esp.setSerial(a.device());
+	esp.setSerial(b.device());
+	esp.setSerial(b.device());
+	esp.loop(); // takes the flag raised by the switch
+	Esp32Timer timer;
+	timer.init(nothing, NULL);
+	esp.getTimers().arm(timer, 20);
+	a.module().write((const uint8_t*)"x", 1);
+	CHECK(!esp.waitEvent());
+	esp.getTimers().arm(timer, 1000); // the byte takes a moment through the pty
+	b.module().write((const uint8_t*)"x", 1);
+	CHECK(esp.waitEvent());
+	return true;
+}
+
+#ifdef WIFI_NO_DEFAULT_ARENA
+// without memory no command goes out, the pool hands out no link and a burst still
+// completes with every datagram failed
+static bool checkNoMemory(void)
+{
+	Bench b(false);
+	static byte payload[16];
+	Esp32::Datagram d[2];
+	for (int i = 0; i < 2; i++)
+	{
+		d[i].remote_ip = 0;
+		d[i].remote_port = 0;
+		d[i].payload = payload;
+		d[i].size = sizeof(payload);
+	}
+	CHECK(!b.esp.UDPConnectMUX(&b.app, 1, 0x0a000001, 5000));
+	CHECK(b.esp.connectPooled(&b.app, Esp32::UDP, 0x0a000001, 5000) == -1);
+	CHECK(b.esp.sendBurstMUX(&b.app, 1, d, 2));
+	CHECK(b.app.bursts == 1 && b.app.burstSent == 0);
+	CHECK(d[0].result == Esp32::RESPONSE_SEND_ERROR && d[1].result == Esp32::RESPONSE_SEND_ERROR);
+	CHECK(!b.esp.isBusy());
+	return true;
+}
+#endif
+
+typedef struct _CHECK_ENTRY {
+	const char* name;
+	bool (*run)(void);
+} CheckEntry;
+
+static const CheckEntry s_checks[] = {
+	{ "window", checkWindow },
+	{ "retry", checkRetry },
+	{ "retrysend", checkRetrySend },
+	{ "retryconnect", checkRetryConnect },
+	{ "burst", checkBurst },
+	{ "pool", checkPool },
+	{ "http", checkHttpBody },
+	{ "mqtt", checkMqttClose },
+	{ "mux", checkMuxCache },
+	{ "bssid", checkBringupBssid },
+	{ "port", checkPortSwitch },
+	{ "timers", checkTimers },
+#ifdef WIFI_NO_DEFAULT_ARENA
+	{ "nomemory", checkNoMemory },
+#endif
+};
+
+int main(int argc, char* argv[])
+{
+	int failed = 0;
+	for (size_t i = 0; i < sizeof(s_checks) / sizeof(s_checks[0]); i++)
+	{
+		if (argc > 1 && strcmp(argv[1], s_checks[i].name) != 0)
+			continue;
+		bool ok = s_checks[i].run();
+		printf("%s\t%s\n", s_checks[i].name, ok ? "ok" : "FAILED");
+		if (!ok)
+			failed++;
+	}
+	return failed;
+}
@@ -0,0 +1,370 @@
+// HTTP requests per second against an emulated module and server, Linux only
+//
+//   g++ -I.. -I<dir of conf_wifi.h> -o esp32http esp32http.cpp ../ESP32HTTP.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp
+//   ./esp32http [-n requests] [-b body bytes] [-d pipeline depth]
+//
+// The emulator answers each AT command after 2 ms, connects in 50 ms and serves a
+// response 5 ms after the request is complete, in +IPD frames of at most 100 bytes,
+// alternating Content-Length and chunked bodies. Time is virtual, so the figures
+// are those of the modeled latencies: connect per request, keep-alive, and
+// keep-alive with pipelining
+
+
+#include "ESP32HTTP.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const static uint32_t AT_TIME = 2000; // us
+const static uint32_t CONNECT_TIME = 50000;
+const static uint32_t SERVE_TIME = 5000;
+const static size_t FRAME_SIZE = 100;
+
+// AT commands in, answers and server responses out once the clock reaches them
+class HttpModule : public Esp32Serial
+{
+public:
+	const static int EVENT_MAX = 1024;
+	const static size_t EVENT_SIZE = FRAME_SIZE + 32;
+	const static size_t REQUEST_SIZE = 4096;
+	const static size_t BODY_MAX = 4096;
+
+	int served;
+
+	HttpModule(VirtualClock& clock, size_t body_size, bool close)
+		: served(0), m_clock(clock), m_bodySize(body_size < BODY_MAX ? body_size : BODY_MAX), m_close(close),
+		m_head(0), m_count(0), m_rxPos(0), m_cmdLen(0), m_payload(0), m_payloadLink(0)
+	{
+		memset(m_open, 0, sizeof(m_open));
+		memset(m_reqLen, 0, sizeof(m_reqLen));
+	}
+	uint32_t nextTime(bool* any) // of the next answer not readable yet
+	{
+		*any = m_count > 0;
+		return m_count > 0 ? m_events[m_head].at : 0;
+	}
+	int available(void)
+	{
+		return m_count > 0 && Esp32Clock::reached(m_clock.micros(), m_events[m_head].at)
+			? m_events[m_head].len - m_rxPos : 0;
+	}
+	int read(void)
+	{
+		uint8_t c;
+		return read(&c, 1) == 1 ? c : -1;
+	}
+	size_t read(uint8_t* buffer, size_t n)
+	{
+		size_t c = 0;
+		while (c < n && available() > 0)
+		{
+			Event& e = m_events[m_head];
+			size_t k = e.len - m_rxPos < n - c ? e.len - m_rxPos : n - c;
+			memcpy(buffer + c, e.data + m_rxPos, k);
+			c += k;
+			m_rxPos += k;
+			if (m_rxPos == e.len)
+			{
+				m_head = (m_head + 1) % EVENT_MAX;
+				m_count--;
+				m_rxPos = 0;
+			}
+		}
+		return c;
+	}
+	size_t write(const uint8_t* buffer, size_t n)
+	{
+		for (size_t i = 0; i < n; i++)
+		{
+			if (m_payload > 0)
+			{
+				if (m_reqLen[m_payloadLink] < REQUEST_SIZE)
+					m_request[m_payloadLink][m_reqLen[m_payloadLink]++] = buffer[i];
+				m_payloadSeen++;
+				if (--m_payload == 0)
+				{
+					answer(AT_TIME, "\r\nRecv %d bytes\r\n\r\nSEND OK\r\n", m_payloadSeen);
+					respond(m_payloadLink);
+				}
+				continue;
+			}
+			if (m_cmdLen < sizeof(m_cmd) - 1)
+				m_cmd[m_cmdLen++] = buffer[i];
+			if (m_cmdLen >= 2 && m_cmd[m_cmdLen - 2] == '\r' && m_cmd[m_cmdLen - 1] == '\n')
+			{
+				m_cmd[m_cmdLen - 2] = 0;
+				command(m_cmd);
+				m_cmdLen = 0;
+			}
+		}
+		return n;
+	}
+
+private:
+	typedef struct _EVENT {
+		uint32_t at;
+		size_t len;
+		char data[EVENT_SIZE];
+	} Event;
+
+	VirtualClock& m_clock;
+	size_t m_bodySize;
+	bool m_close; // the server closes after each response
+	Event m_events[EVENT_MAX];
+	int m_head;
+	int m_count;
+	size_t m_rxPos; // in the head event
+	char m_cmd[128];
+	size_t m_cmdLen;
+	int m_payload; // bytes of the AT+CIPSEND still to come
+	int m_payloadSeen;
+	int m_payloadLink;
+	bool m_open[Esp32::LINK_MAX];
+	char m_request[Esp32::LINK_MAX][REQUEST_SIZE];
+	size_t m_reqLen[Esp32::LINK_MAX];
+
+	// answers go out in order, none before the one queued last
+	void push(uint32_t delay, const char* data, size_t len)
+	{
+		if (m_count == EVENT_MAX)
+			return;
+		uint32_t at = m_clock.micros() + delay;
+		if (m_count > 0)
+		{
+			uint32_t last = m_events[(m_head + m_count - 1) % EVENT_MAX].at;
+			if (!Esp32Clock::reached(at, last))
+				at = last;
+		}
+		Event& e = m_events[(m_head + m_count) % EVENT_MAX];
+		e.at = at;
+		e.len = len < EVENT_SIZE ? len : EVENT_SIZE;
+		memcpy(e.data, data, e.len);
+		m_count++;
+	}
+	void answer(uint32_t delay, const char format[], int n = 0)
+	{
+		char s[64];
+		push(delay, s, snprintf(s, sizeof(s), format, n));
+	}
+	void command(const char line[])
+	{
+		int link_id = 0;
+		int size = 0;
+		if (sscanf(line, "AT+CIPSTART=%d,", &link_id) == 1 && link_id >= 0 && link_id < Esp32::LINK_MAX)
+		{
+			if (m_open[link_id])
+			{
+				answer(AT_TIME, "ALREADY CONNECTED\r\n\r\nERROR\r\n");
+				return;
+			}
+			m_open[link_id] = true;
+			m_reqLen[link_id] = 0;
+			answer(CONNECT_TIME, "%d,CONNECT\r\n\r\nOK\r\n", link_id);
+		}
+		else if (sscanf(line, "AT+CIPSEND=%d,%d", &link_id, &size) == 2 && link_id >= 0 && link_id < Esp32::LINK_MAX)
+		{
+			m_payloadLink = link_id;
+			m_payload = size;
+			m_payloadSeen = 0;
+			answer(AT_TIME, "\r\nOK\r\n> ");
+		}
+		else if (sscanf(line, "AT+CIPCLOSE=%d", &link_id) == 1 && link_id >= 0 && link_id < Esp32::LINK_MAX)
+		{
+			if (!m_open[link_id])
+			{
+				answer(AT_TIME, "\r\nERROR\r\n");
+				return;
+			}
+			m_open[link_id] = false;
+			answer(AT_TIME, "%d,CLOSED\r\n\r\nOK\r\n", link_id);
+		}
+		else
+		{
+			answer(AT_TIME, "\r\nOK\r\n");
+		}
+	}
+	// serves every complete request written to the link
+	void respond(int link_id)
+	{
+		char* r = m_request[link_id];
+		while (true)
+		{
+			size_t len = m_reqLen[link_id];
+			char* end = NULL;
+			for (size_t i = 0; i + 4 <= len && end == NULL; i++)
+			{
+				if (memcmp(r + i, "\r\n\r\n", 4) == 0)
+					end = r + i;
+			}
+			if (end == NULL)
+				return;
+			size_t body = 0;
+			*end = 0;
+			const char* cl = strstr(r, "Content-Length: ");
+			if (cl != NULL)
+				body = atoi(cl + 16);
+			size_t used = end + 4 - r + body;
+			if (used > len)
+			{
+				*end = '\r';
+				return;
+			}
+			memmove(r, r + used, len - used);
+			m_reqLen[link_id] = len - used;
+			served++;
+			serve(link_id, served % 2 == 0);
+		}
+	}
+	void serve(int link_id, bool chunked)
+	{
+		static char response[BODY_MAX * 2 + 256];
+		const char* close = m_close ? "Connection: close\r\n" : "";
+		int n;
+		if (chunked)
+		{
+			n = sprintf(response, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n%s\r\n", close);
+			for (size_t off = 0; off < m_bodySize; off += 37)
+			{
+				size_t k = m_bodySize - off < 37 ? m_bodySize - off : 37;
+				n += sprintf(response + n, "%x\r\n", (unsigned)k);
+				for (size_t i = 0; i < k; i++)
+				{
+					response[n++] = 'a' + (off + i) % 26;
+				}
+				n += sprintf(response + n, "\r\n");
+			}
+			n += sprintf(response + n, "0\r\n\r\n");
+		}
+		else
+		{
+			n = sprintf(response, "HTTP/1.1 200 OK\r\nContent-Length: %u\r\n%s\r\n", (unsigned)m_bodySize, close);
+			for (size_t i = 0; i < m_bodySize; i++)
+			{
+				response[n++] = 'a' + i % 26;
+			}
+		}
+		for (int off = 0; off < n; off += FRAME_SIZE)
+		{
+			char frame[EVENT_SIZE];
+			int k = n - off < (int)FRAME_SIZE ? n - off : FRAME_SIZE;
+			int h = sprintf(frame, "\r\n+IPD,%d,%d:", link_id, k);
+			memcpy(frame + h, response + off, k);
+			push(SERVE_TIME, frame, h + k);
+		}
+		if (m_close)
+		{
+			m_open[link_id] = false;
+			answer(100, "%d,CLOSED\r\n", link_id);
+		}
+	}
+};
+
+// counts the answers and the body bytes
+class Counter : public IHttp
+{
+public:
+	int done;
+	int failed;
+	size_t bytes;
+
+	Counter() : done(0), failed(0), bytes(0) {}
+	void cbHttpResponse(int id, int status, int32_t content_length) {}
+	void cbHttpBody(int id, const byte* data, size_t size) { bytes += size; }
+	void cbHttpDone(int id, Esp32::ResponseType result)
+	{
+		done++;
+		if (result != Esp32::RESPONSE_OK)
+			failed++;
+	}
+};
+
+// a client that only takes the answer to AT+CIPMUX=1
+class MuxClient : public Esp32HTTP
+{
+public:
+	bool set;
+
+	MuxClient(Esp32& esp) : Esp32HTTP(esp), set(false) {}
+	void cbSetMUX(Esp32::ResponseType) { set = true; }
+};
+
+static void run(const char name[], bool keep_alive, int depth, int requests, size_t body_size)
+{
+	VirtualClock clock;
+	HttpModule module(clock, body_size, !keep_alive);
+	Esp32 esp;
+	esp.setClock(clock);
+	esp.setSerial(module);
+	Esp32HTTP http(esp);
+	http.begin(0, Esp32::LINK_MAX);
+	http.setKeepAlive(keep_alive);
+	http.setPipelineDepth(depth);
+	MuxClient mux(esp);
+	esp.setMUX(&mux, true);
+	while (!mux.set)
+	{
+		clock.advance(100);
+		esp.loop();
+	}
+	uint32_t start = clock.micros();
+	Counter counter;
+	int issued = 0;
+	while (counter.done < requests)
+	{
+		while (issued < requests && http.get(&counter, "10.0.0.1", 0x0100000a, 80, "/x") != -1)
+		{
+			issued++;
+		}
+		esp.loop();
+		http.loop();
+		// jump to the next answer, or the next driver timer if that comes first
+		bool any;
+		uint32_t next = module.nextTime(&any);
+		uint32_t timer = esp.nextTimeout();
+		if (!any)
+		{
+			if (timer == Esp32::NO_TIMEOUT)
+				break; // nothing left that could move
+			clock.advance(timer * 1000);
+		}
+		else if (!Esp32Clock::reached(clock.micros(), next))
+		{
+			if (timer != Esp32::NO_TIMEOUT && (uint64_t)timer * 1000 < Esp32Clock::elapsed(next, clock.micros()))
+				clock.advance(timer * 1000);
+			else
+				clock.set(next);
+		}
+	}
+	double span = Esp32Clock::elapsed(clock.micros(), start) / 1e6;
+	const Esp32HTTP::HttpStats& st = http.getStats();
+	printf("%-20s %d of %d done, %d failed, %llu body bytes, %u connects, %u reused, %u pipelined, %.3f s, %.1f req/s\n",
+		name, counter.done, requests, counter.failed, (unsigned long long)counter.bytes, st.connects, st.reused,
+		st.pipelined, span, span > 0 ? counter.done / span : 0.0);
+}
+
+int main(int argc, char* argv[])
+{
+	int requests = 40;
+	int body_size = 300;
+	int depth = Esp32HTTP::PIPELINE_MAX;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-n") == 0)
+			requests = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-b") == 0)
+			body_size = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-d") == 0)
+			depth = atoi(argv[i + 1]);
+	}
+	if (requests < 1 || body_size < 0 || body_size > (int)HttpModule::BODY_MAX || depth < 1
+		|| depth > Esp32HTTP::PIPELINE_MAX || argc % 2 == 0)
+	{
+		fprintf(stderr, "usage: %s [-n requests] [-b body bytes, up to %u] [-d pipeline depth, 1 to %d]\n",
+			argv[0], (unsigned)HttpModule::BODY_MAX, Esp32HTTP::PIPELINE_MAX);
+		return 2;
+	}
+	run("connect per request", false, 1, requests, body_size);
+	run("keep-alive", true, 1, requests, body_size);
+	run("pipelined", true, depth, requests, body_size);
+	return 0;
+}
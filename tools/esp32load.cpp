@@ -0,0 +1,206 @@
+// Sustained receive load on the parser from a synthetic module, Linux only
+//
+//   g++ -O2 -I.. -I<dir of conf_wifi.h> -o esp32load esp32load.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp
+//   ./esp32load [-t seconds] [-s seed]
+//
+// The module interleaves +IPD frames of up to 2920 bytes on all five links with
+// URCs and SEND OK, and hands them over in chunks of random size so frames and
+// lines are cut anywhere. Each second prints the figures so far, the last line
+// the totals: bytes/s through loop(), bytes lost, and the latency from reading a
+// chunk to its cbReceivedData. Runs with the same seed parse the same stream
+
+
+#include "ESP32WROOM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t s_seed = 1;
+
+// xorshift, the stream only depends on the seed
+static uint32_t random32(void)
+{
+	s_seed ^= s_seed << 13;
+	s_seed ^= s_seed >> 17;
+	s_seed ^= s_seed << 5;
+	return s_seed;
+}
+
+// payload byte at offset of a link, checked on delivery
+static uint8_t pattern(int link_id, uint64_t offset)
+{
+	return 'a' + (offset + link_id * 7) % 26;
+}
+
+// a module streaming events without end, after the answer to AT+CIPMUX=1
+class LoadSerial : public Esp32Serial
+{
+public:
+	const static size_t PAYLOAD_MAX = 2920;
+	const static size_t CHUNK_MAX = 700;
+
+	uint64_t sent[Esp32::LINK_MAX]; // payload bytes per link
+
+	LoadSerial() : m_len(6), m_pos(0), m_chunk(6)
+	{
+		memcpy(m_event, "\r\nOK\r\n", 6);
+		memset(sent, 0, sizeof(sent));
+	}
+	int available(void) { return m_chunk; }
+	int read(void)
+	{
+		uint8_t c;
+		return read(&c, 1) == 1 ? c : -1;
+	}
+	size_t read(uint8_t* buffer, size_t n)
+	{
+		size_t c = m_chunk < n ? m_chunk : n;
+		memcpy(buffer, m_event + m_pos, c);
+		m_pos += c;
+		m_chunk -= c;
+		return c;
+	}
+	size_t write(const uint8_t* buffer, size_t n) { return n; }
+	void arrive(void) // the next chunk of the stream, once the last one is read
+	{
+		if (m_chunk > 0)
+			return;
+		if (m_pos == m_len)
+			generate();
+		m_chunk = 1 + random32() % CHUNK_MAX;
+		if (m_chunk > m_len - m_pos)
+			m_chunk = m_len - m_pos;
+	}
+
+private:
+	char m_event[PAYLOAD_MAX + 32];
+	size_t m_len;
+	size_t m_pos;
+	size_t m_chunk; // left of what the UART has delivered so far
+
+	void generate(void)
+	{
+		m_pos = 0;
+		uint32_t r = random32() % 10;
+		if (r < 7)
+		{
+			int link_id = random32() % Esp32::LINK_MAX;
+			size_t size = 1 + random32() % PAYLOAD_MAX;
+			int n = sprintf(m_event, "\r\n+IPD,%d,%u:", link_id, (unsigned)size);
+			for (size_t i = 0; i < size; i++)
+			{
+				m_event[n + i] = pattern(link_id, sent[link_id] + i);
+			}
+			sent[link_id] += size;
+			m_len = n + size;
+		}
+		else
+		{
+			const char* urc = r == 7 ? "\r\nWIFI GOT IP\r\n" : (r == 8 ? "\r\nSEND OK\r\n" : "\r\nbusy p...\r\n");
+			m_len = strlen(urc);
+			memcpy(m_event, urc, m_len);
+		}
+	}
+};
+
+// owns every link and checks what reaches the application
+class Sink : public IWifi
+{
+public:
+	uint64_t received[Esp32::LINK_MAX];
+	uint32_t corrupt; // deliveries not continuing the stream of their link
+
+	Sink() : corrupt(0) { memset(received, 0, sizeof(received)); }
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbSend(Esp32::ResponseType) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end)
+	{
+		bool ok = true;
+		for (int i = begin; i < end; i++)
+		{
+			if ((uint8_t)buffer[i] != pattern(link_id, received[link_id] + i - begin))
+				ok = false;
+		}
+		if (!ok)
+			corrupt++;
+		received[link_id] += end - begin;
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	int seconds = 10;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-t") == 0)
+			seconds = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			s_seed = strtoul(argv[i + 1], NULL, 0);
+	}
+	if (seconds < 1 || s_seed == 0 || argc % 2 == 0)
+	{
+		fprintf(stderr, "usage: %s [-t seconds] [-s seed], seed not 0\n", argv[0]);
+		return 2;
+	}
+	LoadSerial module;
+	Esp32 esp;
+	Sink sink;
+	esp.setSerial(module);
+	esp.setMUX(&sink, true);
+	esp.loop();
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		esp.setLinkOwner(i, &sink);
+	}
+	esp.resetRxStats();
+	uint64_t busy = 0; // us in loop()
+	uint64_t last = 0; // bytes_received at the last line
+	uint32_t start = systemClock.micros();
+	for (int s = 1; s <= seconds; s++)
+	{
+		uint32_t t = systemClock.micros();
+		while (Esp32Clock::elapsed(systemClock.micros(), t) < 1000000)
+		{
+			for (int i = 0; i < 1000; i++)
+			{
+				module.arrive();
+				esp.loop();
+			}
+		}
+		busy += Esp32Clock::elapsed(systemClock.micros(), t);
+		const Esp32::RxStats& st = esp.getRxStats();
+		printf("%3d s: %.1f MB/s, %llu lost, latency avg %.1f max %u us\n", s,
+			(st.bytes_received - last) / 1e6, (unsigned long long)st.bytes_lost,
+			st.deliveries > 0 ? st.latency_sum / (double)st.deliveries : 0.0, st.latency_max);
+		last = st.bytes_received;
+	}
+	const Esp32::RxStats& st = esp.getRxStats();
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		sent += module.sent[i];
+		received += sink.received[i];
+	}
+	// the frame being parsed at the end is neither delivered nor lost
+	printf("total: %llu bytes in %.3f s (%.1f MB/s), %u frames, %u deliveries, payload %llu of %llu delivered, "
+		"%llu lost, %u corrupt, latency avg %.1f max %u us\n",
+		(unsigned long long)st.bytes_received, Esp32Clock::elapsed(systemClock.micros(), start) / 1e6,
+		busy > 0 ? st.bytes_received / (double)busy : 0.0, st.frames, st.deliveries,
+		(unsigned long long)received, (unsigned long long)sent, (unsigned long long)st.bytes_lost, sink.corrupt,
+		st.deliveries > 0 ? st.latency_sum / (double)st.deliveries : 0.0, st.latency_max);
+	return st.bytes_lost > 0 || sink.corrupt > 0;
+}
@@ -0,0 +1,147 @@
+// Replays a capture written by CaptureSerial through the driver under virtual time, Linux only
+//
+//   g++ -I.. -I<dir of conf_wifi.h> -o esp32replay esp32replay.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp
+//   ./esp32replay [-m] [-n runs] capture.bin
+//
+// -m puts the driver in multi-connect mode first, as after AT+CIPMUX=1 in the field.
+// The virtual clock jumps to each received chunk or driver timer, so every run
+// parses the same bytes at the same times, and the wall time spent in loop() is
+// what parsing costs
+
+
+#include "ESP32WROOM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// owns every link and counts what reaches the application
+class Sink : public IWifi
+{
+public:
+	uint64_t bytes;
+	uint32_t deliveries;
+
+	Sink() : bytes(0), deliveries(0) {}
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbSend(Esp32::ResponseType) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end)
+	{
+		bytes += end - begin;
+		deliveries++;
+	}
+	void cbReceivedDirect(int link_id, byte* buffer, size_t size)
+	{
+		bytes += size;
+		deliveries++;
+	}
+};
+
+// answers the AT+CIPMUX=1 of -m
+class MuxSerial : public Esp32Serial
+{
+public:
+	MuxSerial() : m_pos(0) {}
+	int available(void) { return m_pos < 6 ? 6 - m_pos : 0; }
+	int read(void) { return m_pos < 6 ? "\r\nOK\r\n"[m_pos++] : -1; }
+	size_t read(uint8_t* buffer, size_t n)
+	{
+		size_t j = 0;
+		while (j < n && m_pos < 6)
+			buffer[j++] = "\r\nOK\r\n"[m_pos++];
+		return j;
+	}
+	size_t write(const uint8_t* buffer, size_t n) { return n; }
+
+private:
+	int m_pos;
+};
+
+int main(int argc, char* argv[])
+{
+	bool mux = false;
+	int runs = 1;
+	const char* path = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-m") == 0)
+			mux = true;
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			runs = atoi(argv[++i]);
+		else
+			path = argv[i];
+	}
+	if (path == NULL || runs < 1)
+	{
+		fprintf(stderr, "usage: %s [-m] [-n runs] capture.bin\n", argv[0]);
+		return 2;
+	}
+	VirtualClock clock;
+	ReplaySerial replay;
+	if (!replay.load(path, clock))
+	{
+		fprintf(stderr, "%s: not a capture\n", path);
+		return 1;
+	}
+	Esp32 esp;
+	Sink sink;
+	esp.setClock(clock);
+	if (mux)
+	{
+		MuxSerial serial;
+		esp.setSerial(serial);
+		esp.setMUX(&sink, true);
+		esp.loop();
+	}
+	esp.setSerial(replay);
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		esp.setLinkOwner(i, &sink);
+	}
+	for (int run = 0; run < runs; run++)
+	{
+		replay.rewind();
+		esp.resetRxStats();
+		sink.bytes = 0;
+		sink.deliveries = 0;
+		uint32_t start = clock.micros();
+		uint64_t busy = 0; // wall time in loop(), us
+		while (!replay.done())
+		{
+			uint32_t now = clock.micros();
+			uint32_t next = replay.nextTime();
+			if (!Esp32Clock::reached(now, next))
+			{
+				// a driver timer due before the next chunk runs at its own time
+				uint32_t timer = esp.nextTimeout();
+				if (timer != Esp32::NO_TIMEOUT && (uint64_t)timer * 1000 < Esp32Clock::elapsed(next, now))
+					clock.advance(timer * 1000);
+				else
+					clock.set(next);
+			}
+			uint32_t t = systemClock.micros();
+			esp.loop();
+			busy += Esp32Clock::elapsed(systemClock.micros(), t);
+		}
+		const Esp32::RxStats& st = esp.getRxStats();
+		double span = Esp32Clock::elapsed(clock.micros(), start) / 1e6;
+		printf("run %d: %llu bytes in %.3f s of capture, %u frames, %u deliveries of %llu bytes, %llu lost, "
+			"%u tx mismatches, loop %.3f ms (%.1f MB/s)\n",
+			run, (unsigned long long)st.bytes_received, span, st.frames, sink.deliveries,
+			(unsigned long long)sink.bytes, (unsigned long long)st.bytes_lost, replay.mismatches(),
+			busy / 1e3, busy > 0 ? st.bytes_received / (double)busy : 0.0);
+	}
+	return 0;
+}
@@ -0,0 +1,219 @@
+// Search primitives of MyRingBuffer against byte-at-a-time references, Linux only
+//
+//   g++ -O2 -I.. -I<dir of conf_wifi.h> -o esp32ring esp32ring.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp
+//   ./esp32ring [-n randomized rounds]
+//
+// The references walk the ring one byte at a time with a wrap per step and build
+// the KMP table on every call, as the search did before it went by segments.
+// First both are run on random rings that wrap at random places and must agree,
+// the exit status is 1 if they do not. Then each is timed on a full
+// default-size ring of +IPD frames with 1400-byte payloads, wrapping in the middle
+
+
+#include "ESP32WROOM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint32_t s_seed = 1;
+
+static uint32_t random32(void)
+{
+	s_seed = s_seed * 1103515245 + 12345;
+	return s_seed >> 8;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int refFindByte(MyRingBuffer& r, byte c, int begin, int end)
+{
+	int len = r.length();
+	if (end == -1 || end > len)
+		end = len;
+	for (int j = begin, i = (r._iTail + begin) % r._iSize; j < end; j++, i = (i + 1) % r._iSize)
+	{
+		if (r._aucBuffer[i] == c)
+			return j;
+	}
+	return -1;
+}
+
+static int refFindWord(MyRingBuffer& r, uint16_t w, int begin)
+{
+	int len = r.length();
+	for (int j = begin; j + 1 < len; j++)
+	{
+		if (r._aucBuffer[(r._iTail + j) % r._iSize] == (w & 0xff)
+			&& r._aucBuffer[(r._iTail + j + 1) % r._iSize] == (w >> 8))
+			return j;
+	}
+	return -1;
+}
+
+static int refFindBytes(MyRingBuffer& r, const byte* p, size_t n)
+{
+	int next[MyRingBuffer::FINDBYTES_MAX_SIZE + 1];
+	next[0] = -1;
+	for (int i = 1, k = -1; i <= (int)n; i++)
+	{
+		while (k >= 0 && p[k] != p[i - 1])
+			k = next[k];
+		next[i] = ++k;
+	}
+	int len = r.length();
+	for (int i = 0, j = 0; i < len; i++)
+	{
+		byte c = r._aucBuffer[(r._iTail + i) % r._iSize];
+		while (j > 0 && p[j] != c)
+			j = next[j];
+		if (p[j] == c)
+			j++;
+		if (j == (int)n)
+			return i + 1 - n;
+	}
+	return -1;
+}
+
+static bool refCmpBytes(MyRingBuffer& r, const byte* p, size_t n, int begin)
+{
+	if (begin + (int)n > r.length())
+		return false;
+	for (size_t j = 0; j < n; j++)
+	{
+		if (r._aucBuffer[(r._iTail + begin + j) % r._iSize] != p[j])
+			return false;
+	}
+	return true;
+}
+
+static size_t refReadBytes(MyRingBuffer& r, uint8_t* buffer, size_t n, int begin)
+{
+	size_t j = 0;
+	for (int len = r.length(); j < n && begin + (int)j < len; j++)
+	{
+		buffer[j] = r._aucBuffer[(r._iTail + begin + j) % r._iSize];
+	}
+	return j;
+}
+
+// puts len bytes of alphabet into the ring starting at tail
+static void fill(MyRingBuffer& r, int tail, int len, const char alphabet[], int size)
+{
+	r._iTail = r._iHead = tail;
+	for (int i = 0; i < len; i++)
+	{
+		r._aucBuffer[r._iHead] = alphabet[random32() % size];
+		r._iHead = (r._iHead + 1) % r._iSize;
+	}
+}
+
+static long randomized(MyRingBuffer& r, int rounds)
+{
+	const char alphabet[] = "ab\r\nc+IPD,:";
+	int capacity = r.capacity();
+	long bad = 0;
+	for (int i = 0; i < rounds; i++)
+	{
+		int len = random32() % (i % 10 == 0 ? capacity : 64);
+		int tail = random32() % 8 == 0 ? r._iSize - 1 - random32() % 40 : random32() % r._iSize;
+		int size = 2 + random32() % (sizeof(alphabet) - 2);
+		fill(r, tail, len, alphabet, size);
+		byte p[MyRingBuffer::FINDBYTES_MAX_SIZE];
+		size_t n = 1 + random32() % (i % 3 == 0 ? MyRingBuffer::FINDBYTES_MAX_SIZE : 4);
+		for (size_t k = 0; k < n; k++)
+		{
+			p[k] = alphabet[random32() % size];
+		}
+		int begin = random32() % (len + 2);
+		int end = random32() % 3 == 0 ? -1 : random32() % (len + 2);
+		uint16_t w = p[0] | p[n > 1] << 8;
+		MyRingBuffer::Pattern pattern;
+		MyRingBuffer::compile(pattern, p, n);
+		uint8_t a[64];
+		uint8_t b[64];
+		size_t m = random32() % sizeof(a);
+		size_t ra = refReadBytes(r, a, m, begin);
+		size_t rb = r.read_bytes(b, m, begin);
+		bad += refFindByte(r, p[0], begin, end) != r.find_byte(p[0], begin, end);
+		bad += refFindWord(r, w, begin) != r.find_word(w, begin);
+		bad += refFindBytes(r, p, n) != r.find_bytes(p, n);
+		bad += refFindBytes(r, p, n) != r.find_bytes(pattern);
+		bad += refCmpBytes(r, p, n, begin) != r.cmp_bytes(p, n, begin);
+		bad += ra != rb || memcmp(a, b, ra) != 0;
+	}
+	return bad;
+}
+
+int main(int argc, char* argv[])
+{
+	int rounds = 200000;
+	if (argc == 3 && strcmp(argv[1], "-n") == 0)
+		rounds = atoi(argv[2]);
+	else if (argc != 1)
+	{
+		fprintf(stderr, "usage: %s [-n randomized rounds]\n", argv[0]);
+		return 2;
+	}
+	static uint8_t memory[MyRingBuffer::BUFFER_MAX_SIZE];
+	MyRingBuffer r;
+	r.attach(memory, sizeof(memory));
+	long bad = randomized(r, rounds);
+	printf("randomized: %d rounds, %ld mismatches\n", rounds, bad);
+
+	// a full ring of frames, the wrap point in the middle
+	int tail = r._iSize / 2;
+	r._iTail = r._iHead = tail;
+	for (int n = 0; n < r.capacity(); )
+	{
+		char frame[1500];
+		int k = sprintf(frame, "\r\n+IPD,1,1400:");
+		for (int i = 0; i < 1400; i++)
+		{
+			frame[k++] = 'A' + random32() % 26;
+		}
+		k += sprintf(frame + k, "\r\nSEND OK\r\n");
+		for (int i = 0; i < k && n < r.capacity(); i++, n++)
+		{
+			r._aucBuffer[r._iHead] = frame[i];
+			r._iHead = (r._iHead + 1) % r._iSize;
+		}
+	}
+	static byte sendOK[] = "SEND OK\r\n";
+	static byte link3[] = "+IPD,3,";
+	MyRingBuffer::Pattern pattern;
+	MyRingBuffer::compile(pattern, link3, 7);
+	int across = r._iSize - tail - 8; // 19 bytes over the wrap point
+	byte cmpAcross[19];
+	refReadBytes(r, cmpAcross, sizeof(cmpAcross), across);
+	static uint8_t buffer[2048];
+	printf("%d bytes in the ring\n", r.length());
+	const int N = 20000;
+	volatile long sink = 0;
+#define BENCH(name, ref, ring) \
+	{ \
+		double t = seconds(); \
+		for (int i = 0; i < N; i++) sink += ref; \
+		double a = seconds() - t; \
+		t = seconds(); \
+		for (int i = 0; i < N; i++) sink += ring; \
+		double b = seconds() - t; \
+		printf("%-36s bytewise %8.3f us  segments %8.3f us  x%.1f\n", name, a / N * 1e6, b / N * 1e6, a / b); \
+	}
+	BENCH("find_byte ':' after the first frame", refFindByte(r, ':', 20, -1), r.find_byte(':', 20, -1));
+	BENCH("find_byte absent", refFindByte(r, '~', 0, -1), r.find_byte('~', 0, -1));
+	BENCH("find_word CRLF from a payload", refFindWord(r, Esp32::WORD_CRLF, 16), r.find_word(Esp32::WORD_CRLF, 16));
+	BENCH("find_word absent", refFindWord(r, '~' | '~' << 8, 0), r.find_word('~' | '~' << 8, 0));
+	BENCH("find_bytes \"SEND OK\\r\\n\"", refFindBytes(r, sendOK, 9), r.find_bytes(sendOK, 9));
+	BENCH("find_bytes absent, compiled", refFindBytes(r, link3, 7), r.find_bytes(pattern));
+	BENCH("cmp_bytes 19 across the wrap", refCmpBytes(r, cmpAcross, 19, across), r.cmp_bytes(cmpAcross, 19, across));
+	BENCH("read_bytes 2000 across the wrap", refReadBytes(r, buffer, 2000, across - 1000),
+		r.read_bytes(buffer, 2000, across - 1000));
+#undef BENCH
+	return bad > 0;
+}
@@ -0,0 +1,236 @@
+// Gain of the delimiter scan kernel, alone and in parsing, Linux only
+//
+//   g++ -O2 -I.. -I<dir of conf_wifi.h> -o esp32scan esp32scan.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp
+//   ./esp32scan [-n runs]
+//
+// The kernel is chosen when ESP32WROOM.cpp is compiled, so the comparison takes
+// one build per kernel: as above for SSE2, with -mavx2 for AVX2, and with
+// -DWIFI_SCAN_SCALAR for the byte loop. Each build times find_delim() over a full
+// ring without a delimiter against a byte loop, checks both agree on random
+// rings, then parses the same 3 MB stream of +IPD frames on all five links and
+// prints the throughput of loop()
+
+
+#include "ESP32WROOM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(WIFI_SCAN_SCALAR) && defined(__AVX2__)
+const static char* s_kernel = "AVX2";
+#elif !defined(WIFI_SCAN_SCALAR) && defined(__SSE2__)
+const static char* s_kernel = "SSE2";
+#elif !defined(WIFI_SCAN_SCALAR) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+const static char* s_kernel = "32-bit words";
+#else
+const static char* s_kernel = "scalar";
+#endif
+
+const static size_t STREAM_SIZE = 3 << 20;
+const static size_t CHUNK_MAX = 700;
+
+static uint32_t s_seed = 7;
+
+static uint32_t random32(void)
+{
+	s_seed = s_seed * 1103515245 + 12345;
+	return s_seed >> 8;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int refFindDelim(MyRingBuffer& r, int begin, int end)
+{
+	int len = r.length();
+	if (end == -1 || end > len)
+		end = len;
+	for (int i = begin; i < end; i++)
+	{
+		uint8_t c = r.read_byte(i);
+		if (c == '\r' || c == '\n' || c == ':' || c == ',')
+			return i;
+	}
+	return -1;
+}
+
+// the stream in chunks of random size, one chunk per loop()
+class StreamSerial : public Esp32Serial
+{
+public:
+	StreamSerial(const uint8_t* data, size_t size) : m_data(data), m_size(size), m_pos(0), m_chunk(0) {}
+	void rewind(void) { m_pos = 0; m_chunk = 0; }
+	bool done(void) { return m_pos == m_size; }
+	void arrive(void)
+	{
+		if (m_chunk == 0)
+			m_chunk = 1 + random32() % CHUNK_MAX;
+		if (m_chunk > m_size - m_pos)
+			m_chunk = m_size - m_pos;
+	}
+	int available(void) { return m_chunk; }
+	int read(void)
+	{
+		uint8_t c;
+		return read(&c, 1) == 1 ? c : -1;
+	}
+	size_t read(uint8_t* buffer, size_t n)
+	{
+		size_t c = m_chunk < n ? m_chunk : n;
+		memcpy(buffer, m_data + m_pos, c);
+		m_pos += c;
+		m_chunk -= c;
+		return c;
+	}
+	size_t write(const uint8_t* buffer, size_t n) { return n; }
+
+private:
+	const uint8_t* m_data;
+	size_t m_size;
+	size_t m_pos;
+	size_t m_chunk;
+};
+
+// owns every link and counts what reaches the application
+class Sink : public IWifi
+{
+public:
+	uint64_t bytes;
+
+	Sink() : bytes(0) {}
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbSend(Esp32::ResponseType) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end) { bytes += end - begin; }
+};
+
+static long randomized(MyRingBuffer& r, int rounds)
+{
+	long bad = 0;
+	for (int i = 0; i < rounds; i++)
+	{
+		int len = random32() % (i % 10 == 0 ? r.capacity() : 100);
+		int density = 1 + random32() % 200;
+		r._iTail = r._iHead = random32() % 4 == 0 ? r._iSize - 1 - random32() % 70 : random32() % r._iSize;
+		for (int k = 0; k < len; k++)
+		{
+			r._aucBuffer[r._iHead] = random32() % density == 0 ? "\r\n:,"[random32() % 4] : random32();
+			r._iHead = (r._iHead + 1) % r._iSize;
+		}
+		int begin = random32() % (len + 2);
+		int end = random32() % 3 == 0 ? -1 : random32() % (len + 2);
+		bad += refFindDelim(r, begin, end) != r.find_delim(begin, end);
+	}
+	return bad;
+}
+
+int main(int argc, char* argv[])
+{
+	int runs = 5;
+	if (argc == 3 && strcmp(argv[1], "-n") == 0)
+		runs = atoi(argv[2]);
+	if (runs < 1 || (argc != 1 && argc != 3))
+	{
+		fprintf(stderr, "usage: %s [-n runs]\n", argv[0]);
+		return 2;
+	}
+	printf("kernel: %s\n", s_kernel);
+
+	static uint8_t memory[MyRingBuffer::BUFFER_MAX_SIZE];
+	MyRingBuffer r;
+	r.attach(memory, sizeof(memory));
+	long bad = randomized(r, 300000);
+	printf("randomized: %ld mismatches with the byte loop\n", bad);
+	for (int i = 0; i < r._iSize; i++)
+	{
+		r._aucBuffer[i] = 'A' + i % 26;
+	}
+	r._iTail = r._iSize / 2;
+	r._iHead = r._iTail - 1; // full, wrapping in the middle
+	const int N = 20000;
+	volatile long found = 0;
+	double t = seconds();
+	for (int i = 0; i < N; i++)
+	{
+		found += refFindDelim(r, 0, -1);
+	}
+	double a = seconds() - t;
+	t = seconds();
+	for (int i = 0; i < N; i++)
+	{
+		found += r.find_delim(0, -1);
+	}
+	double b = seconds() - t;
+	printf("find_delim over %d bytes: byte loop %.3f us, kernel %.3f us (%.2f GB/s), x%.1f\n",
+		r.length(), a / N * 1e6, b / N * 1e6, r.length() * (double)N / b / 1e9, a / b);
+
+	// +IPD frames of up to 2920 bytes on the five links, with a SEND OK now and then
+	static uint8_t stream[STREAM_SIZE];
+	size_t size = 0;
+	while (size + 3000 < STREAM_SIZE)
+	{
+		if (random32() % 8 == 0)
+		{
+			size += sprintf((char*)stream + size, "\r\nSEND OK\r\n");
+			continue;
+		}
+		int len = 1 + random32() % 2920;
+		size += sprintf((char*)stream + size, "\r\n+IPD,%d,%d:", (int)(random32() % Esp32::LINK_MAX), len);
+		for (int i = 0; i < len; i++)
+		{
+			stream[size++] = 'a' + random32() % 26;
+		}
+	}
+	StreamSerial serial(stream, size);
+	StreamSerial ok((const uint8_t*)"\r\nOK\r\n", 6); // to AT+CIPMUX=1
+	Esp32 esp;
+	Sink sink;
+	esp.setSerial(ok);
+	esp.setMUX(&sink, true);
+	while (!ok.done())
+	{
+		ok.arrive();
+		esp.loop();
+	}
+	esp.setSerial(serial);
+	for (int i = 0; i < Esp32::LINK_MAX; i++)
+	{
+		esp.setLinkOwner(i, &sink);
+	}
+	for (int run = 0; run < runs; run++)
+	{
+		serial.rewind();
+		esp.resetRxStats();
+		sink.bytes = 0;
+		double busy = 0;
+		while (!serial.done())
+		{
+			serial.arrive();
+			t = seconds();
+			esp.loop();
+			busy += seconds() - t;
+		}
+		const Esp32::RxStats& st = esp.getRxStats();
+		printf("run %d: %llu bytes, %u frames, %llu delivered, %llu lost, loop %.3f ms (%.1f MB/s)\n", run,
+			(unsigned long long)st.bytes_received, st.frames, (unsigned long long)sink.bytes,
+			(unsigned long long)st.bytes_lost, busy * 1e3, st.bytes_received / busy / 1e6);
+	}
+	return bad > 0;
+}
@@ -0,0 +1,224 @@
+// TLS connect latency against a module emulator on a pseudo terminal, Linux only
+//
+//   g++ -I.. -I<dir of conf_wifi.h> -o esp32tls esp32tls.cpp ../ESP32WROOM.cpp ../ESP32Serial.cpp ../ESP32Clock.cpp ../ESP32Timer.cpp ../ESP32Trace.cpp ../ESP32Arena.cpp
+//   ./esp32tls [-n rounds] [-h handshake ms]
+//
+// The emulator answers AT+CIPSTART "SSL" once the modeled handshake is over and
+// refuses it on a link that is still open, as the firmware does. Each round
+// closes link 1 and connects it again, which costs the full handshake: the
+// firmware has no session resumption, so there is no faster reconnect to
+// compare with. Latency is from SSLConnectMUX to cbSSLConnect, on the wall clock
+
+
+#include "ESP32WROOM.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// the module side of the loopback, one line at a time
+class TlsModule
+{
+public:
+	const static size_t LINE_MAX = 128;
+
+	TlsModule(TermiosSerial& serial, uint32_t handshake)
+		: m_serial(serial), m_handshake(handshake), m_lineLen(0), m_connecting(-1), m_connectAt(0)
+	{
+		memset(m_open, 0, sizeof(m_open));
+	}
+	void poll(void)
+	{
+		uint8_t c;
+		while (m_serial.read(&c, 1) == 1)
+		{
+			if (c == '\n' && m_lineLen > 0 && m_line[m_lineLen - 1] == '\r')
+			{
+				m_line[m_lineLen - 1] = 0;
+				command(m_line);
+				m_lineLen = 0;
+			}
+			else if (m_lineLen < LINE_MAX - 1)
+			{
+				m_line[m_lineLen++] = c;
+			}
+		}
+		if (m_connecting != -1 && Esp32Clock::reached(systemClock.micros(), m_connectAt))
+		{
+			m_open[m_connecting] = true;
+			answer("%d,CONNECT\r\n\r\nOK\r\n", m_connecting);
+			m_connecting = -1;
+		}
+	}
+
+private:
+	TermiosSerial& m_serial;
+	uint32_t m_handshake; // us
+	char m_line[LINE_MAX];
+	size_t m_lineLen;
+	bool m_open[Esp32::LINK_MAX];
+	int m_connecting; // link in its handshake, -1 if none
+	uint32_t m_connectAt;
+
+	void answer(const char format[], int link_id = 0)
+	{
+		char s[64];
+		int n = snprintf(s, sizeof(s), format, link_id);
+		m_serial.write((const uint8_t*)s, n);
+	}
+	void command(const char line[])
+	{
+		int link_id = 0;
+		if (sscanf(line, "AT+CIPSTART=%d,", &link_id) == 1 && link_id >= 0 && link_id < Esp32::LINK_MAX)
+		{
+			if (m_open[link_id])
+			{
+				answer("ALREADY CONNECTED\r\n\r\nERROR\r\n");
+				return;
+			}
+			m_connecting = link_id;
+			m_connectAt = systemClock.micros() + (strstr(line, "\"SSL\"") != NULL ? m_handshake : 0);
+		}
+		else if (sscanf(line, "AT+CIPCLOSE=%d", &link_id) == 1 && link_id >= 0 && link_id < Esp32::LINK_MAX)
+		{
+			m_open[link_id] = false;
+			answer("%d,CLOSED\r\n\r\nOK\r\n", link_id);
+		}
+		else if (strncmp(line, "AT", 2) == 0)
+		{
+			answer("\r\nOK\r\n");
+		}
+	}
+};
+
+// waits for the connects of the rounds
+class Client : public IWifi
+{
+public:
+	int connects;
+	Esp32::ResponseType state;
+	bool already_open;
+
+	Client() : connects(0), state(Esp32::RESPONSE_OK), already_open(false) {}
+	void cbReset(Esp32::ResponseType) {}
+	void cbSetMode(Esp32::ResponseType) {}
+	void cbSetSoftAP(Esp32::ResponseType) {}
+	void cbAutoConnAP(Esp32::ResponseType) {}
+	void cbScanAP(Esp32::ResponseType, bool) {}
+	void cbConnectAP(Esp32::ResponseType) {}
+	void cbGetIP(Esp32::ResponseType, uint32_t AP_IP, uint32_t STA_IP) {}
+	void cbGetAPIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetSTAIP(Esp32::ResponseType, uint32_t ip, uint32_t mask) {}
+	void cbGetNetStatus(Esp32::ResponseType, int link_id) {}
+	void cbSetMUX(Esp32::ResponseType) {}
+	void cbUDPConnect(Esp32::ResponseType) {}
+	void cbDomainResolution(Esp32::ResponseType, uint32_t ip) {}
+	void cbDisconnectAP(void) {}
+	void cbReceivedData(int link_id, MyRingBuffer& buffer, int begin, int end) {}
+	void cbSend(Esp32::ResponseType) {}
+	void cbSSLConnect(Esp32::ResponseType state, int link_id, bool already_open)
+	{
+		connects++;
+		this->state = state;
+		this->already_open = already_open;
+	}
+};
+
+typedef struct _LATENCY {
+	uint32_t count;
+	uint32_t failures; // already_open counts as one, the round did not close the link
+	uint64_t sum; // us
+	uint32_t max;
+} Latency;
+
+static void run(Esp32& esp, TlsModule& module)
+{
+	esp.loop();
+	module.poll();
+	usleep(100);
+}
+
+// the driver is idle when called
+static void connect(Esp32& esp, TlsModule& module, Client& client, Latency& latency)
+{
+	int connects = client.connects;
+	uint32_t t = systemClock.micros();
+	if (!esp.SSLConnectMUX(&client, 1, 0x0a000001, 443))
+	{
+		latency.failures++;
+		return;
+	}
+	while (client.connects == connects)
+	{
+		run(esp, module);
+	}
+	uint32_t us = Esp32Clock::elapsed(systemClock.micros(), t);
+	if (client.state != Esp32::RESPONSE_OK || client.already_open)
+	{
+		latency.failures++;
+		return;
+	}
+	latency.count++;
+	latency.sum += us;
+	if (us > latency.max)
+		latency.max = us;
+	while (esp.isBusy())
+	{
+		run(esp, module);
+	}
+}
+
+static void report(const char name[], const Latency& latency)
+{
+	printf("%-16s %u connects, %u failed, avg %.3f ms, max %.3f ms\n", name,
+		latency.count, latency.failures,
+		latency.count > 0 ? latency.sum / 1e3 / latency.count : 0.0, latency.max / 1e3);
+}
+
+int main(int argc, char* argv[])
+{
+	int rounds = 5;
+	int handshake = 1500;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-n") == 0)
+			rounds = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-h") == 0)
+			handshake = atoi(argv[i + 1]);
+	}
+	if (rounds < 1 || handshake < 0 || argc % 2 == 0)
+	{
+		fprintf(stderr, "usage: %s [-n rounds] [-h handshake ms]\n", argv[0]);
+		return 2;
+	}
+	PtyLoopback pty;
+	if (!pty.open())
+	{
+		fprintf(stderr, "no pseudo terminal\n");
+		return 1;
+	}
+	TlsModule module(pty.module(), handshake * 1000);
+	Esp32 esp;
+	Client client;
+	esp.setSerial(pty.device());
+	esp.setMUX(&client, true);
+	while (esp.isBusy())
+	{
+		run(esp, module);
+	}
+	Latency full;
+	memset(&full, 0, sizeof(full));
+	for (int i = 0; i < rounds; i++)
+	{
+		if (esp.isConnected(1) && esp.closeConnect(&client, 1))
+		{
+			while (esp.isBusy())
+			{
+				run(esp, module);
+			}
+		}
+		connect(esp, module, client, full);
+	}
+	report("full handshake", full);
+	return full.failures;
+}
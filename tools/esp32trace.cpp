@@ -0,0 +1,109 @@
+// Decoder for traces saved by Esp32Trace::save(), runs on the host
+//
+//   g++ -I.. -o esp32trace esp32trace.cpp
+//   ./esp32trace trace.bin
+//
+// prints one event per line: time in us, time since the previous event, event and arguments
+
+
+#include "ESP32Trace.h"
+#include <stdio.h>
+#include <string.h>
+
+// in the order of Esp32::CMDType
+static const char* const s_cmds[] = {
+	"NONE", "RESET", "RECOVERY", "SETMODE", "SETSOFTAP", "CONNECTAP", "CONFIGSCANAP", "SCANAP",
+	"AUTOCONN", "GETIP", "GETAPIP", "GETSTAIP", "GETNETSTATUS", "SETMUX", "TCPSERVER", "TCPSERVER_STOP",
+	"TCPCONNECT", "UDPCONNECT", "SENDBYTES", "SENDSTRING", "DOSEND", "CLOSECONNECT", "DOMAIN", "SSLCONNECT",
+	"SSLCONFIG", "SERVERCONFIG", "GETMODE", "GETMUX", "GETAP"
+};
+// in the order of Esp32::ResponseType
+static const char* const s_responses[] = {
+	"OK", "TIMEOUT", "BUSY", "CONNECTAP_FAIL", "DOMAIN_FAIL", "SEND_READY", "SEND_ERROR", "SEND_FAILED", "UNKNOWN_ERROR"
+};
+
+static const char* cmdName(uint8_t cmd)
+{
+	return cmd < sizeof(s_cmds) / sizeof(s_cmds[0]) ? s_cmds[cmd] : "?";
+}
+
+static const char* responseName(uint16_t response)
+{
+	return response < sizeof(s_responses) / sizeof(s_responses[0]) ? s_responses[response] : "?";
+}
+
+static void print(const Esp32Trace::TraceEvent& e, uint32_t delta)
+{
+	printf("%10u %+9d  ", e.time, (int)delta);
+	switch (e.type)
+	{
+	case Esp32Trace::TRACE_CMD:
+		printf("cmd      %s, %u bytes\n", cmdName(e.arg), e.value);
+		break;
+	case Esp32Trace::TRACE_RETRY:
+		printf("retry    %s, attempt %u\n", cmdName(e.arg), e.value);
+		break;
+	case Esp32Trace::TRACE_PROMPT:
+		printf("prompt   link %u, %u bytes out\n", e.arg, e.value);
+		break;
+	case Esp32Trace::TRACE_RX:
+		printf("rx       %u bytes\n", e.value);
+		break;
+	case Esp32Trace::TRACE_OVERFLOW:
+		printf("overflow %u bytes lost\n", e.value);
+		break;
+	case Esp32Trace::TRACE_DATA:
+		printf("data     link %u, %u bytes\n", e.arg, e.value);
+		break;
+	case Esp32Trace::TRACE_END:
+		printf("end      %s, %u ms\n", cmdName(e.arg), e.value);
+		break;
+	case Esp32Trace::TRACE_RESPONSE:
+		printf("response %s, %s\n", cmdName(e.arg), responseName(e.value));
+		break;
+	case Esp32Trace::TRACE_LINK:
+		printf("link     %u %s\n", e.arg, e.value ? "connected" : "closed");
+		break;
+	default:
+		printf("unknown  type %u arg %u value %u\n", e.type, e.arg, e.value);
+		break;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+		return 2;
+	}
+	FILE* f = fopen(argv[1], "rb");
+	if (f == NULL)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	Esp32Trace::TraceHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "E32T", 4) != 0)
+	{
+		fprintf(stderr, "%s: not a trace\n", argv[1]);
+		fclose(f);
+		return 1;
+	}
+	if (header.version != Esp32Trace::VERSION || header.event_size != sizeof(Esp32Trace::TraceEvent))
+	{
+		fprintf(stderr, "%s: version %u with %u byte events is not supported\n", argv[1], header.version, header.event_size);
+		fclose(f);
+		return 1;
+	}
+	printf("%u events recorded, %u kept\n", header.recorded, header.count);
+	Esp32Trace::TraceEvent e;
+	uint32_t last = 0;
+	for (uint32_t i = 0; i < header.count && fread(&e, sizeof(e), 1, f) == 1; i++)
+	{
+		print(e, i == 0 ? 0 : e.time - last);
+		last = e.time;
+	}
+	fclose(f);
+	return 0;
+}